@@ -1834,6 +1834,7 @@ struct Treefile final : public ::rust::Opaque
   bool get_boot_location_is_modules () const noexcept;
   bool use_kernel_install () const noexcept;
   bool get_ima () const noexcept;
+  bool get_parallel_post_scripts () const noexcept;
   ::rust::String get_releasever () const noexcept;
   ::rpmostreecxx::RepoMetadataTarget get_repo_metadata_target () const noexcept;
   ::rpmostreecxx::AdvisoriesMetadataTarget get_advisories_metadata_target () const noexcept;
@@ -2704,6 +2705,9 @@ extern "C"
 
   bool rpmostreecxx$cxxbridge1$Treefile$get_ima (::rpmostreecxx::Treefile const &self) noexcept;
 
+  bool rpmostreecxx$cxxbridge1$Treefile$get_parallel_post_scripts (
+      ::rpmostreecxx::Treefile const &self) noexcept;
+
   void rpmostreecxx$cxxbridge1$Treefile$get_releasever (::rpmostreecxx::Treefile const &self,
                                                         ::rust::String *return$) noexcept;
 
@@ -5326,6 +5330,12 @@ Treefile::get_ima () const noexcept
   return rpmostreecxx$cxxbridge1$Treefile$get_ima (*this);
 }
 
+bool
+Treefile::get_parallel_post_scripts () const noexcept
+{
+  return rpmostreecxx$cxxbridge1$Treefile$get_parallel_post_scripts (*this);
+}
+
 ::rust::String
 Treefile::get_releasever () const noexcept
 {
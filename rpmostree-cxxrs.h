@@ -1611,6 +1611,7 @@ struct Treefile final : public ::rust::Opaque
   bool get_boot_location_is_modules () const noexcept;
   bool use_kernel_install () const noexcept;
   bool get_ima () const noexcept;
+  bool get_parallel_post_scripts () const noexcept;
   ::rust::String get_releasever () const noexcept;
   ::rpmostreecxx::RepoMetadataTarget get_repo_metadata_target () const noexcept;
   ::rpmostreecxx::AdvisoriesMetadataTarget get_advisories_metadata_target () const noexcept;
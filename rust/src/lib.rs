@@ -645,6 +645,7 @@ pub mod ffi {
         fn get_boot_location_is_modules(&self) -> bool;
         fn use_kernel_install(&self) -> bool;
         fn get_ima(&self) -> bool;
+        fn get_parallel_post_scripts(&self) -> bool;
         fn get_releasever(&self) -> String;
         fn get_repo_metadata_target(&self) -> RepoMetadataTarget;
         fn get_advisories_metadata_target(&self) -> AdvisoriesMetadataTarget;
@@ -464,6 +464,7 @@ fn treefile_merge(dest: &mut TreeComposeConfig, src: &mut TreeComposeConfig) {
         container,
         recommends,
         readonly_executables,
+        parallel_post_scripts,
         container_cmd,
         documentation,
         boot_location,
@@ -1398,6 +1399,10 @@ impl Treefile {
         self.parsed.base.ima.unwrap_or(false)
     }
 
+    pub(crate) fn get_parallel_post_scripts(&self) -> bool {
+        self.parsed.base.parallel_post_scripts.unwrap_or(false)
+    }
+
     pub(crate) fn set_releasever(&mut self, releasever: &str) -> Result<()> {
         self.parsed.base.releasever = Some(ReleaseVer::String(releasever.into()));
         Ok(())
@@ -1585,6 +1590,10 @@ impl Treefile {
     /// Given a treefile, print notices about items which are experimental.
     pub(crate) fn print_experimental_notices(&self) {
         print_experimental_notice(self.parsed.base.lockfile_repos.is_some(), "lockfile-repos");
+        print_experimental_notice(
+            self.parsed.base.parallel_post_scripts.is_some(),
+            "parallel-post-scripts",
+        );
     }
 
     pub(crate) fn get_checksum(&self, repo: &crate::ffi::OstreeRepo) -> CxxResult<String> {
@@ -2610,6 +2619,8 @@ pub(crate) struct BaseComposeConfigFields {
     pub(crate) initramfs_args: Option<Vec<String>>,
     #[serde(skip_serializing_if = "Option::is_none")]
     pub(crate) readonly_executables: Option<bool>,
+    #[serde(skip_serializing_if = "Option::is_none")]
+    pub(crate) parallel_post_scripts: Option<bool>,
 
     // Tree layout options
     #[serde(skip_serializing_if = "Option::is_none")]
@@ -81,6 +81,7 @@ static gboolean opt_no_parent;
 static char *opt_write_lockfile_to;
 static char **opt_lockfiles;
 static gboolean opt_lockfile_strict;
+static gboolean opt_import_stats;
 static char *opt_parent;
 
 static char *opt_extensions_output_dir;
@@ -142,6 +143,8 @@ static GOptionEntry install_option_entries[]
           "FILE" },
         { "ex-lockfile-strict", 0, 0, G_OPTION_ARG_NONE, &opt_lockfile_strict,
           "With --ex-lockfile, only allow installing locked packages", NULL },
+        { "ex-import-stats", 0, 0, G_OPTION_ARG_NONE, &opt_import_stats,
+          "Print per-package throughput and read syscalls when importing RPMs", NULL },
         { NULL } };
 
 static GOptionEntry postprocess_option_entries[] = { { NULL } };
@@ -250,6 +253,78 @@ inputhash_from_commit (OstreeRepo *repo, const char *sha256,
   return TRUE;
 }
 
+/* Print how the resolved package set differs from the one in the rpmdb of the
+ * previous commit.  This is the delta an incremental compose would need to
+ * apply on top of the previous tree.
+ */
+static gboolean
+print_package_delta (RpmOstreeTreeComposeContext *self, GCancellable *cancellable,
+                     GError **error)
+{
+  g_autoptr (GVariant) commit_v = NULL;
+  if (!ostree_repo_load_variant (self->repo, OSTREE_OBJECT_TYPE_COMMIT, self->previous_checksum,
+                                 &commit_v, error))
+    return FALSE;
+
+  /* Compose commits don't carry the pkglist metadata that client-side
+   * deployments have, so usually we need to look at the rpmdb itself. */
+  g_autoptr (GVariant) commit_metadata = g_variant_get_child_value (commit_v, 0);
+  g_autoptr (GVariant) pkglist = g_variant_lookup_value (
+      commit_metadata, "rpmostree.rpmdb.pkglist", G_VARIANT_TYPE ("a(sssss)"));
+  if (!pkglist)
+    {
+      g_autoptr (RpmOstreeRefSack) rsack
+          = rpmostree_get_refsack_for_commit (self->repo, self->previous_checksum, cancellable,
+                                              error);
+      if (!rsack)
+        return glnx_prefix_error (error, "Loading rpmdb of previous commit");
+      pkglist = rpmostree_variant_pkgs_from_sack (rsack);
+    }
+
+  /* name.arch --> evr, in the same format as dnf_package_get_evr() */
+  g_autoptr (GHashTable) previous = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  const guint n = g_variant_n_children (pkglist);
+  for (guint i = 0; i < n; i++)
+    {
+      const char *name, *epoch, *version, *release, *arch;
+      g_variant_get_child (pkglist, i, "(&s&s&s&s&s)", &name, &epoch, &version, &release, &arch);
+      char *evr = g_str_equal (epoch, "0") ? g_strdup_printf ("%s-%s", version, release)
+                                           : g_strdup_printf ("%s:%s-%s", epoch, version, release);
+      g_hash_table_insert (previous, g_strconcat (name, ".", arch, NULL), evr);
+    }
+
+  DnfSack *sack = dnf_context_get_sack (rpmostree_context_get_dnf (self->corectx));
+  g_autoptr (GPtrArray) pkgs = rpmostree_context_get_packages (self->corectx);
+  guint n_upgraded = 0, n_downgraded = 0, n_added = 0;
+  for (guint i = 0; i < pkgs->len; i++)
+    {
+      auto pkg = static_cast<DnfPackage *> (pkgs->pdata[i]);
+      g_autofree char *key
+          = g_strconcat (dnf_package_get_name (pkg), ".", dnf_package_get_arch (pkg), NULL);
+      auto previous_evr = static_cast<const char *> (g_hash_table_lookup (previous, key));
+      if (!previous_evr)
+        n_added++;
+      else
+        {
+          int cmp = dnf_sack_evr_cmp (sack, dnf_package_get_evr (pkg), previous_evr);
+          if (cmp > 0)
+            n_upgraded++;
+          else if (cmp < 0)
+            n_downgraded++;
+          g_hash_table_remove (previous, key);
+        }
+    }
+  const guint n_removed = g_hash_table_size (previous);
+
+  g_autofree char *summary
+      = rpmostree_generate_diff_summary (n_upgraded, n_downgraded, n_removed, n_added);
+  if (*summary)
+    g_print ("Package changes since previous commit: %s\n", summary);
+  else
+    g_print ("No package changes since previous commit\n");
+  return TRUE;
+}
+
 static gboolean
 try_load_previous_sepolicy (RpmOstreeTreeComposeContext *self, GCancellable *cancellable,
                             GError **error)
@@ -481,24 +556,33 @@ install_packages (RpmOstreeTreeComposeContext *self, gboolean *out_unmodified,
         g_print ("Previous commit found, but without rpmostree.inputhash metadata key\n");
     }
 
+  if (self->previous_checksum)
+    {
+      if (!print_package_delta (self, cancellable, error))
+        return FALSE;
+    }
+
   if (opt_dry_run)
     return TRUE; /* NB: early return */
 
   CXX_TRY ((*self->treefile_rs)->sanitycheck_externals (), error);
 
   /* --- Downloading packages --- */
-  if (!rpmostree_context_download (self->corectx, cancellable, error))
-    return FALSE;
-
-  if (opt_download_only || opt_download_only_rpms)
+  /* In unified core mode, packages are imported into the pkgcache as they
+   * finish downloading rather than after everything has been fetched. */
+  if (opt_unified_core && !opt_download_only_rpms)
     {
-      if (opt_unified_core && !opt_download_only_rpms)
-        {
-          if (!rpmostree_context_import (self->corectx, cancellable, error))
-            return FALSE;
-        }
-      return TRUE; /* 🔚 Early return */
+      if (!rpmostree_context_download_and_import (self->corectx, cancellable, error))
+        return FALSE;
     }
+  else
+    {
+      if (!rpmostree_context_download (self->corectx, cancellable, error))
+        return FALSE;
+    }
+
+  if (opt_download_only || opt_download_only_rpms)
+    return TRUE; /* 🔚 Early return */
 
   /* Before we install packages, inject /etc/{passwd,group} if configured. */
   g_assert (self->repo);
@@ -509,8 +593,6 @@ install_packages (RpmOstreeTreeComposeContext *self, gboolean *out_unmodified,
 
   if (opt_unified_core)
     {
-      if (!rpmostree_context_import (self->corectx, cancellable, error))
-        return FALSE;
       rpmostree_context_set_tmprootfs_dfd (self->corectx, rootfs_dfd);
       if (!rpmostree_context_assemble (self->corectx, cancellable, error))
         return FALSE;
@@ -791,6 +873,7 @@ rpm_ostree_compose_context_new (const char *treefile_pathstr, const char *basear
 
   self->corectx
       = rpmostree_context_new_compose (dnf_cachedir_dfd, self->build_repo, **self->treefile_rs);
+  rpmostree_context_set_import_stats (self->corectx, opt_import_stats);
 
   /* In the legacy compose path, we don't want to use any of the core's selinux stuff,
    * e.g. importing, relabeling, etc... so just disable it. We do still set the policy
@@ -1153,10 +1236,174 @@ noninteractive_console_progress_changed (OstreeAsyncProgress *progress, gpointer
   /* We do nothing here - we just want the final status */
 }
 
+/* Shared by the link_objects_in_thread() workers */
+typedef struct
+{
+  OstreeRepo *src_repo;
+  OstreeRepo *dest_repo;
+  GPtrArray *objects; /* Serialized object names */
+  guint n_workers;
+  guint n_running;
+  gint failed;     /* Atomic; lets the other workers stop early */
+  gint n_imported; /* Atomic */
+  GError *error;
+} LinkObjectsData;
+
+typedef struct
+{
+  LinkObjectsData *data;
+  guint worker;
+} LinkObjectsTaskData;
+
+static gboolean
+link_objects_worker (LinkObjectsData *data, guint worker, GCancellable *cancellable,
+                     GError **error)
+{
+  for (guint i = worker; i < data->objects->len; i += data->n_workers)
+    {
+      if (g_atomic_int_get (&data->failed))
+        return TRUE;
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        return FALSE;
+
+      const char *checksum = NULL;
+      OstreeObjectType objtype;
+      ostree_object_name_deserialize (static_cast<GVariant *> (data->objects->pdata[i]),
+                                      &checksum, &objtype);
+
+      gboolean have = FALSE;
+      if (!ostree_repo_has_object (data->dest_repo, objtype, checksum, &have, cancellable, error))
+        return FALSE;
+      if (have)
+        continue;
+
+      /* Trusted, so this is a hardlink (or a reflink copy) of the object */
+      if (!ostree_repo_import_object_from_with_trust (data->dest_repo, data->src_repo, objtype,
+                                                      checksum, TRUE, cancellable, error))
+        return glnx_prefix_error (error, "Importing %s.%s", checksum,
+                                  ostree_object_type_to_string (objtype));
+      g_atomic_int_inc (&data->n_imported);
+    }
+  return TRUE;
+}
+
+static void
+link_objects_in_thread (GTask *task, gpointer source, gpointer task_data,
+                        GCancellable *cancellable)
+{
+  auto tdata = static_cast<LinkObjectsTaskData *> (task_data);
+  g_autoptr (GError) local_error = NULL;
+  if (!link_objects_worker (tdata->data, tdata->worker, cancellable, &local_error))
+    {
+      g_atomic_int_set (&tdata->data->failed, TRUE);
+      g_task_return_error (task, util::move_nullify (local_error));
+    }
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+static void
+on_link_objects_done (GObject *object, GAsyncResult *result, gpointer user_data)
+{
+  auto data = static_cast<LinkObjectsData *> (user_data);
+  g_autoptr (GError) local_error = NULL;
+  if (!g_task_propagate_boolean (G_TASK (result), &local_error) && !data->error)
+    data->error = util::move_nullify (local_error);
+  data->n_running--;
+}
+
+/* A faster pull-local for the case where @src_repo and @dest_repo have the
+ * same mode and live on the same filesystem: the objects can be linked over
+ * as is, so there's no need to go through the full pull machinery and its
+ * checksum verification.  We import everything but the commit object in
+ * parallel, and the commit (and its detached metadata) last, so an
+ * interrupted import never leaves what looks like a complete commit.
+ */
+static gboolean
+link_commit_into_target_repo (OstreeRepo *src_repo, OstreeRepo *dest_repo, const char *checksum,
+                              GCancellable *cancellable, GError **error)
+{
+  g_autoptr (GHashTable) reachable = NULL;
+  if (!ostree_repo_traverse_commit (src_repo, checksum, 0, &reachable, cancellable, error))
+    return FALSE;
+
+  g_autoptr (GPtrArray) objects = g_ptr_array_new ();
+  GLNX_HASH_TABLE_FOREACH (reachable, GVariant *, object)
+    {
+      const char *object_checksum = NULL;
+      OstreeObjectType objtype;
+      ostree_object_name_deserialize (object, &object_checksum, &objtype);
+      if (objtype != OSTREE_OBJECT_TYPE_COMMIT)
+        g_ptr_array_add (objects, object);
+    }
+
+  if (!ostree_repo_prepare_transaction (dest_repo, NULL, cancellable, error))
+    return FALSE;
+
+  LinkObjectsData data = {
+    src_repo, dest_repo, objects, MIN (g_get_num_processors (), 8u), 0, FALSE, 0, NULL,
+  };
+  for (guint i = 0; i < data.n_workers; i++)
+    {
+      auto tdata = g_new0 (LinkObjectsTaskData, 1);
+      tdata->data = &data;
+      tdata->worker = i;
+      g_autoptr (GTask) task = g_task_new (NULL, cancellable, on_link_objects_done, &data);
+      g_task_set_task_data (task, tdata, g_free);
+      g_task_run_in_thread (task, link_objects_in_thread);
+      data.n_running++;
+    }
+  /* Wait for all of them, even on error; they borrow @data */
+  GMainContext *mainctx = g_main_context_get_thread_default ();
+  while (data.n_running > 0)
+    g_main_context_iteration (mainctx, TRUE);
+
+  if (data.error)
+    {
+      (void)ostree_repo_abort_transaction (dest_repo, NULL, NULL);
+      g_propagate_error (error, data.error);
+      return FALSE;
+    }
+
+  g_autoptr (GVariant) detached_meta = NULL;
+  if (!ostree_repo_import_object_from_with_trust (dest_repo, src_repo, OSTREE_OBJECT_TYPE_COMMIT,
+                                                  checksum, TRUE, cancellable, error)
+      || !ostree_repo_read_commit_detached_metadata (src_repo, checksum, &detached_meta,
+                                                     cancellable, error)
+      || (detached_meta
+          && !ostree_repo_write_commit_detached_metadata (dest_repo, checksum, detached_meta,
+                                                          cancellable, error))
+      || !ostree_repo_commit_transaction (dest_repo, NULL, cancellable, error))
+    {
+      (void)ostree_repo_abort_transaction (dest_repo, NULL, NULL);
+      return FALSE;
+    }
+
+  g_print ("Linked %u/%u objects into target repo\n", (guint)g_atomic_int_get (&data.n_imported),
+           objects->len);
+  return TRUE;
+}
+
 static gboolean
 pull_local_into_target_repo (OstreeRepo *src_repo, OstreeRepo *dest_repo, const char *checksum,
                              GCancellable *cancellable, GError **error)
 {
+  /* See if we can just link the objects over */
+  if (ostree_repo_get_mode (src_repo) == ostree_repo_get_mode (dest_repo)
+      && !g_getenv ("RPMOSTREE_COMPOSE_FULL_PULL_LOCAL"))
+    {
+      struct stat src_stbuf, dest_stbuf;
+      if (!glnx_fstat (ostree_repo_get_dfd (src_repo), &src_stbuf, error)
+          || !glnx_fstat (ostree_repo_get_dfd (dest_repo), &dest_stbuf, error))
+        return FALSE;
+      if (src_stbuf.st_dev == dest_stbuf.st_dev)
+        {
+          if (!link_commit_into_target_repo (src_repo, dest_repo, checksum, cancellable, error))
+            return glnx_prefix_error (error, "Failed to link %s into target repo", checksum);
+          return TRUE;
+        }
+    }
+
   const char *refs[] = { checksum, NULL };
 
   /* really should enhance the pull API so we can just pass the src OstreeRepo directly */
@@ -1281,9 +1528,21 @@ impl_commit_tree (RpmOstreeTreeComposeContext *self, GCancellable *cancellable,
     else
       selinux_mode = RPMOSTREE_SELINUX_MODE_DISABLED;
   }
+  /* The devino cache only lives for this compose; this index lets the next
+   * one on this builder skip checksumming the same pkgcache files again.
+   */
+  g_autoptr (RpmOstreeDevinoIndex) devino_index = NULL;
+  if (self->devino_cache)
+    {
+      devino_index = rpmostree_devino_index_load (self->pkgcache_repo, self->build_repo,
+                                                  cancellable, error);
+      if (!devino_index)
+        return FALSE;
+    }
   if (!rpmostree_compose_commit (self->rootfs_dfd, self->build_repo, parent_revision, metadata,
                                  detached_metadata, gpgkey_c, container, selinux_mode,
-                                 self->devino_cache, &new_revision, cancellable, error))
+                                 self->devino_cache, devino_index, &new_revision, cancellable,
+                                 error))
     return glnx_prefix_error (error, "Writing commit");
   g_assert (new_revision != NULL);
 
@@ -1300,6 +1559,15 @@ impl_commit_tree (RpmOstreeTreeComposeContext *self, GCancellable *cancellable,
       rpmostreecxx::print_ostree_txn_stats (stats);
     }
 
+  if (devino_index)
+    {
+      const guint n_hits = rpmostree_devino_index_get_n_hits (devino_index);
+      if (n_hits > 0)
+        g_print ("Reused checksums for %u pkgcache files\n", n_hits);
+      if (!rpmostree_devino_index_save (devino_index, cancellable, error))
+        return FALSE;
+    }
+
   if (!opt_unified_core)
     g_assert (self->repo == self->build_repo);
   else
@@ -1609,6 +1877,124 @@ rpmostree_compose_builtin_tree (int argc, char **argv, RpmOstreeCommandInvocatio
   return TRUE;
 }
 
+/* Whether @name in @dfd is @pkg, going by the size and the checksum in the
+ * repodata.
+ */
+static gboolean
+extension_matches_repodata (DnfPackage *pkg, int dfd, const char *name, const struct stat *stbuf,
+                            gboolean *out_matches, GCancellable *cancellable, GError **error)
+{
+  *out_matches = FALSE;
+  if (!S_ISREG (stbuf->st_mode) || (guint64)stbuf->st_size != dnf_package_get_downloadsize (pkg))
+    return TRUE;
+
+  CXX_TRY_VAR (chksum_repr, rpmostreecxx::get_repodata_chksum_repr (*pkg), error);
+  std::string expected (chksum_repr.data (), chksum_repr.size ());
+  GChecksumType checksum_type;
+  if (g_str_has_prefix (expected.c_str (), "sha256:"))
+    checksum_type = G_CHECKSUM_SHA256;
+  else if (g_str_has_prefix (expected.c_str (), "sha512:"))
+    checksum_type = G_CHECKSUM_SHA512;
+  else
+    return TRUE; /* Not worth supporting anything older */
+
+  g_autoptr (GChecksum) checksum = g_checksum_new (checksum_type);
+  if (!_rpmostree_util_update_checksum_from_file (checksum, dfd, name, cancellable, error))
+    return FALSE;
+  const char *actual = g_checksum_get_string (checksum);
+  *out_matches = g_str_equal (actual, strchr (expected.c_str (), ':') + 1);
+  return TRUE;
+}
+
+/* If @pkg is already in @output_dfd from a previous run, and still matches the
+ * checksum in the repodata, link it into the dnf cache so it doesn't need to
+ * be downloaded again.
+ */
+static gboolean
+reuse_extension_from_output_dir (DnfPackage *pkg, int output_dfd, gboolean *out_reused,
+                                 GCancellable *cancellable, GError **error)
+{
+  *out_reused = FALSE;
+  const char *dest = dnf_package_get_filename (pkg);
+  const char *basename = glnx_basename (dest);
+
+  struct stat stbuf;
+  if (!glnx_fstatat_allow_noent (output_dfd, basename, &stbuf, 0, error))
+    return FALSE;
+  if (errno == ENOENT)
+    return TRUE;
+  gboolean matches = FALSE;
+  if (!extension_matches_repodata (pkg, output_dfd, basename, &stbuf, &matches, cancellable,
+                                   error))
+    return FALSE;
+  if (!matches)
+    return TRUE;
+
+  g_autofree char *dest_dir = g_path_get_dirname (dest);
+  if (!glnx_shutil_mkdir_p_at (AT_FDCWD, dest_dir, 0755, cancellable, error))
+    return FALSE;
+  if (linkat (output_dfd, basename, AT_FDCWD, dest, 0) < 0)
+    {
+      /* Just download it again */
+      if (G_IN_SET (errno, EXDEV, EPERM, EMLINK))
+        return TRUE;
+      return glnx_throw_errno_prefix (error, "linkat(%s)", basename);
+    }
+
+  *out_reused = TRUE;
+  return TRUE;
+}
+
+/* Hardlink the downloaded @pkg into @output_dfd, falling back to a copy.  If
+ * there's already an identical file there, it's left alone; anything else by
+ * that name is replaced.
+ */
+static gboolean
+link_extension_into_output_dir (DnfPackage *pkg, int output_dfd, GCancellable *cancellable,
+                                GError **error)
+{
+  const char *src = dnf_package_get_filename (pkg);
+  const char *basename = glnx_basename (src);
+
+  struct stat src_stbuf, dest_stbuf;
+  if (!glnx_fstatat (AT_FDCWD, src, &src_stbuf, 0, error))
+    return FALSE;
+  if (!glnx_fstatat_allow_noent (output_dfd, basename, &dest_stbuf, 0, error))
+    return FALSE;
+  if (errno == 0)
+    {
+      /* Reused from the previous run */
+      if (src_stbuf.st_dev == dest_stbuf.st_dev && src_stbuf.st_ino == dest_stbuf.st_ino)
+        return TRUE;
+      /* Or a copy of it, e.g. from another filesystem */
+      gboolean matches = FALSE;
+      if (!extension_matches_repodata (pkg, output_dfd, basename, &dest_stbuf, &matches,
+                                       cancellable, error))
+        return FALSE;
+      if (matches)
+        return TRUE;
+    }
+
+  /* Link to a temporary name and rename over, so we replace whatever's there */
+  g_autofree char *tmpname = g_strdup_printf (".%s.XXXXXX", basename);
+  glnx_gen_temp_name (tmpname);
+  if (linkat (AT_FDCWD, src, output_dfd, tmpname, 0) == 0)
+    {
+      if (!glnx_renameat (output_dfd, tmpname, output_dfd, basename, error))
+        {
+          (void)unlinkat (output_dfd, tmpname, 0);
+          return FALSE;
+        }
+      return TRUE;
+    }
+  if (!G_IN_SET (errno, EXDEV, EPERM, EMLINK))
+    return glnx_throw_errno_prefix (error, "linkat(%s)", basename);
+
+  GLnxFileCopyFlags flags = static_cast<GLnxFileCopyFlags> (
+      GLNX_FILE_COPY_OVERWRITE | GLNX_FILE_COPY_NOXATTRS | GLNX_FILE_COPY_NOCHOWN);
+  return glnx_file_copy_at (AT_FDCWD, src, NULL, output_dfd, basename, flags, cancellable, error);
+}
+
 gboolean
 rpmostree_compose_builtin_extensions (int argc, char **argv, RpmOstreeCommandInvocation *invocation,
                                       GCancellable *cancellable, GError **error)
@@ -1812,22 +2198,6 @@ rpmostree_compose_builtin_extensions (int argc, char **argv, RpmOstreeCommandInv
       return TRUE;
     }
 
-  if (!rpmostree_context_download (ctx, cancellable, error))
-    return FALSE;
-
-  g_autoptr (GPtrArray) extensions_pkgs = rpmostree_context_get_packages (ctx);
-  for (guint i = 0; i < extensions_pkgs->len; i++)
-    {
-      DnfPackage *pkg = (DnfPackage *)extensions_pkgs->pdata[i];
-      const char *src = dnf_package_get_filename (pkg);
-      const char *basename = glnx_basename (src);
-      GLnxFileCopyFlags flags
-          = static_cast<GLnxFileCopyFlags> (GLNX_FILE_COPY_NOXATTRS | GLNX_FILE_COPY_NOCHOWN);
-      if (!glnx_file_copy_at (AT_FDCWD, dnf_package_get_filename (pkg), NULL, output_dfd, basename,
-                              flags, cancellable, error))
-        return FALSE;
-    }
-
   /* This is hacky: for "development" extensions, we don't want any depsolving
    * against the base OS. Rather than awkwardly teach the core about this, we
    * just reuse its sack and keep all the functionality here. */
@@ -1839,30 +2209,66 @@ rpmostree_compose_builtin_extensions (int argc, char **argv, RpmOstreeCommandInv
   dnf_sack_repo_enabled (sack, HY_SYSTEM_REPO_NAME, 0);
 
   auto pkgs = extensions->get_development_packages ();
-  g_autoptr (GPtrArray) devel_pkgs_to_download = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr (GPtrArray) devel_pkgs = g_ptr_array_new_with_free_func (g_object_unref);
   for (auto &pkg : pkgs)
     {
       g_autoptr (GPtrArray) matches = rpmostree_get_matching_packages (sack, pkg.c_str ());
       if (matches->len == 0)
         return glnx_throw (error, "Package %s not found", pkg.c_str ());
       DnfPackage *found_pkg = (DnfPackage *)matches->pdata[0];
-      g_ptr_array_add (devel_pkgs_to_download, g_object_ref (found_pkg));
+      g_ptr_array_add (devel_pkgs, g_object_ref (found_pkg));
     }
 
-  rpmostree_set_repos_on_packages (dnfctx, devel_pkgs_to_download);
+  rpmostree_set_repos_on_packages (dnfctx, devel_pkgs);
 
-  if (!rpmostree_download_packages (devel_pkgs_to_download, cancellable, error))
-    return FALSE;
+  /* Download the OS and development extensions together, so that each repo is
+   * only fetched from once.  Anything we already output last time and which
+   * hasn't changed is reused instead.
+   */
+  g_autoptr (GPtrArray) os_pkgs = rpmostree_context_get_packages (ctx);
+  g_autoptr (GPtrArray) extensions_pkgs = g_ptr_array_new ();
+  for (guint i = 0; i < os_pkgs->len; i++)
+    g_ptr_array_add (extensions_pkgs, os_pkgs->pdata[i]);
+  for (guint i = 0; i < devel_pkgs->len; i++)
+    g_ptr_array_add (extensions_pkgs, devel_pkgs->pdata[i]);
+  g_autoptr (GPtrArray) pkgs_to_download = g_ptr_array_new ();
+  g_autoptr (GHashTable) seen = g_hash_table_new (g_str_hash, g_str_equal);
+  guint n_reused = 0;
+  for (guint i = 0; i < extensions_pkgs->len; i++)
+    {
+      DnfPackage *pkg = (DnfPackage *)extensions_pkgs->pdata[i];
+      const char *filename = dnf_package_get_filename (pkg);
+      if (!g_hash_table_add (seen, (gpointer)filename))
+        continue;
+      if (rpmostree_pkg_is_local (pkg) || g_file_test (filename, G_FILE_TEST_EXISTS))
+        continue;
+
+      gboolean reused = FALSE;
+      if (!reuse_extension_from_output_dir (pkg, output_dfd, &reused, cancellable, error))
+        return FALSE;
+      if (reused)
+        n_reused++;
+      else
+        g_ptr_array_add (pkgs_to_download, pkg);
+    }
 
-  for (guint i = 0; i < devel_pkgs_to_download->len; i++)
+  if (n_reused > 0)
+    g_print ("Reusing %u package%s from %s\n", n_reused, n_reused == 1 ? "" : "s",
+             opt_extensions_output_dir);
+  if (pkgs_to_download->len > 0)
     {
-      DnfPackage *pkg = (DnfPackage *)devel_pkgs_to_download->pdata[i];
-      const char *src = dnf_package_get_filename (pkg);
-      const char *basename = glnx_basename (src);
-      GLnxFileCopyFlags flags
-          = static_cast<GLnxFileCopyFlags> (GLNX_FILE_COPY_NOXATTRS | GLNX_FILE_COPY_NOCHOWN);
-      if (!glnx_file_copy_at (AT_FDCWD, dnf_package_get_filename (pkg), NULL, output_dfd, basename,
-                              flags, cancellable, error))
+      g_autofree char *sizestr
+          = g_format_size (dnf_package_array_get_download_size (pkgs_to_download));
+      g_print ("Will download: %u package%s (%s)\n", pkgs_to_download->len,
+               pkgs_to_download->len == 1 ? "" : "s", sizestr);
+      if (!rpmostree_download_packages (pkgs_to_download, cancellable, error))
+        return FALSE;
+    }
+
+  for (guint i = 0; i < extensions_pkgs->len; i++)
+    {
+      DnfPackage *pkg = (DnfPackage *)extensions_pkgs->pdata[i];
+      if (!link_extension_into_output_dir (pkg, output_dfd, cancellable, error))
         return FALSE;
     }
 
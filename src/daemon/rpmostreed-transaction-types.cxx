@@ -592,8 +592,9 @@ import_local_rpm (OstreeRepo *repo, OstreeSePolicy *policy, int *fd, char **out_
                   GCancellable *cancellable, GError **error)
 {
   auto flags = rpmostreecxx::rpm_importer_flags_new_empty ();
-  g_autoptr (RpmOstreeImporter) unpacker
-      = rpmostree_importer_new_take_fd (fd, repo, NULL, *flags, policy, cancellable, error);
+  /* The fd was passed by the client, who could truncate it under us; don't mmap() it */
+  g_autoptr (RpmOstreeImporter) unpacker = rpmostree_importer_new_take_fd (
+      fd, repo, NULL, *flags, policy, FALSE, cancellable, error);
   if (unpacker == NULL)
     return FALSE;
 
@@ -0,0 +1,278 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Licensed under the GNU Lesser General Public License Version 2.1
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/**
+ * A persistent map from keys to ostree content objects, which the digest and
+ * devino indexes are built on; they only differ in how they compute keys.
+ *
+ * Keys are SHA-256 checksums (in hex) of everything that determines the
+ * content object.  The map is stored as a GVariant at @path in the storage
+ * repo, tagged with a version and a scope (e.g. the filesystem the keys are
+ * valid for); a map with a different version or scope is silently
+ * discarded.  Entries are only ever used if the object is still in the
+ * object repo, so a stale or lost map just means we do more work.
+ */
+
+#include "config.h"
+
+#include "rpmostree-checksum-map.h"
+#include "rpmostree-util.h"
+
+#include <string.h>
+
+#define CHECKSUM_MAP_VARIANT_TYPE "(uva(ayay))"
+
+struct RpmOstreeChecksumMap
+{
+  OstreeRepo *storage_repo;
+  char *path; /* Relative to storage_repo */
+  guint32 version;
+  GVariant *scope;
+  OstreeRepo *object_repo;
+  GMutex lock;
+  GHashTable *entries; /* key (hex) -> content checksum */
+  GHashTable *used;    /* set{key}; looked up or inserted since loading */
+  guint n_hits;
+  gboolean dirty;
+};
+
+/*
+ * rpmostree_checksum_map_new:
+ * @storage_repo: Repo the map is stored in
+ * @path: Where, relative to @storage_repo
+ * @version: Format version of the keys
+ * @scope: (nullable): Anything else the keys are only valid for
+ * @object_repo: Repo the objects must be in to be used
+ *
+ * Returns: An empty map; see rpmostree_checksum_map_load() to read the stored one.
+ */
+RpmOstreeChecksumMap *
+rpmostree_checksum_map_new (OstreeRepo *storage_repo, const char *path, guint32 version,
+                            GVariant *scope, OstreeRepo *object_repo)
+{
+  RpmOstreeChecksumMap *map = g_new0 (RpmOstreeChecksumMap, 1);
+  map->storage_repo = (OstreeRepo *)g_object_ref (storage_repo);
+  map->path = g_strdup (path);
+  map->version = version;
+  map->scope = g_variant_ref_sink (scope ?: g_variant_new ("()"));
+  map->object_repo = (OstreeRepo *)g_object_ref (object_repo);
+  g_mutex_init (&map->lock);
+  map->entries = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  map->used = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  return map;
+}
+
+static void
+load_entries (RpmOstreeChecksumMap *map, GVariant *data)
+{
+  guint32 version;
+  g_autoptr (GVariant) scope = NULL;
+  g_autoptr (GVariant) entries = NULL;
+  g_variant_get (data, "(uv@a(ayay))", &version, &scope, &entries);
+  if (version != map->version || !g_variant_equal (scope, map->scope))
+    return;
+
+  const guint n = g_variant_n_children (entries);
+  for (guint i = 0; i < n; i++)
+    {
+      g_autoptr (GVariant) key_v = NULL;
+      g_autoptr (GVariant) csum_v = NULL;
+      g_variant_get_child (entries, i, "(@ay@ay)", &key_v, &csum_v);
+      /* Skip anything malformed rather than trusting it */
+      if (g_variant_n_children (key_v) != OSTREE_SHA256_DIGEST_LEN
+          || g_variant_n_children (csum_v) != OSTREE_SHA256_DIGEST_LEN)
+        continue;
+      g_hash_table_insert (map->entries, ostree_checksum_from_bytes_v (key_v),
+                           ostree_checksum_from_bytes_v (csum_v));
+    }
+}
+
+/* Like rpmostree_checksum_map_new(), but also load the stored map, if any */
+RpmOstreeChecksumMap *
+rpmostree_checksum_map_load (OstreeRepo *storage_repo, const char *path, guint32 version,
+                             GVariant *scope, OstreeRepo *object_repo, GCancellable *cancellable,
+                             GError **error)
+{
+  g_autoptr (RpmOstreeChecksumMap) map
+      = rpmostree_checksum_map_new (storage_repo, path, version, scope, object_repo);
+
+  glnx_autofd int fd = -1;
+  if (!glnx_openat_ignore_enoent (ostree_repo_get_dfd (storage_repo), path, &fd, error))
+    return NULL;
+  if (fd == -1)
+    return util::move_nullify (map);
+
+  g_autoptr (GBytes) bytes = glnx_fd_readall_bytes (fd, cancellable, error);
+  if (!bytes)
+    return (RpmOstreeChecksumMap *)glnx_prefix_error_null (error, "Reading %s", path);
+  g_autoptr (GVariant) data = g_variant_ref_sink (
+      g_variant_new_from_bytes (G_VARIANT_TYPE (CHECKSUM_MAP_VARIANT_TYPE), bytes, FALSE));
+  /* It's just a cache; if it's corrupted, start over */
+  if (g_variant_is_normal_form (data))
+    load_entries (map, data);
+
+  return util::move_nullify (map);
+}
+
+void
+rpmostree_checksum_map_free (RpmOstreeChecksumMap *map)
+{
+  g_clear_object (&map->storage_repo);
+  g_clear_pointer (&map->path, g_free);
+  g_clear_pointer (&map->scope, g_variant_unref);
+  g_clear_object (&map->object_repo);
+  g_clear_pointer (&map->entries, g_hash_table_unref);
+  g_clear_pointer (&map->used, g_hash_table_unref);
+  g_mutex_clear (&map->lock);
+  g_free (map);
+}
+
+/*
+ * rpmostree_checksum_map_lookup:
+ * @out_checksum: (out) (nullable): Content checksum, or %NULL if not known
+ *
+ * Look up the content object for @key.  This only returns a checksum if the
+ * object is actually present in the object repo.  Safe to call from multiple
+ * threads.
+ */
+gboolean
+rpmostree_checksum_map_lookup (RpmOstreeChecksumMap *map, const char *key, char **out_checksum,
+                               GCancellable *cancellable, GError **error)
+{
+  g_autofree char *checksum = NULL;
+  {
+    g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&map->lock);
+    checksum = g_strdup ((const char *)g_hash_table_lookup (map->entries, key));
+  }
+
+  if (checksum)
+    {
+      gboolean have_obj = FALSE;
+      if (!ostree_repo_has_object (map->object_repo, OSTREE_OBJECT_TYPE_FILE, checksum,
+                                   &have_obj, cancellable, error))
+        return FALSE;
+      g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&map->lock);
+      if (have_obj)
+        {
+          map->n_hits++;
+          g_hash_table_add (map->used, g_strdup (key));
+        }
+      else
+        {
+          /* Probably pruned since; forget about it */
+          g_hash_table_remove (map->entries, key);
+          map->dirty = TRUE;
+          g_clear_pointer (&checksum, g_free);
+        }
+    }
+
+  *out_checksum = util::move_nullify (checksum);
+  return TRUE;
+}
+
+/* Record that @key maps to content object @checksum.  Safe to call from
+ * multiple threads. */
+void
+rpmostree_checksum_map_insert (RpmOstreeChecksumMap *map, const char *key, const char *checksum)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&map->lock);
+  g_hash_table_add (map->used, g_strdup (key));
+  const char *existing = (const char *)g_hash_table_lookup (map->entries, key);
+  if (g_strcmp0 (existing, checksum) == 0)
+    return;
+  g_hash_table_insert (map->entries, g_strdup (key), g_strdup (checksum));
+  map->dirty = TRUE;
+}
+
+/* Returns: The number of entries, including any not verified yet */
+guint
+rpmostree_checksum_map_get_size (RpmOstreeChecksumMap *map)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&map->lock);
+  return g_hash_table_size (map->entries);
+}
+
+/* Returns: The number of lookups which found an object */
+guint
+rpmostree_checksum_map_get_n_hits (RpmOstreeChecksumMap *map)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&map->lock);
+  return map->n_hits;
+}
+
+/*
+ * rpmostree_checksum_map_save:
+ * @mode: Which entries to drop
+ *
+ * Write the map back to the storage repo if it changed.  With
+ * %RPMOSTREE_CHECKSUM_MAP_SAVE_PRUNE_MISSING, entries whose object is gone
+ * are dropped; with %RPMOSTREE_CHECKSUM_MAP_SAVE_ONLY_USED, entries which
+ * weren't looked up or inserted since loading are, so that the map tracks
+ * the current working set rather than growing forever.
+ */
+gboolean
+rpmostree_checksum_map_save (RpmOstreeChecksumMap *map, RpmOstreeChecksumMapSaveMode mode,
+                             GCancellable *cancellable, GError **error)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&map->lock);
+  const gboolean have_unused = mode == RPMOSTREE_CHECKSUM_MAP_SAVE_ONLY_USED
+                               && g_hash_table_size (map->used) < g_hash_table_size (map->entries);
+  if (!map->dirty && !have_unused)
+    return TRUE;
+
+  g_auto (GVariantBuilder) builder;
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ayay)"));
+  GLNX_HASH_TABLE_FOREACH_IT (map->entries, it, const char *, key, const char *, checksum)
+    {
+      gboolean keep = TRUE;
+      switch (mode)
+        {
+        case RPMOSTREE_CHECKSUM_MAP_SAVE_PRUNE_MISSING:
+          if (!ostree_repo_has_object (map->object_repo, OSTREE_OBJECT_TYPE_FILE, checksum, &keep,
+                                       cancellable, error))
+            return FALSE;
+          break;
+        case RPMOSTREE_CHECKSUM_MAP_SAVE_ONLY_USED:
+          keep = g_hash_table_contains (map->used, key);
+          break;
+        }
+      if (!keep)
+        {
+          g_hash_table_iter_remove (&it);
+          continue;
+        }
+      g_variant_builder_add (&builder, "(@ay@ay)", ostree_checksum_to_bytes_v (key),
+                             ostree_checksum_to_bytes_v (checksum));
+    }
+  g_autoptr (GVariant) data = g_variant_ref_sink (
+      g_variant_new ("(uv@a(ayay))", map->version, map->scope, g_variant_builder_end (&builder)));
+
+  int repo_dfd = ostree_repo_get_dfd (map->storage_repo);
+  g_autofree char *dir = g_path_get_dirname (map->path);
+  if (!glnx_shutil_mkdir_p_at (repo_dfd, dir, 0755, cancellable, error))
+    return FALSE;
+  if (!glnx_file_replace_contents_at (repo_dfd, map->path,
+                                      (const guint8 *)g_variant_get_data (data),
+                                      g_variant_get_size (data), GLNX_FILE_REPLACE_NODATASYNC,
+                                      cancellable, error))
+    return glnx_prefix_error (error, "Writing %s", map->path);
+
+  map->dirty = FALSE;
+  return TRUE;
+}
@@ -0,0 +1,65 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Licensed under the GNU Lesser General Public License Version 2.1
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#pragma once
+
+#include <ostree.h>
+
+#include "libglnx.h"
+
+G_BEGIN_DECLS
+
+typedef struct RpmOstreeChecksumMap RpmOstreeChecksumMap;
+
+typedef enum
+{
+  /* Drop entries whose object is no longer in the repo */
+  RPMOSTREE_CHECKSUM_MAP_SAVE_PRUNE_MISSING,
+  /* Only keep entries which were looked up or inserted since loading */
+  RPMOSTREE_CHECKSUM_MAP_SAVE_ONLY_USED,
+} RpmOstreeChecksumMapSaveMode;
+
+RpmOstreeChecksumMap *rpmostree_checksum_map_new (OstreeRepo *storage_repo, const char *path,
+                                                  guint32 version, GVariant *scope,
+                                                  OstreeRepo *object_repo);
+
+RpmOstreeChecksumMap *rpmostree_checksum_map_load (OstreeRepo *storage_repo, const char *path,
+                                                   guint32 version, GVariant *scope,
+                                                   OstreeRepo *object_repo,
+                                                   GCancellable *cancellable, GError **error);
+
+void rpmostree_checksum_map_free (RpmOstreeChecksumMap *map);
+
+gboolean rpmostree_checksum_map_lookup (RpmOstreeChecksumMap *map, const char *key,
+                                        char **out_checksum, GCancellable *cancellable,
+                                        GError **error);
+
+void rpmostree_checksum_map_insert (RpmOstreeChecksumMap *map, const char *key,
+                                    const char *checksum);
+
+guint rpmostree_checksum_map_get_size (RpmOstreeChecksumMap *map);
+
+guint rpmostree_checksum_map_get_n_hits (RpmOstreeChecksumMap *map);
+
+gboolean rpmostree_checksum_map_save (RpmOstreeChecksumMap *map, RpmOstreeChecksumMapSaveMode mode,
+                                      GCancellable *cancellable, GError **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (RpmOstreeChecksumMap, rpmostree_checksum_map_free)
+
+G_END_DECLS
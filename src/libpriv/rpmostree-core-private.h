@@ -25,10 +25,13 @@
 #include "libglnx.h"
 #include "rpmostree-core.h"
 #include "rpmostree-cxxrs.h"
+#include "rpmostree-digest-index.h"
 #include "rpmostree-output.h"
 
 G_BEGIN_DECLS
 
+typedef struct RpmOstreePathTable RpmOstreePathTable;
+
 struct _RpmOstreeContext
 {
   GObject parent;
@@ -65,7 +68,11 @@ struct _RpmOstreeContext
   GPtrArray *pkgs; /* All packages */
   GPtrArray *pkgs_to_download;
   GPtrArray *pkgs_to_import;
+  GPtrArray *pkgs_import_queue; /* Subset of pkgs_to_import available locally */
+  gboolean import_queue_closed; /* No more packages will be added to the queue */
   guint n_async_pkgs_imported;
+  GPtrArray *import_stats; /* If non-NULL, per-package import statistics lines */
+  RpmOstreeDigestIndex *digest_index; /* For the pkgcache, loaded on first import */
   GPtrArray *pkgs_to_relabel;
   guint n_async_pkgs_relabeled;
 
@@ -73,6 +80,7 @@ struct _RpmOstreeContext
   GHashTable *pkgs_to_replace; /* source -> (new gv_nevra --> old gv_nevra) */
 
   GHashTable *fileoverride_pkgs; /* set of nevras */
+  GHashTable *files_remove_regex; /* pkgname --> combined GRegex, or NULL if none */
 
   gboolean filelists_exist;
 
@@ -85,6 +93,7 @@ struct _RpmOstreeContext
 
   int tmprootfs_dfd; /* Borrowed */
   GHashTable *rootfs_usrlinks;
+  RpmOstreePathTable *path_table; /* Only during assemble() */
   GLnxTmpDir repo_tmpdir; /* Used to assemble+commit if no base rootfs provided */
 };
 
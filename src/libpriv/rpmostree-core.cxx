@@ -30,6 +30,7 @@
 #include <rpm/rpmmacro.h>
 #include <rpm/rpmsq.h>
 #include <rpm/rpmts.h>
+#include <sys/ioctl.h>
 #include <systemd/sd-journal.h>
 #include <utility>
 
@@ -38,6 +39,7 @@
 #include "rpmostree-cxxrs.h"
 #include "rpmostree-importer.h"
 #include "rpmostree-kernel.h"
+#include "rpmostree-label-manifest.h"
 #include "rpmostree-output.h"
 #include "rpmostree-postprocess.h"
 #include "rpmostree-rpm-util.h"
@@ -56,6 +58,7 @@
   SD_ID128_MAKE (df, 8b, b5, 4f, 04, fa, 47, 08, ac, 16, 11, 1b, bf, 4b, a3, 52)
 
 static OstreeRepo *get_pkgcache_repo (RpmOstreeContext *self);
+static void path_table_free (RpmOstreePathTable *table);
 
 static int
 compare_pkgs (gconstpointer ap, gconstpointer bp)
@@ -91,17 +94,22 @@ rpmostree_context_finalize (GObject *object)
   g_clear_pointer (&rctx->pkgs, g_ptr_array_unref);
   g_clear_pointer (&rctx->pkgs_to_download, g_ptr_array_unref);
   g_clear_pointer (&rctx->pkgs_to_import, g_ptr_array_unref);
+  g_clear_pointer (&rctx->pkgs_import_queue, g_ptr_array_unref);
+  g_clear_pointer (&rctx->import_stats, g_ptr_array_unref);
+  g_clear_pointer (&rctx->digest_index, rpmostree_digest_index_free);
   g_clear_pointer (&rctx->pkgs_to_relabel, g_ptr_array_unref);
 
   g_clear_pointer (&rctx->pkgs_to_remove, g_hash_table_unref);
   g_clear_pointer (&rctx->pkgs_to_replace, g_hash_table_unref);
 
   g_clear_pointer (&rctx->fileoverride_pkgs, g_hash_table_unref);
+  g_clear_pointer (&rctx->files_remove_regex, g_hash_table_unref);
 
   (void)glnx_tmpdir_delete (&rctx->tmpdir, NULL, NULL);
   (void)glnx_tmpdir_delete (&rctx->repo_tmpdir, NULL, NULL);
 
   g_clear_pointer (&rctx->rootfs_usrlinks, g_hash_table_unref);
+  g_clear_pointer (&rctx->path_table, path_table_free);
 
   G_OBJECT_CLASS (rpmostree_context_parent_class)->finalize (object);
 }
@@ -113,6 +121,13 @@ rpmostree_context_class_init (RpmOstreeContextClass *klass)
   object_class->finalize = rpmostree_context_finalize;
 }
 
+static void
+regex_unref_nullable (GRegex *regex)
+{
+  if (regex)
+    g_regex_unref (regex);
+}
+
 static void
 rpmostree_context_init (RpmOstreeContext *self)
 {
@@ -121,6 +136,8 @@ rpmostree_context_init (RpmOstreeContext *self)
   self->enable_rofiles = TRUE;
   self->unprivileged = getuid () != 0;
   self->filelists_exist = FALSE;
+  self->files_remove_regex = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                    (GDestroyNotify)regex_unref_nullable);
 }
 
 static void
@@ -418,6 +435,16 @@ rpmostree_context_set_sepolicy (RpmOstreeContext *self, OstreeSePolicy *sepolicy
   g_set_object (&self->sepolicy, sepolicy);
 }
 
+/* Gather per-package throughput and read syscall counts during import, and
+ * print them once it's done. */
+void
+rpmostree_context_set_import_stats (RpmOstreeContext *self, gboolean enabled)
+{
+  g_clear_pointer (&self->import_stats, g_ptr_array_unref);
+  if (enabled)
+    self->import_stats = g_ptr_array_new_with_free_func (g_free);
+}
+
 void
 rpmostree_context_set_devino_cache (RpmOstreeContext *self, OstreeRepoDevInoCache *devino_cache)
 {
@@ -2439,30 +2466,66 @@ rpmostree_find_and_download_packages (const char *const *packages, const char *s
   return TRUE;
 }
 
-gboolean
-rpmostree_context_download (RpmOstreeContext *self, GCancellable *cancellable, GError **error)
+/* Print a summary of what we're about to download; returns FALSE if there is
+ * nothing to do. */
+static gboolean
+print_download_summary (RpmOstreeContext *self)
 {
   int n = self->pkgs_to_download->len;
+  if (n == 0)
+    return FALSE;
 
-  if (n > 0)
-    {
-      guint64 size = dnf_package_array_get_download_size (self->pkgs_to_download);
-      g_autofree char *sizestr = g_format_size (size);
-      rpmostree_output_message ("Will download: %u package%s (%s)", n, _NS (n), sizestr);
-    }
-  else
-    return TRUE;
+  guint64 size = dnf_package_array_get_download_size (self->pkgs_to_download);
+  g_autofree char *sizestr = g_format_size (size);
+  rpmostree_output_message ("Will download: %u package%s (%s)", n, _NS (n), sizestr);
 
   // For now just make this a warning for debugging https://github.com/coreos/rpm-ostree/issues/4565
   // It may be that people are actually relying on this behavior too...
   if (self->dnf_cache_policy == RPMOSTREE_CONTEXT_DNF_CACHE_FOREVER)
     g_printerr ("warning: Found %u packages to download in cache-only mode\n",
                 self->pkgs_to_download->len);
+  return TRUE;
+}
+
+gboolean
+rpmostree_context_download (RpmOstreeContext *self, GCancellable *cancellable, GError **error)
+{
+  if (!print_download_summary (self))
+    return TRUE;
+
   return rpmostree_download_packages (self->pkgs_to_download, cancellable, error);
 }
 
 static gboolean async_imports_mainctx_iter (gpointer user_data);
 
+/* Sort largest first; the time to import a package is dominated by
+ * decompressing and checksumming its contents. */
+static int
+compare_pkgs_by_installsize_desc (gconstpointer ap, gconstpointer bp)
+{
+  auto a = *(DnfPackage **)ap;
+  auto b = *(DnfPackage **)bp;
+  guint64 a_size = dnf_package_get_installsize (a);
+  guint64 b_size = dnf_package_get_installsize (b);
+  if (a_size != b_size)
+    return a_size > b_size ? -1 : 1;
+  return dnf_package_cmp (a, b);
+}
+
+/* Reorder the not-yet-started part of the import queue so that large
+ * packages are started first (the "longest processing time" heuristic).
+ * Otherwise e.g. linux-firmware may happen to get scheduled last and
+ * leave one core grinding on it alone at the end.
+ */
+static void
+sort_import_queue_pending (RpmOstreeContext *self)
+{
+  GPtrArray *queue = self->pkgs_import_queue;
+  g_assert_cmpuint (self->async_index, <=, queue->len);
+  qsort (queue->pdata + self->async_index, queue->len - self->async_index, sizeof (gpointer),
+         compare_pkgs_by_installsize_desc);
+}
+
 /* Called on completion of an async import; runs on main thread */
 static void
 on_async_import_done (GObject *obj, GAsyncResult *res, gpointer user_data)
@@ -2477,6 +2540,19 @@ on_async_import_done (GObject *obj, GAsyncResult *res, gpointer user_data)
         g_cancellable_cancel (self->async_cancellable);
       g_assert (self->async_error != NULL);
     }
+  else if (self->import_stats)
+    {
+      const RpmOstreeUnpackStats *stats = rpmostree_importer_get_stats (importer);
+      g_autofree char *nevra = rpmostree_importer_get_nevra (importer);
+      g_autofree char *sizestr = g_format_size (stats->n_bytes);
+      const double secs = MAX (stats->elapsed_us, 1) / (double)G_USEC_PER_SEC;
+      g_autofree char *ratestr = g_format_size ((guint64)(stats->n_bytes / secs));
+      g_ptr_array_add (self->import_stats,
+                       g_strdup_printf ("%s: %s in %.2fs (%s/s), %" G_GUINT64_FORMAT
+                                        " syscalls (%s), %" G_GUINT64_FORMAT " files deduped",
+                                        nevra, sizestr, secs, ratestr, stats->n_syscalls,
+                                        stats->mmapped ? "mmap" : "read", stats->n_deduped));
+    }
 
   g_assert_cmpint (self->n_async_pkgs_imported, <, self->pkgs_to_import->len);
   self->n_async_pkgs_imported++;
@@ -2502,9 +2578,10 @@ start_async_import_one_package (RpmOstreeContext *self, DnfPackage *pkg, GCancel
 
   OstreeRepo *ostreerepo = get_pkgcache_repo (self);
   g_autoptr (RpmOstreeImporter) unpacker = rpmostree_importer_new_take_fd (
-      &fd, ostreerepo, pkg, *importer_flags, self->sepolicy, cancellable, error);
+      &fd, ostreerepo, pkg, *importer_flags, self->sepolicy, TRUE, cancellable, error);
   if (!unpacker)
     return glnx_prefix_error (error, "creating importer");
+  rpmostree_importer_set_digest_index (unpacker, self->digest_index);
 
   rpmostree_importer_run_async (unpacker, cancellable, on_async_import_done, self);
 
@@ -2519,11 +2596,12 @@ static gboolean
 async_imports_mainctx_iter (gpointer user_data)
 {
   auto self = static_cast<RpmOstreeContext *> (user_data);
+  GPtrArray *queue = self->pkgs_import_queue;
 
-  while (self->async_index < self->pkgs_to_import->len && self->n_async_running < self->n_async_max
+  while (self->async_index < queue->len && self->n_async_running < self->n_async_max
          && self->async_error == NULL)
     {
-      auto pkg = static_cast<DnfPackage *> (self->pkgs_to_import->pdata[self->async_index]);
+      auto pkg = static_cast<DnfPackage *> (queue->pdata[self->async_index]);
       if (!start_async_import_one_package (self, pkg, self->async_cancellable, &self->async_error))
         {
           g_cancellable_cancel (self->async_cancellable);
@@ -2533,7 +2611,9 @@ async_imports_mainctx_iter (gpointer user_data)
       self->n_async_running++;
     }
 
-  if (self->n_async_running == 0)
+  /* If we're still waiting on downloads, then more packages may be queued later */
+  const gboolean more_pending = !self->import_queue_closed && self->async_error == NULL;
+  if (self->n_async_running == 0 && !more_pending)
     {
       self->async_running = FALSE;
       g_main_context_wakeup (g_main_context_get_thread_default ());
@@ -2542,13 +2622,112 @@ async_imports_mainctx_iter (gpointer user_data)
   return FALSE;
 }
 
-gboolean
-rpmostree_context_import (RpmOstreeContext *self, GCancellable *cancellable, GError **error)
+/* How many packages to hand librepo at once; it only downloads
+ * LRO_MAXPARALLELDOWNLOADS of them concurrently, so give it enough that one
+ * slow package doesn't leave the other connections idle for long.
+ */
+#define DOWNLOAD_BATCH_SIZE (LRO_MAXPARALLELDOWNLOADS_DEFAULT * 8)
+
+typedef struct
+{
+  RpmOstreeContext *self;
+  const char *repo_id;
+  guint n_done;  /* Packages from this repo in previous batches */
+  guint n_batch; /* Packages in the current batch */
+  guint n_total; /* Packages from this repo */
+} DownloadProgress;
+
+/* The importer owns the progress bar, so show download progress for the
+ * whole repo as its sub-message. */
+static void
+on_download_percentage_changed (DnfState *hifstate, guint percentage, gpointer user_data)
+{
+  auto progress = static_cast<DownloadProgress *> (user_data);
+  const guint percent
+      = (100 * progress->n_done + percentage * progress->n_batch) / progress->n_total;
+  g_autofree char *msg
+      = g_strdup_printf ("Downloading from '%s': %u%%", progress->repo_id, MIN (percent, 100));
+  progress->self->async_progress->set_sub_message (msg);
+}
+
+/* Download packages from each repo in batches, and add them to the import
+ * queue as each batch completes; this way the importer threads can get started
+ * while we're still fetching the rest.  We only start another batch once the
+ * importers have worked through most of the queue, so that it (and the disk
+ * space used by not-yet-imported packages) stays bounded.
+ */
+static gboolean
+download_into_import_queue (RpmOstreeContext *self, GCancellable *cancellable, GError **error)
+{
+  GMainContext *mainctx = g_main_context_get_thread_default ();
+  /* Enough to keep every importer busy while the next batch downloads */
+  const guint max_backlog = self->n_async_max * 2;
+  /* Packages we already had locally start out at the front of the queue; we
+   * don't count those when deciding how far ahead of the importers we are. */
+  const guint n_local = self->pkgs_import_queue->len;
+
+  /* Get those started before blocking on the network */
+  async_imports_mainctx_iter (self);
+
+  g_autoptr (GHashTable) source_to_packages = gather_source_to_packages (self->pkgs_to_download);
+  GLNX_HASH_TABLE_FOREACH_KV (source_to_packages, DnfRepo *, src, GPtrArray *, src_packages)
+    {
+      g_autofree char *target_dir
+          = g_build_filename (dnf_repo_get_location (src), "/packages/", NULL);
+      if (!glnx_shutil_mkdir_p_at (AT_FDCWD, target_dir, 0755, cancellable, error))
+        return FALSE;
+
+      /* Fetch the big ones first so their imports can start early too */
+      g_ptr_array_sort (src_packages, compare_pkgs_by_installsize_desc);
+
+      DownloadProgress progress = {
+        self, dnf_repo_get_id (src), 0, 0, src_packages->len,
+      };
+      for (guint i = 0; i < src_packages->len; i += DOWNLOAD_BATCH_SIZE)
+        {
+          /* Wait for the importers to catch up */
+          while (self->async_error == NULL
+                 && self->pkgs_import_queue->len - MAX (self->async_index, n_local) >= max_backlog)
+            g_main_context_iteration (mainctx, TRUE);
+          /* If an import failed, there's no point in continuing */
+          if (self->async_error != NULL)
+            return TRUE;
+
+          g_autoptr (GPtrArray) batch = g_ptr_array_new ();
+          for (guint j = i; j < MIN (i + DOWNLOAD_BATCH_SIZE, src_packages->len); j++)
+            g_ptr_array_add (batch, src_packages->pdata[j]);
+
+          progress.n_done = i;
+          progress.n_batch = batch->len;
+          glnx_unref_object DnfState *hifstate = dnf_state_new ();
+          on_download_percentage_changed (hifstate, 0, &progress);
+          guint progress_sigid
+              = g_signal_connect (hifstate, "percentage-changed",
+                                  G_CALLBACK (on_download_percentage_changed), &progress);
+          const gboolean downloaded
+              = dnf_repo_download_packages (src, batch, target_dir, hifstate, error);
+          g_signal_handler_disconnect (hifstate, progress_sigid);
+          if (!downloaded)
+            return glnx_prefix_error (error, "Downloading from '%s'", dnf_repo_get_id (src));
+
+          for (guint j = 0; j < batch->len; j++)
+            g_ptr_array_add (self->pkgs_import_queue, g_object_ref (batch->pdata[j]));
+          sort_import_queue_pending (self);
+          async_imports_mainctx_iter (self);
+        }
+    }
+
+  self->async_progress->set_sub_message ("");
+  return TRUE;
+}
+
+static gboolean
+import_packages (RpmOstreeContext *self, gboolean pipeline_downloads, GCancellable *cancellable,
+                 GError **error)
 {
   DnfContext *dnfctx = self->dnfctx;
   const int n = self->pkgs_to_import->len;
-  if (n == 0)
-    return TRUE;
+  g_assert_cmpint (n, >, 0);
 
   OstreeRepo *repo = get_pkgcache_repo (self);
   g_assert (repo != NULL);
@@ -2563,6 +2742,13 @@ rpmostree_context_import (RpmOstreeContext *self, GCancellable *cancellable, GEr
   if (!rpmostree_repo_auto_transaction_start (&txn, repo, TRUE, cancellable, error))
     return FALSE;
 
+  if (!self->digest_index)
+    {
+      self->digest_index = rpmostree_digest_index_load (repo, cancellable, error);
+      if (!self->digest_index)
+        return FALSE;
+    }
+
   self->async_running = TRUE;
   self->async_index = 0;
   self->n_async_running = 0;
@@ -2570,21 +2756,50 @@ rpmostree_context_import (RpmOstreeContext *self, GCancellable *cancellable, GEr
   self->n_async_max = g_get_num_processors ();
   self->async_cancellable = cancellable;
 
-  self->async_progress
-      = rpmostreecxx::progress_nitems_begin (self->pkgs_to_import->len, "Importing packages");
+  /* If pipelining, start with the packages we already have locally; the rest
+   * get queued as they're downloaded. */
+  g_clear_pointer (&self->pkgs_import_queue, g_ptr_array_unref);
+  self->pkgs_import_queue = g_ptr_array_new_with_free_func ((GDestroyNotify)g_object_unref);
+  for (guint i = 0; i < self->pkgs_to_import->len; i++)
+    {
+      auto pkg = static_cast<DnfPackage *> (self->pkgs_to_import->pdata[i]);
+      if (!pipeline_downloads || !g_ptr_array_find (self->pkgs_to_download, pkg, NULL))
+        g_ptr_array_add (self->pkgs_import_queue, g_object_ref (pkg));
+    }
+  self->import_queue_closed = !pipeline_downloads;
+  sort_import_queue_pending (self);
+
+  self->async_progress = rpmostreecxx::progress_nitems_begin (
+      self->pkgs_to_import->len,
+      pipeline_downloads ? "Downloading and importing packages" : "Importing packages");
 
   /* Process imports */
   GMainContext *mainctx = g_main_context_get_thread_default ();
-  {
-    g_autoptr (GSource) src = g_timeout_source_new (0);
-    g_source_set_priority (src, G_PRIORITY_HIGH);
-    g_source_set_callback (src, async_imports_mainctx_iter, self, NULL);
-    g_source_attach (src, mainctx); /* Note takes a ref */
-  }
+  g_autoptr (GSource) src = g_timeout_source_new (0);
+  g_source_set_priority (src, G_PRIORITY_HIGH);
+  g_source_set_callback (src, async_imports_mainctx_iter, self, NULL);
+  g_source_attach (src, mainctx); /* Note takes a ref */
 
   self->async_error = NULL;
+  if (pipeline_downloads)
+    {
+      g_autoptr (GError) download_error = NULL;
+      if (!download_into_import_queue (self, cancellable, &download_error))
+        {
+          /* Let any in-flight imports wind down before returning */
+          if (self->async_error == NULL)
+            self->async_error = util::move_nullify (download_error);
+          g_cancellable_cancel (cancellable);
+        }
+      self->import_queue_closed = TRUE;
+      async_imports_mainctx_iter (self);
+    }
+
   while (self->async_running)
     g_main_context_iteration (mainctx, TRUE);
+  /* We may have finished without ever dispatching it */
+  g_source_destroy (src);
+  g_clear_pointer (&self->pkgs_import_queue, g_ptr_array_unref);
   if (self->async_error)
     {
       g_propagate_error (error, util::move_nullify (self->async_error));
@@ -2595,10 +2810,21 @@ rpmostree_context_import (RpmOstreeContext *self, GCancellable *cancellable, GEr
   self->async_progress->end (import_done_msg);
   self->async_progress.release ();
 
+  if (self->import_stats)
+    {
+      for (guint i = 0; i < self->import_stats->len; i++)
+        rpmostree_output_message ("  %s", (char *)self->import_stats->pdata[i]);
+      g_ptr_array_set_size (self->import_stats, 0);
+    }
+
   if (!ostree_repo_commit_transaction (repo, NULL, cancellable, error))
     return FALSE;
   txn.initialized = FALSE;
 
+  /* Only once the objects it references are committed */
+  if (!rpmostree_digest_index_save (self->digest_index, cancellable, error))
+    return FALSE;
+
   sd_journal_send ("MESSAGE_ID=" SD_ID128_FORMAT_STR,
                    SD_ID128_FORMAT_VAL (RPMOSTREE_MESSAGE_PKG_IMPORT), "MESSAGE=Imported %u pkg%s",
                    n, _NS (n), "IMPORTED_N_PKGS=%u", n, NULL);
@@ -2606,6 +2832,32 @@ rpmostree_context_import (RpmOstreeContext *self, GCancellable *cancellable, GEr
   return TRUE;
 }
 
+gboolean
+rpmostree_context_import (RpmOstreeContext *self, GCancellable *cancellable, GError **error)
+{
+  if (self->pkgs_to_import->len == 0)
+    return TRUE;
+
+  return import_packages (self, FALSE, cancellable, error);
+}
+
+/* Like calling rpmostree_context_download() followed by
+ * rpmostree_context_import(), except that each package is imported as soon as
+ * it has been downloaded, so that the total time approaches the slower of the
+ * two phases rather than their sum.
+ */
+gboolean
+rpmostree_context_download_and_import (RpmOstreeContext *self, GCancellable *cancellable,
+                                       GError **error)
+{
+  const gboolean have_downloads = print_download_summary (self);
+  if (self->pkgs_to_import->len == 0)
+    return !have_downloads
+           || rpmostree_download_packages (self->pkgs_to_download, cancellable, error);
+
+  return import_packages (self, have_downloads, cancellable, error);
+}
+
 /* Given a single package, verify its GPG signature (if enabled), open a file
  * descriptor for it, and delete the on-disk downloaded copy.
  */
@@ -2669,16 +2921,146 @@ canonicalize_non_usrmove_path (RpmOstreeContext *self, const char *path)
   return g_build_filename (link, slash + 1, NULL);
 }
 
+/* The canonical forms of the rpm file paths seen during assembly.  The file
+ * disposition, checkout, deletion and override stages all look at the same
+ * paths, so we compute each form once and intern it; this also means that
+ * the results can be compared by pointer.  This isn't thread-safe, so it
+ * should only be used from the main thread.
+ */
+struct RpmOstreePathTable
+{
+  GStringChunk *strings;
+  GHashTable *ostree_paths;        /* rpm path -> see canonicalize_rpmfi_path() */
+  GHashTable *rootfs_paths;        /* rpm path -> relative, with usrmove links resolved */
+  GHashTable *rootfs_ostree_paths; /* rpm path -> the above in ostree conventions */
+};
+
+static RpmOstreePathTable *
+path_table_new (void)
+{
+  auto table = g_new0 (RpmOstreePathTable, 1);
+  table->strings = g_string_chunk_new (64 * 1024);
+  /* All keys are interned rpm paths */
+  table->ostree_paths = g_hash_table_new (NULL, NULL);
+  table->rootfs_paths = g_hash_table_new (NULL, NULL);
+  table->rootfs_ostree_paths = g_hash_table_new (NULL, NULL);
+  return table;
+}
+
+static void
+path_table_free (RpmOstreePathTable *table)
+{
+  g_hash_table_unref (table->ostree_paths);
+  g_hash_table_unref (table->rootfs_paths);
+  g_hash_table_unref (table->rootfs_ostree_paths);
+  g_string_chunk_free (table->strings);
+  g_free (table);
+}
+
+/* The returned string is owned by the table */
+static const char *
+path_table_intern (RpmOstreePathTable *table, const char *path)
+{
+  return g_string_chunk_insert_const (table->strings, path);
+}
+
+/* Like canonicalize_rpmfi_path(), but the result is owned by the context */
+static const char *
+get_ostree_path (RpmOstreeContext *self, const char *path)
+{
+  RpmOstreePathTable *table = self->path_table;
+  const char *key = path_table_intern (table, path);
+  auto ret = static_cast<const char *> (g_hash_table_lookup (table->ostree_paths, key));
+  if (ret == NULL)
+    {
+      g_autofree char *canonical = canonicalize_rpmfi_path (key);
+      ret = path_table_intern (table, canonical);
+      g_hash_table_insert (table->ostree_paths, (gpointer)key, (gpointer)ret);
+    }
+  return ret;
+}
+
+/* Return @path relative to the root, with e.g. lib/ canonicalized to usr/lib/,
+ * and if @translate is set, also converted to ostree conventions.  The result
+ * is owned by the context. */
+static const char *
+get_rootfs_path (RpmOstreeContext *self, const char *path, gboolean translate)
+{
+  RpmOstreePathTable *table = self->path_table;
+  GHashTable *cache = translate ? table->rootfs_ostree_paths : table->rootfs_paths;
+  const char *key = path_table_intern (table, path);
+  auto ret = static_cast<const char *> (g_hash_table_lookup (cache, key));
+  if (ret != NULL)
+    return ret;
+
+  const char *rel = key + strspn (key, "/");
+  g_autofree char *rel_owned = canonicalize_non_usrmove_path (self, rel);
+  if (rel_owned)
+    rel = rel_owned;
+
+  if (translate)
+    {
+      auto translated = rpmostreecxx::translate_path_for_ostree (rel);
+      ret = path_table_intern (table, translated.size () != 0 ? translated.c_str () : rel);
+    }
+  else
+    ret = path_table_intern (table, rel);
+  g_hash_table_insert (cache, (gpointer)key, (gpointer)ret);
+  return ret;
+}
+
+/* @path must be interned in the path table */
 static void
-ht_insert_path_for_nevra (GHashTable *ht, const char *nevra, char *path, gpointer v)
+ht_insert_path_for_nevra (GHashTable *ht, const char *nevra, const char *path, gpointer v)
 {
   auto paths = static_cast<GHashTable *> (g_hash_table_lookup (ht, nevra));
   if (!paths)
     {
-      paths = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+      paths = g_hash_table_new (g_str_hash, g_str_equal);
       g_hash_table_insert (ht, g_strdup (nevra), paths);
     }
-  g_hash_table_insert (paths, path, v);
+  g_hash_table_insert (paths, (gpointer)path, v);
+}
+
+static int
+compare_strings (gconstpointer ap, gconstpointer bp)
+{
+  return strcmp (*(const char **)ap, *(const char **)bp);
+}
+
+/* Add @fn from the rpmdb to @files_changed (if we're collecting them), using the
+ * same conventions as the tree.  The paths are interned in the path table; @buf
+ * is just scratch space. */
+static void
+add_changed_file (RpmOstreeContext *self, GHashTable *files_changed, GString *buf, const char *fn)
+{
+  if (!files_changed)
+    return;
+  g_string_assign (buf, "/");
+  g_string_append (buf, get_rootfs_path (self, fn, FALSE));
+  g_hash_table_add (files_changed, (gpointer)path_table_intern (self->path_table, buf->str));
+}
+
+/* A colored file added by the transaction; see handle_file_dispositions() */
+typedef struct
+{
+  const char *path;  /* Interned in the path table, so pointer equality is path equality */
+  const char *nevra; /* Borrowed from the package */
+  rpm_color_t color;
+  guint idx; /* Position in transaction order, to keep sorting stable */
+} ColoredFile;
+
+/* Group entries by (interned) path; within a path, keep the transaction order */
+static int
+compare_colored_files (gconstpointer ap, gconstpointer bp)
+{
+  auto a = static_cast<const ColoredFile *> (ap);
+  auto b = static_cast<const ColoredFile *> (bp);
+  if (a->path != b->path)
+    return (guintptr)a->path < (guintptr)b->path ? -1 : 1;
+  if (a->idx != b->idx)
+    return a->idx < b->idx ? -1 : 1;
+  return 0;
 }
 
 /* This is a lighter version of calculations that librpm calls "file disposition".
@@ -2689,11 +3071,20 @@ ht_insert_path_for_nevra (GHashTable *ht, const char *nevra, char *path, gpointe
  *   and they are both "coloured", we need to pick the preferred one
  *
  * The librpm functions and APIs for these are unfortunately private since they're just run
- * as part of rpmtsRun(). XXX: see if we can make the rpmfs APIs public. */
+ * as part of rpmtsRun(). XXX: see if we can make the rpmfs APIs public.
+ *
+ * Since composes can have hundreds of thousands of files, the paths we need to look up
+ * again are interned into a single string chunk, and the colored added files are kept in
+ * one flat array which we sort by path, so that conflicts between added packages can be
+ * resolved in a single pass.
+ *
+ * If @out_files_changed is set, we also return the sorted (canonicalized, absolute) paths
+ * of all files added or removed by the transaction, which we use to decide which file
+ * triggers from base packages to run.  The paths are owned by the path table. */
 static gboolean
 handle_file_dispositions (RpmOstreeContext *self, int tmprootfs_dfd, rpmts ts,
                           GHashTable **out_files_skip_add, GHashTable **out_files_skip_delete,
-                          GCancellable *cancellable, GError **error)
+                          GPtrArray **out_files_changed, GCancellable *cancellable, GError **error)
 {
   /* we deal with color similarly to librpm (compare with skipInstallFiles()) */
   rpm_color_t ts_color = rpmtsColor (ts);
@@ -2701,11 +3092,15 @@ handle_file_dispositions (RpmOstreeContext *self, int tmprootfs_dfd, rpmts ts,
 
   g_autoptr (GHashTable) pkgs_deleted = g_hash_table_new (g_direct_hash, g_direct_equal);
 
-  /* note these entries are *not* canonicalized for ostree conventions */
+  /* note these paths are *not* canonicalized for ostree conventions */
+  RpmOstreePathTable *paths = self->path_table;
   g_autoptr (GHashTable) files_deleted = /* set{paths} */
-      g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-  g_autoptr (GHashTable) files_added = /* map{nevra -> map{path -> color}} */
-      g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_hash_table_unref);
+      g_hash_table_new (g_str_hash, g_str_equal);
+  g_autoptr (GArray) files_added = g_array_new (FALSE, FALSE, sizeof (ColoredFile));
+  /* but this one is, since it's compared against the final tree; keys are interned */
+  g_autoptr (GHashTable) files_changed = /* set{paths} */
+      out_files_changed ? g_hash_table_new (NULL, NULL) : NULL;
+  g_autoptr (GString) changed_buf = g_string_new ("");
 
   /* first pass to just collect added and removed files */
   const guint n_rpmts_elements = (guint)rpmtsNElements (ts);
@@ -2722,7 +3117,10 @@ handle_file_dispositions (RpmOstreeContext *self, int tmprootfs_dfd, rpmts ts,
       if (type == TR_REMOVED)
         {
           while (rpmfiNext (fi) >= 0)
-            g_hash_table_add (files_deleted, g_strdup (rpmfiFN (fi)));
+            {
+              g_hash_table_add (files_deleted, (gpointer)path_table_intern (paths, rpmfiFN (fi)));
+              add_changed_file (self, files_changed, changed_buf, rpmfiFN (fi));
+            }
         }
       else
         {
@@ -2730,16 +3128,31 @@ handle_file_dispositions (RpmOstreeContext *self, int tmprootfs_dfd, rpmts ts,
           const char *nevra = dnf_package_get_nevra (pkg);
           while (rpmfiNext (fi) >= 0)
             {
+              add_changed_file (self, files_changed, changed_buf, rpmfiFN (fi));
               rpm_color_t color = rpmfiFColor (fi);
               if (color)
                 {
-                  // Ownership is passed to the hash table
-                  char *fn = g_strdup (rpmfiFN (fi));
-                  ht_insert_path_for_nevra (files_added, nevra, fn, GUINT_TO_POINTER (color));
+                  ColoredFile file = {
+                    path_table_intern (paths, rpmfiFN (fi)),
+                    nevra,
+                    color,
+                    files_added->len,
+                  };
+                  g_array_append_val (files_added, file);
                 }
             }
         }
     }
+  g_array_sort (files_added, compare_colored_files);
+
+  /* Index of the first entry for each path in @files_added */
+  g_autoptr (GHashTable) files_added_index = g_hash_table_new (g_str_hash, g_str_equal);
+  for (guint i = 0; i < files_added->len; i++)
+    {
+      auto file = &g_array_index (files_added, ColoredFile, i);
+      if (i == 0 || g_array_index (files_added, ColoredFile, i - 1).path != file->path)
+        g_hash_table_insert (files_added_index, (gpointer)file->path, GUINT_TO_POINTER (i));
+    }
 
   /* this we *do* canonicalize since we'll be comparing against ostree paths */
   g_autoptr (GHashTable) files_skip_add = /* map{nevra -> set{files}} */
@@ -2749,14 +3162,12 @@ handle_file_dispositions (RpmOstreeContext *self, int tmprootfs_dfd, rpmts ts,
       = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 
   /* skip added files whose colors aren't in our rainbow */
-  GLNX_HASH_TABLE_FOREACH_KV (files_added, const char *, nevra, GHashTable *, paths)
+  for (guint i = 0; i < files_added->len; i++)
     {
-      GLNX_HASH_TABLE_FOREACH_KV (paths, const char *, path, gpointer, colorp)
-        {
-          rpm_color_t color = GPOINTER_TO_UINT (colorp);
-          if (ts_color && !(ts_color & color))
-            ht_insert_path_for_nevra (files_skip_add, nevra, canonicalize_rpmfi_path (path), NULL);
-        }
+      auto file = &g_array_index (files_added, ColoredFile, i);
+      if (ts_color && !(ts_color & file->color))
+        ht_insert_path_for_nevra (files_skip_add, file->nevra, get_ostree_path (self, file->path),
+                                  NULL);
     }
 
   g_auto (rpmdbMatchIterator) it = rpmtsInitIterator (ts, RPMDBI_PACKAGES, NULL, 0);
@@ -2789,34 +3200,34 @@ handle_file_dispositions (RpmOstreeContext *self, int tmprootfs_dfd, rpmts ts,
           if (!color)
             continue;
 
-          /* let's make the safe assumption that the color mess is only an issue for /usr */
-          const char *fn_rel = fn + strspn (fn, "/");
-
-          /* be sure we've canonicalized usr/ */
-          g_autofree char *fn_rel_owned = canonicalize_non_usrmove_path (self, fn_rel);
-          if (fn_rel_owned)
-            fn_rel = fn_rel_owned;
+          /* check if any of the pkgs to install want to overwrite our file */
+          gpointer first_p = NULL;
+          const char *fn_interned = NULL;
+          if (!g_hash_table_lookup_extended (files_added_index, fn, (gpointer *)&fn_interned,
+                                             &first_p))
+            continue;
 
+          /* let's make the safe assumption that the color mess is only an issue for /usr;
+           * be sure we've canonicalized usr/ */
+          const char *fn_rel = get_rootfs_path (self, fn, FALSE);
           if (!g_str_has_prefix (fn_rel, "usr/"))
             continue;
 
-          /* check if any of the pkgs to install want to overwrite our file */
-          GLNX_HASH_TABLE_FOREACH_KV (files_added, const char *, nevra, GHashTable *, paths)
+          for (guint i = GPOINTER_TO_UINT (first_p); i < files_added->len; i++)
             {
-              gpointer other_colorp = NULL;
-              if (!g_hash_table_lookup_extended (paths, fn, NULL, &other_colorp))
-                continue;
+              auto file = &g_array_index (files_added, ColoredFile, i);
+              if (file->path != fn_interned)
+                break;
 
-              rpm_color_t other_color = GPOINTER_TO_UINT (other_colorp);
-              other_color &= ts_color;
+              rpm_color_t other_color = file->color & ts_color;
 
               /* see handleColorConflict() */
               if (color && other_color && (color != other_color))
                 {
                   /* do we already have the preferred color installed? */
                   if (color & ts_prefcolor)
-                    ht_insert_path_for_nevra (files_skip_add, nevra, canonicalize_rpmfi_path (fn),
-                                              NULL);
+                    ht_insert_path_for_nevra (files_skip_add, file->nevra,
+                                              get_ostree_path (self, fn), NULL);
                   else if (other_color & ts_prefcolor)
                     {
                       /* the new pkg is bringing our favourite color, give way now so we let
@@ -2829,60 +3240,61 @@ handle_file_dispositions (RpmOstreeContext *self, int tmprootfs_dfd, rpmts ts,
         }
     }
 
-  /* and finally, iterate over added pkgs only to search for duplicate files of
-   * differing rpm colors for which we have to pick one */
-  g_autoptr (GHashTable) path_to_nevra = g_hash_table_new (g_str_hash, g_str_equal);
-  g_autoptr (GHashTable) path_to_color = g_hash_table_new (g_str_hash, g_str_equal);
-  GLNX_HASH_TABLE_FOREACH_KV (files_added, const char *, nevra, GHashTable *, paths)
+  /* and finally, scan the added files for duplicates of differing rpm colors for which we
+   * have to pick one; since they're sorted by path, each run is one path */
+  const ColoredFile *winner = NULL;
+  for (guint i = 0; i < files_added->len; i++)
     {
-      GLNX_HASH_TABLE_FOREACH_KV (paths, const char *, path, gpointer, colorp)
+      auto file = &g_array_index (files_added, ColoredFile, i);
+      if (winner == NULL || winner->path != file->path)
         {
-          if (!g_hash_table_contains (path_to_nevra, path))
-            {
-              g_hash_table_insert (path_to_nevra, (gpointer)path, (gpointer)nevra);
-              g_hash_table_insert (path_to_color, (gpointer)path, colorp);
-              continue;
-            }
+          winner = file;
+          continue;
+        }
 
-          rpm_color_t color = GPOINTER_TO_UINT (colorp) & ts_color;
-          const char *other_nevra
-              = static_cast<const char *> (g_hash_table_lookup (path_to_nevra, path));
-          rpm_color_t other_color
-              = GPOINTER_TO_UINT (g_hash_table_lookup (path_to_color, path)) & ts_color;
+      rpm_color_t color = file->color & ts_color;
+      rpm_color_t other_color = winner->color & ts_color;
 
-          /* see handleColorConflict() */
-          if (color && other_color && (color != other_color))
+      /* see handleColorConflict() */
+      if (color && other_color && (color != other_color))
+        {
+          if (color & ts_prefcolor)
             {
-              if (color & ts_prefcolor)
-                {
-                  ht_insert_path_for_nevra (files_skip_add, other_nevra,
-                                            canonicalize_rpmfi_path (path), NULL);
-                  g_hash_table_insert (path_to_nevra, (gpointer)path, (gpointer)nevra);
-                  g_hash_table_insert (path_to_color, (gpointer)path, colorp);
-                }
-              else if (other_color & ts_prefcolor)
-                ht_insert_path_for_nevra (files_skip_add, nevra, canonicalize_rpmfi_path (path),
-                                          NULL);
+              ht_insert_path_for_nevra (files_skip_add, winner->nevra,
+                                        get_ostree_path (self, file->path), NULL);
+              winner = file;
             }
+          else if (other_color & ts_prefcolor)
+            ht_insert_path_for_nevra (files_skip_add, file->nevra,
+                                      get_ostree_path (self, file->path), NULL);
         }
     }
 
   *out_files_skip_add = util::move_nullify (files_skip_add);
   *out_files_skip_delete = util::move_nullify (files_skip_delete);
+
+  if (out_files_changed)
+    {
+      g_autoptr (GPtrArray) files_changed_sorted = g_ptr_array_new ();
+      GLNX_HASH_TABLE_FOREACH (files_changed, const char *, path)
+        g_ptr_array_add (files_changed_sorted, (gpointer)path);
+      g_ptr_array_sort (files_changed_sorted, compare_strings);
+      *out_files_changed = util::move_nullify (files_changed_sorted);
+    }
   return TRUE;
 }
 
 typedef struct
 {
   GHashTable *files_skip;
-  GPtrArray *files_remove_regex;
+  GRegex *files_remove_regex;
 } FilterData;
 
 static OstreeRepoCheckoutFilterResult
 checkout_filter (OstreeRepo *self, const char *path, struct stat *st_buf, gpointer user_data)
 {
   GHashTable *files_skip = ((FilterData *)user_data)->files_skip;
-  GPtrArray *files_remove_regex = ((FilterData *)user_data)->files_remove_regex;
+  GRegex *files_remove_regex = ((FilterData *)user_data)->files_remove_regex;
 
   if (files_skip && g_hash_table_size (files_skip) > 0)
     {
@@ -2890,17 +3302,11 @@ checkout_filter (OstreeRepo *self, const char *path, struct stat *st_buf, gpoint
         return OSTREE_REPO_CHECKOUT_FILTER_SKIP;
     }
 
-  if (files_remove_regex)
+  if (files_remove_regex
+      && g_regex_match (files_remove_regex, path, static_cast<GRegexMatchFlags> (0), NULL))
     {
-      for (guint i = 0; i < files_remove_regex->len; i++)
-        {
-          auto regex = static_cast<GRegex *> (g_ptr_array_index (files_remove_regex, i));
-          if (g_regex_match (regex, path, static_cast<GRegexMatchFlags> (0), NULL))
-            {
-              g_print ("Skipping file %s from checkout\n", path);
-              return OSTREE_REPO_CHECKOUT_FILTER_SKIP;
-            }
-        }
+      g_print ("Skipping file %s from checkout\n", path);
+      return OSTREE_REPO_CHECKOUT_FILTER_SKIP;
     }
 
   /* Hack for nsswitch.conf: the glibc.i686 copy is identical to the one in glibc.x86_64,
@@ -2915,7 +3321,7 @@ checkout_filter (OstreeRepo *self, const char *path, struct stat *st_buf, gpoint
 
 static gboolean
 checkout_package (OstreeRepo *repo, int dfd, const char *path, OstreeRepoDevInoCache *devino_cache,
-                  const char *pkg_commit, GHashTable *files_skip, GPtrArray *files_remove_regex,
+                  const char *pkg_commit, GHashTable *files_skip, GRegex *files_remove_regex,
                   OstreeRepoCheckoutOverwriteMode ovwmode, gboolean force_copy_zerosized,
                   GCancellable *cancellable, GError **error)
 {
@@ -2940,8 +3346,7 @@ checkout_package (OstreeRepo *repo, int dfd, const char *path, OstreeRepoDevInoC
     files_skip,
     files_remove_regex,
   };
-  if ((files_skip && g_hash_table_size (files_skip) > 0)
-      || (files_remove_regex && files_remove_regex->len > 0))
+  if ((files_skip && g_hash_table_size (files_skip) > 0) || files_remove_regex)
     {
       opts.filter = checkout_filter;
       opts.filter_user_data = &filter_data;
@@ -2950,28 +3355,67 @@ checkout_package (OstreeRepo *repo, int dfd, const char *path, OstreeRepoDevInoC
   return ostree_repo_checkout_at (repo, &opts, dfd, path, pkg_commit, cancellable, error);
 }
 
+/* If called on compose-side, there may be files to remove from packages specified in the
+ * treefile.  We combine all of the patterns for a package into a single regex, so that
+ * checkout_filter() only needs one pass over each path, and cache that by package name.
+ * Sets @out_regex to %NULL if there aren't any; the result is owned by the context.
+ *
+ * The alternatives are wrapped in a branch reset group, so that any backreferences in
+ * each pattern keep referring to that pattern's own groups.
+ */
 static gboolean
-checkout_package_into_root (RpmOstreeContext *self, DnfPackage *pkg, int dfd, const char *path,
-                            OstreeRepoDevInoCache *devino_cache, const char *pkg_commit,
-                            GHashTable *files_skip, OstreeRepoCheckoutOverwriteMode ovwmode,
-                            GCancellable *cancellable, GError **error)
+get_files_remove_regex (RpmOstreeContext *self, DnfPackage *pkg, GRegex **out_regex,
+                        GError **error)
 {
-  /* If called on compose-side, there may be files to remove from packages specified in the
-   * treefile. */
-  g_autoptr (GPtrArray) files_remove_regex = NULL;
-  auto files_remove_regex_patterns
-      = self->treefile_rs->get_files_remove_regex (dnf_package_get_name (pkg));
-  files_remove_regex
-      = g_ptr_array_new_full (files_remove_regex_patterns.size (), (GDestroyNotify)g_regex_unref);
-  for (auto &pattern : files_remove_regex_patterns)
-    {
-      GRegex *regex = g_regex_new (pattern.c_str (), G_REGEX_JAVASCRIPT_COMPAT,
-                                   static_cast<GRegexMatchFlags> (0), NULL);
+  const char *name = dnf_package_get_name (pkg);
+  gpointer cached = NULL;
+  if (g_hash_table_lookup_extended (self->files_remove_regex, name, NULL, &cached))
+    {
+      *out_regex = static_cast<GRegex *> (cached);
+      return TRUE;
+    }
+
+  auto files_remove_regex_patterns = self->treefile_rs->get_files_remove_regex (name);
+  g_autoptr (GRegex) regex = NULL;
+  if (files_remove_regex_patterns.size () > 0)
+    {
+      g_autoptr (GString) combined = g_string_new ("(?|");
+      for (auto &pattern : files_remove_regex_patterns)
+        {
+          /* Check them individually first so that errors point at the culprit */
+          g_autoptr (GRegex) single
+              = g_regex_new (pattern.c_str (), G_REGEX_JAVASCRIPT_COMPAT,
+                             static_cast<GRegexMatchFlags> (0), error);
+          if (!single)
+            return glnx_prefix_error (error, "Invalid remove-from-packages regex for %s", name);
+          if (combined->len > strlen ("(?|"))
+            g_string_append_c (combined, '|');
+          g_string_append_printf (combined, "(?:%s)", pattern.c_str ());
+        }
+      g_string_append_c (combined, ')');
+
+      regex = g_regex_new (
+          combined->str,
+          static_cast<GRegexCompileFlags> (G_REGEX_JAVASCRIPT_COMPAT | G_REGEX_OPTIMIZE),
+          static_cast<GRegexMatchFlags> (0), error);
       if (!regex)
-        return FALSE;
-      g_ptr_array_add (files_remove_regex, regex);
+        return glnx_prefix_error (error, "Combining remove-from-packages regexes for %s", name);
     }
 
+  *out_regex = regex;
+  g_hash_table_insert (self->files_remove_regex, g_strdup (name), util::move_nullify (regex));
+  return TRUE;
+}
+
+/* Note this may be called from multiple threads at once; see checkout_packages_parallel() */
+static gboolean
+checkout_package_into_root_impl (RpmOstreeContext *self, DnfPackage *pkg, int dfd,
+                                 const char *path, OstreeRepoDevInoCache *devino_cache,
+                                 const char *pkg_commit, GHashTable *files_skip,
+                                 GRegex *files_remove_regex,
+                                 OstreeRepoCheckoutOverwriteMode ovwmode,
+                                 GCancellable *cancellable, GError **error)
+{
   OstreeRepo *pkgcache_repo = get_pkgcache_repo (self);
 
   /* The below is currently TRUE only in the --unified-core path. We probably want to
@@ -2999,53 +3443,333 @@ checkout_package_into_root (RpmOstreeContext *self, DnfPackage *pkg, int dfd, co
   return TRUE;
 }
 
-static Header
-get_rpmdb_pkg_header (rpmts rpmdb_ts, DnfPackage *pkg, GCancellable *cancellable, GError **error)
+static gboolean
+checkout_package_into_root (RpmOstreeContext *self, DnfPackage *pkg, int dfd, const char *path,
+                            OstreeRepoDevInoCache *devino_cache, const char *pkg_commit,
+                            GHashTable *files_skip, OstreeRepoCheckoutOverwriteMode ovwmode,
+                            GCancellable *cancellable, GError **error)
 {
-  g_auto (rpmts) rpmdb_ts_owned = NULL;
-  if (!rpmdb_ts) /* allow callers to pass NULL */
-    rpmdb_ts = rpmdb_ts_owned = rpmtsCreate ();
-  (void)rpmdb_ts_owned; /* Pacify static analysis */
+  GRegex *files_remove_regex = NULL;
+  if (!get_files_remove_regex (self, pkg, &files_remove_regex, error))
+    return FALSE;
 
-  unsigned int dbid = dnf_package_get_rpmdbid (pkg);
-  g_assert (dbid > 0);
+  return checkout_package_into_root_impl (self, pkg, dfd, path, devino_cache, pkg_commit,
+                                          files_skip, files_remove_regex, ovwmode, cancellable,
+                                          error);
+}
 
-  g_auto (rpmdbMatchIterator) it
-      = rpmtsInitIterator (rpmdb_ts, RPMDBI_PACKAGES, &dbid, sizeof (dbid));
+typedef struct
+{
+  char *meta; /* For directories, mode and ownership; NULL otherwise */
+  gboolean conflict;
+} CheckoutPathInfo;
 
-  Header hdr = it ? rpmdbNextIterator (it) : NULL;
-  if (hdr == NULL)
-    return (Header)glnx_null_throw (error, "Failed to find package '%s' in rpmdb",
-                                    dnf_package_get_nevra (pkg));
+static void
+checkout_path_info_free (CheckoutPathInfo *info)
+{
+  g_free (info->meta);
+  g_free (info);
+}
 
-  return headerLink (hdr);
+/* If @path is @dir or under it, return the remainder (possibly ""), else NULL */
+static const char *
+path_strip_dir (const char *path, const char *dir)
+{
+  const char *rest = g_str_has_prefix (path, dir) ? path + strlen (dir) : NULL;
+  if (rest && (*rest == '\0' || *rest == '/'))
+    return rest;
+  return NULL;
 }
 
-/* Scan rootfs and build up a mapping like lib → usr/lib, etc. */
-static gboolean
-build_rootfs_usrlinks (RpmOstreeContext *self, GError **error)
+/* Map a path from a package's file list to where it will end up in the
+ * checkout.  This errs on the side of mapping distinct paths together, since
+ * e.g. we can't know yet whether /usr/sbin will be a symlink to bin. */
+static char *
+canonicalize_checkout_path (RpmOstreeContext *self, const char *path)
 {
-  g_assert (!self->rootfs_usrlinks);
-  self->rootfs_usrlinks = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  const char *canonical = get_ostree_path (self, path);
+  const char *rel = canonical + strspn (canonical, "/");
 
-  g_auto (GLnxDirFdIterator) dfd_iter = {
-    FALSE,
-  };
-  if (!glnx_dirfd_iterator_init_at (self->tmprootfs_dfd, ".", TRUE, &dfd_iter, error))
-    return FALSE;
-  while (TRUE)
+  static const char *const usrmove_dirs[] = { "bin", "sbin", "lib", "lib64" };
+  g_autofree char *usr_rel = NULL;
+  for (guint i = 0; i < G_N_ELEMENTS (usrmove_dirs) && !usr_rel; i++)
     {
-      struct dirent *dent = NULL;
-      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&dfd_iter, &dent, NULL, error))
-        return FALSE;
-      if (dent == NULL)
-        break;
+      if (path_strip_dir (rel, usrmove_dirs[i]))
+        usr_rel = g_strconcat ("usr/", rel, NULL);
+    }
+  if (usr_rel)
+    rel = usr_rel;
 
-      if (dent->d_type != DT_LNK)
-        continue;
+  const char *sbin_rest = path_strip_dir (rel, "usr/sbin");
+  if (sbin_rest)
+    return g_strconcat ("usr/bin", sbin_rest, NULL);
+  return g_strdup (rel);
+}
 
-      g_autofree char *link = glnx_readlinkat_malloc (dfd_iter.fd, dent->d_name, NULL, error);
-      if (!link)
+/* Record that a package ships @path (taking ownership of it), with directory
+ * metadata @meta (or NULL for anything else), noting whether that conflicts
+ * with other packages. */
+static void
+add_checkout_path (GHashTable *paths, GHashTable *pkg_paths, char *path, const char *meta)
+{
+  g_autofree char *path_owned = path;
+  if (g_hash_table_contains (pkg_paths, path))
+    return;
+
+  char *key = NULL;
+  CheckoutPathInfo *entry = NULL;
+  if (g_hash_table_lookup_extended (paths, path, (gpointer *)&key, (gpointer *)&entry))
+    {
+      /* Directories can be shared, as long as there's no question of what
+       * they should look like */
+      if (entry->meta == NULL || meta == NULL || !g_str_equal (entry->meta, meta))
+        entry->conflict = TRUE;
+    }
+  else
+    {
+      entry = g_new0 (CheckoutPathInfo, 1);
+      entry->meta = g_strdup (meta);
+      key = util::move_nullify (path_owned);
+      g_hash_table_insert (paths, key, entry);
+    }
+  g_hash_table_add (pkg_paths, key);
+}
+
+/* Find the packages which must be checked out serially.  Checking out a
+ * package with UNION_IDENTICAL only creates directories which don't exist
+ * yet, so the result depends on ordering whenever two packages ship the same
+ * non-directory path, the same directory with different metadata (including
+ * parent directories ostree created implicitly on import), or a path beneath
+ * another package's symlink.  Everything else can go in any order.
+ */
+static GHashTable *
+find_order_sensitive_packages (RpmOstreeContext *self, GPtrArray *candidates)
+{
+  g_autoptr (GHashTable) paths = g_hash_table_new_full (
+      g_str_hash, g_str_equal, g_free, (GDestroyNotify)checkout_path_info_free);
+  g_autoptr (GPtrArray) pkg_paths = g_ptr_array_new_with_free_func (
+      (GDestroyNotify)g_hash_table_unref);
+
+  for (guint i = 0; i < candidates->len; i++)
+    {
+      auto te = static_cast<rpmte> (candidates->pdata[i]);
+      GHashTable *seen = g_hash_table_new (g_str_hash, g_str_equal);
+      g_ptr_array_add (pkg_paths, seen);
+
+      g_auto (rpmfiles) files = rpmteFiles (te);
+      g_auto (rpmfi) fi = rpmfilesIter (files, RPMFI_ITER_FWD);
+      while (rpmfiNext (fi) >= 0)
+        {
+          if (rpmfiFFlags (fi) & RPMFILE_GHOST)
+            continue;
+          const rpm_mode_t mode = rpmfiFMode (fi);
+          g_autofree char *meta = NULL;
+          if (S_ISDIR (mode))
+            meta = g_strdup_printf ("%o:%s:%s", (mode | S_IWUSR) & 07777, rpmfiFUser (fi),
+                                    rpmfiFGroup (fi));
+          add_checkout_path (paths, seen, canonicalize_checkout_path (self, rpmfiFN (fi)), meta);
+        }
+
+      /* Now the parents; we do this in a second pass so that explicitly
+       * owned directories take precedence */
+      g_autoptr (GPtrArray) own = g_ptr_array_new ();
+      GLNX_HASH_TABLE_FOREACH (seen, const char *, path)
+        g_ptr_array_add (own, (gpointer)path);
+      for (guint j = 0; j < own->len; j++)
+        {
+          g_autofree char *parent = g_path_get_dirname ((const char *)own->pdata[j]);
+          while (!g_str_equal (parent, "."))
+            {
+              char *next = g_path_get_dirname (parent);
+              add_checkout_path (paths, seen, util::move_nullify (parent), "755:root:root");
+              parent = next;
+            }
+        }
+    }
+
+  GHashTable *ret = g_hash_table_new (NULL, NULL);
+  for (guint i = 0; i < candidates->len; i++)
+    {
+      auto seen = static_cast<GHashTable *> (pkg_paths->pdata[i]);
+      GLNX_HASH_TABLE_FOREACH (seen, const char *, path)
+        {
+          auto entry = static_cast<CheckoutPathInfo *> (g_hash_table_lookup (paths, path));
+          if (entry->conflict)
+            {
+              g_hash_table_add (ret, candidates->pdata[i]);
+              break;
+            }
+        }
+    }
+  return ret;
+}
+
+typedef struct
+{
+  DnfPackage *pkg;
+  const char *pkg_commit;
+  GHashTable *files_skip;
+  GRegex *files_remove_regex; /* Owned by the context */
+} CheckoutTaskData;
+
+static void
+checkout_task_data_free (CheckoutTaskData *tdata)
+{
+  if (!tdata)
+    return;
+  g_object_unref (tdata->pkg);
+  g_free (tdata);
+}
+
+static void
+checkout_in_thread (GTask *task, gpointer source, gpointer task_data, GCancellable *cancellable)
+{
+  g_autoptr (GError) local_error = NULL;
+  auto self = static_cast<RpmOstreeContext *> (source);
+  auto tdata = static_cast<CheckoutTaskData *> (task_data);
+
+  /* No devino cache; see checkout_packages_parallel() */
+  if (!checkout_package_into_root_impl (self, tdata->pkg, self->tmprootfs_dfd, ".", NULL,
+                                        tdata->pkg_commit, tdata->files_skip,
+                                        tdata->files_remove_regex,
+                                        OSTREE_REPO_CHECKOUT_OVERWRITE_UNION_IDENTICAL,
+                                        cancellable, &local_error))
+    g_task_return_error (task, util::move_nullify (local_error));
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+typedef struct
+{
+  RpmOstreeContext *self;
+  rpmostreecxx::Progress *progress;
+  guint n_pending;
+  guint *n_done;
+} RpmOstreeAsyncCheckoutData;
+
+static void
+on_async_checkout_done (GObject *obj, GAsyncResult *res, gpointer user_data)
+{
+  auto data = static_cast<RpmOstreeAsyncCheckoutData *> (user_data);
+  RpmOstreeContext *self = data->self;
+  if (!g_task_propagate_boolean ((GTask *)res, self->async_error ? NULL : &self->async_error))
+    {
+      g_assert (self->async_error != NULL);
+      if (self->async_cancellable)
+        g_cancellable_cancel (self->async_cancellable);
+    }
+
+  g_assert_cmpint (data->n_pending, >, 0);
+  data->n_pending--;
+  (*data->n_done)++;
+  data->progress->nitems_update (*data->n_done);
+  if (data->n_pending == 0)
+    self->async_running = FALSE;
+}
+
+/* Check out @pkgs in parallel; they mustn't overlap, see
+ * find_order_sensitive_packages().  The devino cache isn't thread-safe, so
+ * this can't be used if we have one.  Bumps @n_done as packages complete.
+ */
+static gboolean
+checkout_packages_parallel (RpmOstreeContext *self, GPtrArray *pkgs,
+                            GHashTable *pkg_to_ostree_commit, GHashTable *files_skip,
+                            rpmostreecxx::Progress &progress, guint *n_done,
+                            GCancellable *cancellable, GError **error)
+{
+  g_assert (self->devino_cache == NULL);
+  if (pkgs->len == 0)
+    return TRUE;
+
+  /* Gather everything up front so the threads don't need to touch the treefile */
+  g_autoptr (GPtrArray) tdatas
+      = g_ptr_array_new_with_free_func ((GDestroyNotify)checkout_task_data_free);
+  for (guint i = 0; i < pkgs->len; i++)
+    {
+      auto pkg = static_cast<DnfPackage *> (pkgs->pdata[i]);
+      CheckoutTaskData *tdata = g_new0 (CheckoutTaskData, 1);
+      g_ptr_array_add (tdatas, tdata);
+      tdata->pkg = (DnfPackage *)g_object_ref (pkg);
+      tdata->pkg_commit
+          = static_cast<const char *> (g_hash_table_lookup (pkg_to_ostree_commit, pkg));
+      tdata->files_skip = files_skip;
+      if (!get_files_remove_regex (self, pkg, &tdata->files_remove_regex, error))
+        return FALSE;
+    }
+
+  self->async_running = TRUE;
+  self->async_cancellable = cancellable;
+  self->async_error = NULL;
+  progress.set_sub_message ("");
+  RpmOstreeAsyncCheckoutData data = { self, &progress, pkgs->len, n_done };
+  for (guint i = 0; i < tdatas->len; i++)
+    {
+      g_autoptr (GTask) task = g_task_new (self, cancellable, on_async_checkout_done, &data);
+      g_task_set_task_data (task, tdatas->pdata[i], (GDestroyNotify)checkout_task_data_free);
+      tdatas->pdata[i] = NULL;
+      g_task_run_in_thread (task, checkout_in_thread);
+    }
+
+  /* Wait for all of the checkouts to complete */
+  GMainContext *mainctx = g_main_context_get_thread_default ();
+  while (self->async_running)
+    g_main_context_iteration (mainctx, TRUE);
+  if (self->async_error)
+    {
+      g_propagate_error (error, util::move_nullify (self->async_error));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static Header
+get_rpmdb_pkg_header (rpmts rpmdb_ts, DnfPackage *pkg, GCancellable *cancellable, GError **error)
+{
+  g_auto (rpmts) rpmdb_ts_owned = NULL;
+  if (!rpmdb_ts) /* allow callers to pass NULL */
+    rpmdb_ts = rpmdb_ts_owned = rpmtsCreate ();
+  (void)rpmdb_ts_owned; /* Pacify static analysis */
+
+  unsigned int dbid = dnf_package_get_rpmdbid (pkg);
+  g_assert (dbid > 0);
+
+  g_auto (rpmdbMatchIterator) it
+      = rpmtsInitIterator (rpmdb_ts, RPMDBI_PACKAGES, &dbid, sizeof (dbid));
+
+  Header hdr = it ? rpmdbNextIterator (it) : NULL;
+  if (hdr == NULL)
+    return (Header)glnx_null_throw (error, "Failed to find package '%s' in rpmdb",
+                                    dnf_package_get_nevra (pkg));
+
+  return headerLink (hdr);
+}
+
+/* Scan rootfs and build up a mapping like lib → usr/lib, etc. */
+static gboolean
+build_rootfs_usrlinks (RpmOstreeContext *self, GError **error)
+{
+  g_assert (!self->rootfs_usrlinks);
+  self->rootfs_usrlinks = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  g_auto (GLnxDirFdIterator) dfd_iter = {
+    FALSE,
+  };
+  if (!glnx_dirfd_iterator_init_at (self->tmprootfs_dfd, ".", TRUE, &dfd_iter, error))
+    return FALSE;
+  while (TRUE)
+    {
+      struct dirent *dent = NULL;
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&dfd_iter, &dent, NULL, error))
+        return FALSE;
+      if (dent == NULL)
+        break;
+
+      if (dent->d_type != DT_LNK)
+        continue;
+
+      g_autofree char *link = glnx_readlinkat_malloc (dfd_iter.fd, dent->d_name, NULL, error);
+      if (!link)
         return FALSE;
       const char *link_rel = link + strspn (link, "/");
       if (g_str_has_prefix (link_rel, "usr/"))
@@ -3068,13 +3792,30 @@ compare_strlen (const void *a, const void *b, void *data)
   return 1;
 }
 
-/* Given a single package, remove its files (non-directories), unless they're
- * included in @files_skip.  Add its directories to @dirs_to_remove, which
- * are handled in a second pass.
+/* Queue @path (relative) for deletion in @paths_to_delete, which maps parent
+ * directories to arrays of names in them.
+ */
+static void
+queue_path_for_deletion (GHashTable *paths_to_delete, const char *path)
+{
+  const char *slash = strrchr (path, '/');
+  g_assert (slash != NULL);
+  g_autofree char *dir = g_strndup (path, slash - path);
+  auto names = static_cast<GPtrArray *> (g_hash_table_lookup (paths_to_delete, dir));
+  if (!names)
+    {
+      names = g_ptr_array_new_with_free_func (g_free);
+      g_hash_table_insert (paths_to_delete, util::move_nullify (dir), names);
+    }
+  g_ptr_array_add (names, g_strdup (slash + 1));
+}
+
+/* Given a single package, queue its files for deletion in @paths_to_delete
+ * (see delete_queued_paths()), unless they're included in @files_skip.
  */
 static gboolean
 delete_package_from_root (RpmOstreeContext *self, rpmte pkg, int rootfs_dfd, GHashTable *files_skip,
-                          GSequence *dirs_to_remove, GCancellable *cancellable, GError **error)
+                          GHashTable *paths_to_delete, GCancellable *cancellable, GError **error)
 {
   g_auto (rpmfiles) files = rpmteFiles (pkg);
   /* NB: new librpm uses RPMFI_ITER_BACK here to empty out dirs before deleting them using
@@ -3095,42 +3836,16 @@ delete_package_from_root (RpmOstreeContext *self, rpmte pkg, int rootfs_dfd, GHa
         continue;
 
       g_assert (fn != NULL);
-      fn += strspn (fn, "/");
-      g_assert (fn[0]);
+      g_assert (fn[strspn (fn, "/")]);
 
-      /* Be sure we've canonicalized usr/ */
-      g_autofree char *fn_owned = canonicalize_non_usrmove_path (self, fn);
-      if (fn_owned)
-        fn = fn_owned;
-      (void)fn_owned; /* Pacify static analysis */
-
-      /* Convert to ostree convention. */
-      auto translated = rpmostreecxx::translate_path_for_ostree (fn);
-      if (translated.size () != 0)
-        fn = translated.c_str ();
+      /* Be sure we've canonicalized usr/, and convert to ostree convention. */
+      fn = get_rootfs_path (self, fn, TRUE);
 
       /* for now, we only remove files from /usr */
       if (!g_str_has_prefix (fn, "usr/"))
         continue;
 
-      /* match librpm: check the actual file type on disk rather than the rpmdb */
-      struct stat stbuf;
-      if (!glnx_fstatat_allow_noent (rootfs_dfd, fn, &stbuf, AT_SYMLINK_NOFOLLOW, error))
-        return FALSE;
-      if (errno == ENOENT)
-        continue;
-
-      /* Delete files first, we'll handle directories next */
-      if (S_ISDIR (stbuf.st_mode))
-        g_sequence_insert_sorted (dirs_to_remove, g_strdup (fn), compare_strlen, NULL);
-      else
-        {
-          if (unlinkat (rootfs_dfd, fn, 0) < 0)
-            {
-              if (errno != ENOENT)
-                return glnx_throw_errno_prefix (error, "unlinkat(%s)", fn);
-            }
-        }
+      queue_path_for_deletion (paths_to_delete, fn);
     }
 
   /* And finally, delete any automatically generated tmpfiles.d dropin. */
@@ -3159,8 +3874,168 @@ delete_package_from_root (RpmOstreeContext *self, rpmte pkg, int rootfs_dfd, GHa
   return TRUE;
 }
 
+typedef struct
+{
+  const char *dir;
+  GPtrArray *names;
+  int rootfs_dfd;
+} DeleteTaskData;
+
+/* Delete the non-directories among the names queued for one directory, and
+ * add the directories among them to @dirs.
+ */
+static gboolean
+delete_queued_names (DeleteTaskData *tdata, GPtrArray *dirs, GError **error)
+{
+  glnx_autofd int dfd = glnx_opendirat_with_errno (tdata->rootfs_dfd, tdata->dir, TRUE);
+  if (dfd < 0)
+    {
+      if (errno == ENOENT || errno == ENOTDIR)
+        return TRUE;
+      return glnx_throw_errno_prefix (error, "opendirat(%s)", tdata->dir);
+    }
+
+  for (guint i = 0; i < tdata->names->len; i++)
+    {
+      auto name = static_cast<const char *> (tdata->names->pdata[i]);
+
+      /* match librpm: check the actual file type on disk rather than the rpmdb */
+      struct stat stbuf;
+      if (fstatat (dfd, name, &stbuf, AT_SYMLINK_NOFOLLOW) < 0)
+        {
+          if (errno == ENOENT)
+            continue;
+          return glnx_throw_errno_prefix (error, "fstatat(%s/%s)", tdata->dir, name);
+        }
+
+      /* Delete files first, we'll handle directories next */
+      if (S_ISDIR (stbuf.st_mode))
+        g_ptr_array_add (dirs, g_strconcat (tdata->dir, "/", name, NULL));
+      else if (unlinkat (dfd, name, 0) < 0 && errno != ENOENT)
+        return glnx_throw_errno_prefix (error, "unlinkat(%s/%s)", tdata->dir, name);
+    }
+
+  return TRUE;
+}
+
+static void
+delete_in_thread (GTask *task, gpointer source, gpointer task_data, GCancellable *cancellable)
+{
+  g_autoptr (GError) local_error = NULL;
+  auto tdata = static_cast<DeleteTaskData *> (task_data);
+  g_autoptr (GPtrArray) dirs = g_ptr_array_new_with_free_func (g_free);
+  if (!delete_queued_names (tdata, dirs, &local_error))
+    g_task_return_error (task, util::move_nullify (local_error));
+  else
+    g_task_return_pointer (task, util::move_nullify (dirs), (GDestroyNotify)g_ptr_array_unref);
+}
+
+typedef struct
+{
+  RpmOstreeContext *self;
+  GPtrArray *tdatas; /* DeleteTaskData */
+  GSequence *dirs_to_remove;
+} RpmOstreeDeleteData;
+
+static void async_delete_mainctx_iter (RpmOstreeDeleteData *ddata);
+
+static void
+on_async_delete_done (GObject *obj, GAsyncResult *res, gpointer user_data)
+{
+  auto ddata = static_cast<RpmOstreeDeleteData *> (user_data);
+  RpmOstreeContext *self = ddata->self;
+  g_autoptr (GPtrArray) dirs = static_cast<GPtrArray *> (
+      g_task_propagate_pointer ((GTask *)res, self->async_error ? NULL : &self->async_error));
+  if (!dirs)
+    {
+      if (self->async_cancellable)
+        g_cancellable_cancel (self->async_cancellable);
+    }
+  else
+    {
+      for (guint i = 0; i < dirs->len; i++)
+        g_sequence_insert_sorted (ddata->dirs_to_remove, g_strdup ((char *)dirs->pdata[i]),
+                                  compare_strlen, NULL);
+    }
+
+  g_assert_cmpint (self->n_async_running, >, 0);
+  self->n_async_running--;
+  async_delete_mainctx_iter (ddata);
+}
+
+/* Like async_relabel_mainctx_iter(); keep a bounded number of directories
+ * being processed until we're done. */
+static void
+async_delete_mainctx_iter (RpmOstreeDeleteData *ddata)
+{
+  RpmOstreeContext *self = ddata->self;
+
+  while (self->async_index < ddata->tdatas->len && self->n_async_running < self->n_async_max
+         && self->async_error == NULL)
+    {
+      g_autoptr (GTask) task
+          = g_task_new (self, self->async_cancellable, on_async_delete_done, ddata);
+      g_task_set_task_data (task, ddata->tdatas->pdata[self->async_index], NULL);
+      g_task_run_in_thread (task, delete_in_thread);
+      self->async_index++;
+      self->n_async_running++;
+    }
+
+  if (self->n_async_running == 0)
+    {
+      self->async_running = FALSE;
+      g_main_context_wakeup (g_main_context_get_thread_default ());
+    }
+}
+
+/* Delete the files queued by delete_package_from_root().  Each directory is
+ * only opened once, and directories are processed in parallel.  Any paths
+ * which turn out to be directories are added to @dirs_to_remove, which are
+ * handled in a second pass.
+ */
+static gboolean
+delete_queued_paths (RpmOstreeContext *self, int rootfs_dfd, GHashTable *paths_to_delete,
+                     GSequence *dirs_to_remove, GCancellable *cancellable, GError **error)
+{
+  if (g_hash_table_size (paths_to_delete) == 0)
+    return TRUE;
+
+  g_autoptr (GPtrArray) tdatas = g_ptr_array_new_with_free_func (g_free);
+  GLNX_HASH_TABLE_FOREACH_KV (paths_to_delete, const char *, dir, GPtrArray *, names)
+    {
+      DeleteTaskData *tdata = g_new0 (DeleteTaskData, 1);
+      tdata->dir = dir;
+      tdata->names = names;
+      tdata->rootfs_dfd = rootfs_dfd;
+      g_ptr_array_add (tdatas, tdata);
+    }
+
+  RpmOstreeDeleteData ddata = { self, tdatas, dirs_to_remove };
+  self->async_running = TRUE;
+  self->async_index = 0;
+  self->n_async_running = 0;
+  /* Mostly waiting on the filesystem */
+  self->n_async_max = g_get_num_processors ();
+  self->async_cancellable = cancellable;
+  self->async_error = NULL;
+  async_delete_mainctx_iter (&ddata);
+
+  /* Wait for all of the deletions to complete */
+  GMainContext *mainctx = g_main_context_get_thread_default ();
+  while (self->async_running)
+    g_main_context_iteration (mainctx, TRUE);
+
+  if (self->async_error)
+    {
+      g_propagate_error (error, util::move_nullify (self->async_error));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 /* Process the directories which we were queued up by
- * delete_package_from_root().  We ignore non-empty directories
+ * delete_queued_paths().  We ignore non-empty directories
  * since it's valid for a package being replaced to own a directory
  * to which dependent packages install files (e.g. systemd).
  */
@@ -3191,10 +4066,42 @@ handle_package_deletion_directories (int rootfs_dfd, GSequence *dirs_to_remove,
   return TRUE;
 }
 
+#ifndef FICLONE
+#define FICLONE _IOW (0x94, 9, int)
+#endif
+
+/* Can files in @dfd be reflinked?  We check by trying to clone @name (which
+ * must be a regular file) into an anonymous tmpfile.  This is the same thing
+ * ostree_break_hardlink() tries first, so it tells us whether it will clone
+ * or copy. */
+static gboolean
+dir_supports_reflink (int dfd, const char *name, gboolean *out_supported, GError **error)
+{
+  glnx_autofd int src_fd = -1;
+  if (!glnx_openat_rdonly (dfd, name, FALSE, &src_fd, error))
+    return FALSE;
+  g_auto (GLnxTmpfile) tmpf = {
+    0,
+  };
+  if (!glnx_open_tmpfile_linkable_at (dfd, ".", O_WRONLY | O_CLOEXEC, &tmpf, error))
+    return FALSE;
+
+  if (ioctl (tmpf.fd, FICLONE, src_fd) == 0)
+    *out_supported = TRUE;
+  else if (errno == EOPNOTSUPP || errno == ENOTTY || errno == EINVAL || errno == EXDEV)
+    *out_supported = FALSE;
+  else
+    return glnx_throw_errno_prefix (error, "ioctl(FICLONE) %s", name);
+  return TRUE;
+}
+
 /* Given a directory referred to by @dfd and @dirpath, ensure that physical (or
- * reflink'd) copies of all files are done. */
+ * reflink'd) copies of all files are done.  The size of the files we broke
+ * hardlinks for is added to @out_bytes_cloned or @out_bytes_copied depending
+ * on whether the filesystem supports reflinks. */
 static gboolean
-break_hardlinks_at (int dfd, const char *dirpath, GCancellable *cancellable, GError **error)
+break_hardlinks_at (int dfd, const char *dirpath, guint64 *out_bytes_cloned,
+                    guint64 *out_bytes_copied, GCancellable *cancellable, GError **error)
 {
   g_auto (GLnxDirFdIterator) dfd_iter = {
     FALSE,
@@ -3202,6 +4109,9 @@ break_hardlinks_at (int dfd, const char *dirpath, GCancellable *cancellable, GEr
   if (!glnx_dirfd_iterator_init_at (dfd, dirpath, TRUE, &dfd_iter, error))
     return FALSE;
 
+  guint64 bytes_broken = 0;
+  gboolean checked_reflink = FALSE;
+  gboolean reflink = FALSE;
   while (TRUE)
     {
       struct dirent *dent = NULL;
@@ -3209,33 +4119,331 @@ break_hardlinks_at (int dfd, const char *dirpath, GCancellable *cancellable, GEr
         return FALSE;
       if (dent == NULL)
         break;
+
+      struct stat stbuf;
+      if (!glnx_fstatat (dfd_iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW, error))
+        return FALSE;
+      if (S_ISREG (stbuf.st_mode) && stbuf.st_nlink > 1)
+        {
+          if (!checked_reflink)
+            {
+              if (!dir_supports_reflink (dfd_iter.fd, dent->d_name, &reflink, error))
+                return FALSE;
+              checked_reflink = TRUE;
+            }
+          bytes_broken += stbuf.st_size;
+        }
+
       if (!ostree_break_hardlink (dfd_iter.fd, dent->d_name, FALSE, cancellable, error))
         return FALSE;
     }
 
+  *out_bytes_cloned = reflink ? bytes_broken : 0;
+  *out_bytes_copied = reflink ? 0 : bytes_broken;
+  return TRUE;
+}
+
+/* State shared by all of the relabel tasks; lives on the stack of
+ * relabel_if_necessary(), which waits for all of them.
+ */
+typedef struct
+{
+  RpmOstreeContext *self;
+  GMutex label_lock;
+  GHashTable *label_cache; /* "type:path" --> label, or NULL if unlabeled */
+  guint n_changed_objects;
+  guint n_changed_pkgs;
+} RpmOstreeRelabelData;
+
+/* Packages typically share most of their directories (/usr, /usr/bin,
+ * /usr/lib/.build-id, etc.), and label lookups aren't cheap, so cache them
+ * across packages.
+ */
+static gboolean
+relabel_lookup_label (RpmOstreeRelabelData *rdata, const char *path, guint32 mode,
+                      char **out_label, GCancellable *cancellable, GError **error)
+{
+  /* Only the file type matters for the lookup */
+  g_autofree char *key = g_strdup_printf ("%u:%s", mode & S_IFMT, path);
+  {
+    g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&rdata->label_lock);
+    gpointer cached = NULL;
+    if (g_hash_table_lookup_extended (rdata->label_cache, key, NULL, &cached))
+      {
+        *out_label = g_strdup ((const char *)cached);
+        return TRUE;
+      }
+  }
+
+  g_autofree char *label = NULL;
+  if (!ostree_sepolicy_get_label (rdata->self->sepolicy, path, mode, &label, cancellable, error))
+    return FALSE;
+
+  {
+    g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&rdata->label_lock);
+    g_hash_table_replace (rdata->label_cache, util::move_nullify (key), g_strdup (label));
+  }
+  *out_label = util::move_nullify (label);
+  return TRUE;
+}
+
+/* Return a copy of @xattrs with the SELinux label replaced by @label, or %NULL
+ * if the label already matches.  This mirrors what the commit modifier does
+ * when given a policy.
+ */
+static GVariant *
+relabel_xattrs (GVariant *xattrs, const char *label)
+{
+  const char *cur_label = NULL;
+  gsize cur_label_len = 0;
+  g_autoptr (GVariantBuilder) builder = g_variant_builder_new (G_VARIANT_TYPE ("a(ayay)"));
+  const guint n = xattrs ? g_variant_n_children (xattrs) : 0;
+  for (guint i = 0; i < n; i++)
+    {
+      const char *name = NULL;
+      g_autoptr (GVariant) value = NULL;
+      g_variant_get_child (xattrs, i, "(^&ay@ay)", &name, &value);
+      if (g_str_equal (name, "security.selinux"))
+        {
+          cur_label = (const char *)g_variant_get_fixed_array (value, &cur_label_len, 1);
+          continue;
+        }
+      g_variant_builder_add (builder, "(^ay@ay)", name, value);
+    }
+
+  /* Stored labels include the trailing NUL */
+  if (cur_label && cur_label_len > 0 && cur_label[cur_label_len - 1] == '\0')
+    cur_label_len--;
+  if (label ? (cur_label && cur_label_len == strlen (label)
+               && memcmp (cur_label, label, cur_label_len) == 0)
+            : cur_label == NULL)
+    return NULL;
+
+  if (label)
+    g_variant_builder_add (builder, "(^ay@ay)", "security.selinux",
+                           g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE, label,
+                                                      strlen (label) + 1, 1));
+  return g_variant_ref_sink (g_variant_builder_end (builder));
+}
+
+/* Per-package relabel state */
+typedef struct
+{
+  RpmOstreeRelabelData *rdata;
+  OstreeRepo *repo;
+  /* If we have a label manifest, the paths whose label changed, and their
+   * parent directories; only those need to be looked at. */
+  GHashTable *changed_paths;
+  GHashTable *changed_dirs;
+  RpmOstreeLabelManifest *manifest; /* Updated with the new labels */
+  guint n_changed;                  /* Objects rewritten */
+} RelabelPkgState;
+
+/* Relabel a single content object; @inout_checksum is replaced if the label
+ * changed. */
+static gboolean
+relabel_file (RelabelPkgState *state, const char *path, char **inout_checksum,
+              GCancellable *cancellable, GError **error)
+{
+  OstreeRepo *repo = state->repo;
+  g_autoptr (GFileInfo) finfo = NULL;
+  g_autoptr (GVariant) xattrs = NULL;
+  if (!ostree_repo_load_file (repo, *inout_checksum, NULL, &finfo, &xattrs, cancellable, error))
+    return FALSE;
+
+  const guint32 mode = g_file_info_get_attribute_uint32 (finfo, "unix::mode");
+  g_autofree char *label = NULL;
+  if (!relabel_lookup_label (state->rdata, path, mode, &label, cancellable, error))
+    return FALSE;
+  rpmostree_label_manifest_add (state->manifest, path, mode, label);
+  g_autoptr (GVariant) new_xattrs = relabel_xattrs (xattrs, label);
+  if (!new_xattrs)
+    return TRUE;
+
+  /* Only now do we need the content */
+  g_autoptr (GInputStream) input = NULL;
+  if (!ostree_repo_load_file (repo, *inout_checksum, &input, NULL, NULL, cancellable, error))
+    return FALSE;
+  g_autoptr (GInputStream) content = NULL;
+  guint64 length = 0;
+  if (!ostree_raw_file_to_content_stream (input, finfo, new_xattrs, &content, &length,
+                                          cancellable, error))
+    return FALSE;
+  g_autofree guchar *csum = NULL;
+  if (!ostree_repo_write_content (repo, NULL, content, length, &csum, cancellable, error))
+    return glnx_prefix_error (error, "Writing %s", path);
+
+  g_free (*inout_checksum);
+  *inout_checksum = ostree_checksum_from_bytes (csum);
+  state->n_changed++;
+  return TRUE;
+}
+
+/* Walk the tree @contents_csum/@meta_csum at @path, rewriting only the objects
+ * whose label differs under the new policy.  If nothing under @path changed,
+ * the checksums are left untouched and nothing is written.
+ */
+static gboolean
+relabel_dirtree (RelabelPkgState *state, const char *path, char **inout_contents_csum,
+                 char **inout_meta_csum, GCancellable *cancellable, GError **error)
+{
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
+
+  OstreeRepo *repo = state->repo;
+
+  /* We always check the directories we visit; it's cheap and this way we
+   * don't depend on the manifest having the implicitly created parents. */
+  g_autoptr (GVariant) dirmeta = NULL;
+  if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_DIR_META, *inout_meta_csum, &dirmeta,
+                                 error))
+    return FALSE;
+  guint32 uid, gid, mode;
+  g_autoptr (GVariant) dir_xattrs = NULL;
+  g_variant_get (dirmeta, "(uuu@a(ayay))", &uid, &gid, &mode, &dir_xattrs);
+  g_autofree char *dir_label = NULL;
+  if (!relabel_lookup_label (state->rdata, path, GUINT32_FROM_BE (mode), &dir_label, cancellable,
+                             error))
+    return FALSE;
+  rpmostree_label_manifest_add (state->manifest, path, GUINT32_FROM_BE (mode), dir_label);
+  g_autoptr (GVariant) new_dir_xattrs = relabel_xattrs (dir_xattrs, dir_label);
+  if (new_dir_xattrs)
+    {
+      g_autoptr (GVariant) new_dirmeta
+          = g_variant_ref_sink (g_variant_new ("(uuu@a(ayay))", uid, gid, mode, new_dir_xattrs));
+      g_autofree guchar *csum = NULL;
+      if (!ostree_repo_write_metadata (repo, OSTREE_OBJECT_TYPE_DIR_META, NULL, new_dirmeta, &csum,
+                                       cancellable, error))
+        return FALSE;
+      g_free (*inout_meta_csum);
+      *inout_meta_csum = ostree_checksum_from_bytes (csum);
+      state->n_changed++;
+    }
+
+  const guint n_changed_orig = state->n_changed;
+  g_autoptr (GVariant) dirtree = NULL;
+  if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_DIR_TREE, *inout_contents_csum,
+                                 &dirtree, error))
+    return FALSE;
+
+  /* Entries are already sorted by name; we preserve the ordering */
+  g_autoptr (GVariant) files = g_variant_get_child_value (dirtree, 0);
+  g_autoptr (GVariantBuilder) files_builder = g_variant_builder_new (G_VARIANT_TYPE ("a(say)"));
+  const guint n_files = g_variant_n_children (files);
+  for (guint i = 0; i < n_files; i++)
+    {
+      const char *name = NULL;
+      g_autoptr (GVariant) csum_v = NULL;
+      g_variant_get_child (files, i, "(&s@ay)", &name, &csum_v);
+      g_autofree char *checksum = ostree_checksum_from_bytes_v (csum_v);
+      g_autofree char *child_path = g_build_filename (path, name, NULL);
+      if (!state->changed_paths || g_hash_table_contains (state->changed_paths, child_path))
+        {
+          if (!relabel_file (state, child_path, &checksum, cancellable, error))
+            return FALSE;
+        }
+      g_variant_builder_add (files_builder, "(s@ay)", name, ostree_checksum_to_bytes_v (checksum));
+    }
+
+  g_autoptr (GVariant) dirs = g_variant_get_child_value (dirtree, 1);
+  g_autoptr (GVariantBuilder) dirs_builder = g_variant_builder_new (G_VARIANT_TYPE ("a(sayay)"));
+  const guint n_dirs = g_variant_n_children (dirs);
+  for (guint i = 0; i < n_dirs; i++)
+    {
+      const char *name = NULL;
+      g_autoptr (GVariant) contents_v = NULL;
+      g_autoptr (GVariant) meta_v = NULL;
+      g_variant_get_child (dirs, i, "(&s@ay@ay)", &name, &contents_v, &meta_v);
+      g_autofree char *contents_csum = ostree_checksum_from_bytes_v (contents_v);
+      g_autofree char *meta_csum = ostree_checksum_from_bytes_v (meta_v);
+      g_autofree char *child_path = g_build_filename (path, name, NULL);
+      if (!state->changed_paths || g_hash_table_contains (state->changed_paths, child_path)
+          || g_hash_table_contains (state->changed_dirs, child_path))
+        {
+          if (!relabel_dirtree (state, child_path, &contents_csum, &meta_csum, cancellable,
+                                error))
+            return FALSE;
+        }
+      g_variant_builder_add (dirs_builder, "(s@ay@ay)", name,
+                             ostree_checksum_to_bytes_v (contents_csum),
+                             ostree_checksum_to_bytes_v (meta_csum));
+    }
+
+  /* Nothing below us changed; the dirtree is the same */
+  if (state->n_changed == n_changed_orig)
+    return TRUE;
+
+  g_autoptr (GVariant) new_dirtree = g_variant_ref_sink (
+      g_variant_new ("(@a(say)@a(sayay))", g_variant_builder_end (files_builder),
+                     g_variant_builder_end (dirs_builder)));
+  g_autofree guchar *csum = NULL;
+  if (!ostree_repo_write_metadata (repo, OSTREE_OBJECT_TYPE_DIR_TREE, NULL, new_dirtree, &csum,
+                                   cancellable, error))
+    return FALSE;
+  g_free (*inout_contents_csum);
+  *inout_contents_csum = ostree_checksum_from_bytes (csum);
+  return TRUE;
+}
+
+/* Using the label manifest recorded at import time, find the paths whose label
+ * differs under the new policy (updating the manifest as we go).  Most policy
+ * updates only touch a few file contexts, so usually this is a small set, or
+ * empty.
+ */
+static gboolean
+relabel_diff_manifest (RelabelPkgState *state, GCancellable *cancellable, GError **error)
+{
+  GHashTable *entries = rpmostree_label_manifest_get_entries (state->manifest);
+  GLNX_HASH_TABLE_FOREACH_KV (entries, const char *, path, RpmOstreeLabelManifestEntry *, entry)
+    {
+      g_autofree char *label = NULL;
+      if (!relabel_lookup_label (state->rdata, path, entry->mode, &label, cancellable, error))
+        return FALSE;
+      if (g_strcmp0 (label, entry->label) == 0)
+        continue;
+
+      entry->label = g_intern_string (label);
+      g_hash_table_add (state->changed_paths, g_strdup (path));
+      g_autofree char *dir = g_path_get_dirname (path);
+      while (!g_str_equal (dir, "/") && !g_hash_table_contains (state->changed_dirs, dir))
+        {
+          g_autofree char *parent = g_path_get_dirname (dir);
+          g_hash_table_add (state->changed_dirs, util::move_nullify (dir));
+          dir = util::move_nullify (parent);
+        }
+    }
+
   return TRUE;
 }
 
 typedef struct
 {
-  int tmpdir_dfd;
+  RpmOstreeRelabelData *rdata;
   const char *name;
   const char *evr;
   const char *arch;
 } RelabelTaskData;
 
+/* Relabel a package in the pkgcache in place.  Rather than checking out the
+ * whole package and recommitting it, we walk the existing commit and only
+ * write new objects for the files whose label actually changed.  If the
+ * package has a label manifest, we only look at the paths it says changed.
+ * If none did (the common case for a minor policy bump), we just write a new
+ * commit for the same tree recording the new policy.  Returns the number of
+ * objects rewritten in @out_n_changed.
+ */
 static gboolean
-relabel_in_thread_impl (RpmOstreeContext *self, const char *name, const char *evr, const char *arch,
-                        int tmpdir_dfd, gboolean *out_changed, GCancellable *cancellable,
+relabel_in_thread_impl (RpmOstreeRelabelData *rdata, const char *name, const char *evr,
+                        const char *arch, guint *out_n_changed, GCancellable *cancellable,
                         GError **error)
 {
+  RpmOstreeContext *self = rdata->self;
   if (g_cancellable_set_error_if_cancelled (cancellable, error))
     return FALSE;
 
   const char *nevra = glnx_strjoina (name, "-", evr, ".", arch);
   const char *errmsg = glnx_strjoina ("Relabeling ", nevra);
   GLNX_AUTO_PREFIX_ERROR (errmsg, error);
-  const char *pkg_dirname = nevra;
 
   OstreeRepo *repo = get_pkgcache_repo (self);
   g_autofree char *cachebranch = rpmostree_get_cache_branch_for_n_evr_a (name, evr, arch);
@@ -3243,66 +4451,74 @@ relabel_in_thread_impl (RpmOstreeContext *self, const char *name, const char *ev
   if (!ostree_repo_resolve_rev (repo, cachebranch, FALSE, &commit_csum, error))
     return FALSE;
 
-  /* Compute the original content checksum */
-  g_autoptr (GVariant) orig_commit = NULL;
-  if (!ostree_repo_load_commit (repo, commit_csum, &orig_commit, NULL, error))
+  g_autoptr (GVariant) commit_var = NULL;
+  if (!ostree_repo_load_commit (repo, commit_csum, &commit_var, NULL, error))
     return FALSE;
-  g_autofree char *orig_content_checksum = rpmostree_commit_content_checksum (orig_commit);
 
-  /* checkout the pkg and relabel, breaking hardlinks */
-  g_autoptr (OstreeRepoDevInoCache) cache = ostree_repo_devino_cache_new ();
+  /* let's just copy the metadata from the previous commit and only change the
+   * rpmostree.sepolicy value and the label manifest */
+  g_autoptr (GVariant) meta = g_variant_get_child_value (commit_var, 0);
+  g_autoptr (GVariantDict) meta_dict = g_variant_dict_new (meta);
 
-  if (!checkout_package (repo, tmpdir_dfd, pkg_dirname, cache, commit_csum, NULL, NULL,
-                         OSTREE_REPO_CHECKOUT_OVERWRITE_NONE, FALSE, cancellable, error))
-    return FALSE;
+  g_autoptr (RpmOstreeLabelManifest) manifest
+      = rpmostree_label_manifest_new_from_metadata (meta_dict);
+  const gboolean have_manifest = (manifest != NULL);
+  if (!have_manifest)
+    manifest = rpmostree_label_manifest_new ();
+  g_autoptr (GHashTable) changed_paths = NULL;
+  g_autoptr (GHashTable) changed_dirs = NULL;
+  RelabelPkgState state = {
+    rdata,
+    repo,
+  };
+  state.manifest = manifest;
+  if (have_manifest)
+    {
+      changed_paths = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+      changed_dirs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+      state.changed_paths = changed_paths;
+      state.changed_dirs = changed_dirs;
+      if (!relabel_diff_manifest (&state, cancellable, error))
+        return FALSE;
+    }
 
-  /* write to the tree */
-  g_autoptr (OstreeRepoCommitModifier) modifier = ostree_repo_commit_modifier_new (
-      OSTREE_REPO_COMMIT_MODIFIER_FLAGS_CONSUME, NULL, NULL, NULL);
-  ostree_repo_commit_modifier_set_devino_cache (modifier, cache);
-  ostree_repo_commit_modifier_set_sepolicy (modifier, self->sepolicy);
+  g_autoptr (GVariant) contents_v = NULL;
+  g_autoptr (GVariant) meta_v = NULL;
+  g_variant_get_child (commit_var, 6, "@ay", &contents_v);
+  g_variant_get_child (commit_var, 7, "@ay", &meta_v);
+  g_autofree char *contents_csum = ostree_checksum_from_bytes_v (contents_v);
+  g_autofree char *meta_csum = ostree_checksum_from_bytes_v (meta_v);
 
-  g_autoptr (OstreeMutableTree) mtree = ostree_mutable_tree_new ();
-  if (!ostree_repo_write_dfd_to_mtree (repo, tmpdir_dfd, pkg_dirname, mtree, modifier, cancellable,
-                                       error))
-    return glnx_prefix_error (error, "Writing dfd");
+  /* Without a manifest, we need to look at everything */
+  if (!have_manifest || g_hash_table_size (changed_paths) > 0)
+    {
+      if (!relabel_dirtree (&state, "/", &contents_csum, &meta_csum, cancellable, error))
+        return FALSE;
+    }
 
+  g_autoptr (OstreeMutableTree) mtree
+      = ostree_mutable_tree_new_from_checksum (repo, contents_csum, meta_csum);
   g_autoptr (GFile) root = NULL;
   if (!ostree_repo_write_mtree (repo, mtree, &root, cancellable, error))
     return FALSE;
 
-  /* build metadata and commit */
-  g_autoptr (GVariant) commit_var = NULL;
-  g_autoptr (GVariantDict) meta_dict = NULL;
-
-  if (!ostree_repo_load_commit (repo, commit_csum, &commit_var, NULL, error))
-    return FALSE;
-
-  /* let's just copy the metadata from the previous commit and only change the
-   * rpmostree.sepolicy value */
-  g_autoptr (GVariant) meta = g_variant_get_child_value (commit_var, 0);
-  meta_dict = g_variant_dict_new (meta);
-
   g_variant_dict_insert (meta_dict, "rpmostree.sepolicy", "s",
                          ostree_sepolicy_get_csum (self->sepolicy));
+  GVariant *manifest_v = rpmostree_label_manifest_to_variant (manifest);
+  if (manifest_v)
+    g_variant_dict_insert_value (meta_dict, RPMOSTREE_LABEL_MANIFEST_KEY, manifest_v);
+  else
+    g_variant_dict_remove (meta_dict, RPMOSTREE_LABEL_MANIFEST_KEY);
 
   g_autofree char *new_commit_csum = NULL;
   if (!ostree_repo_write_commit (repo, NULL, "", "", g_variant_dict_end (meta_dict),
                                  OSTREE_REPO_FILE (root), &new_commit_csum, cancellable, error))
     return FALSE;
 
-  /* Compute new content checksum */
-  g_autoptr (GVariant) new_commit = NULL;
-  if (!ostree_repo_load_commit (repo, new_commit_csum, &new_commit, NULL, error))
-    return FALSE;
-  g_autofree char *new_content_checksum = rpmostree_commit_content_checksum (new_commit);
-
   /* Queue an update to the ref */
   ostree_repo_transaction_set_ref (repo, NULL, cachebranch, new_commit_csum);
 
-  /* Return whether or not we actually changed content */
-  *out_changed = !g_str_equal (orig_content_checksum, new_content_checksum);
-
+  *out_n_changed = state.n_changed;
   return TRUE;
 }
 
@@ -3310,25 +4526,24 @@ static void
 relabel_in_thread (GTask *task, gpointer source, gpointer task_data, GCancellable *cancellable)
 {
   g_autoptr (GError) local_error = NULL;
-  auto self = static_cast<RpmOstreeContext *> (source);
   auto tdata = static_cast<RelabelTaskData *> (task_data);
 
-  gboolean changed = FALSE;
-  if (!relabel_in_thread_impl (self, tdata->name, tdata->evr, tdata->arch, tdata->tmpdir_dfd,
-                               &changed, cancellable, &local_error))
+  guint n_changed = 0;
+  if (!relabel_in_thread_impl (tdata->rdata, tdata->name, tdata->evr, tdata->arch, &n_changed,
+                               cancellable, &local_error))
     g_task_return_error (task, util::move_nullify (local_error));
   else
-    g_task_return_int (task, changed ? 1 : 0);
+    g_task_return_int (task, n_changed);
 }
 
 static void
-relabel_package_async (RpmOstreeContext *self, DnfPackage *pkg, int tmpdir_dfd,
+relabel_package_async (RpmOstreeContext *self, DnfPackage *pkg, RpmOstreeRelabelData *rdata,
                        GCancellable *cancellable, GAsyncReadyCallback callback, gpointer user_data)
 {
   g_autoptr (GTask) task = g_task_new (self, cancellable, callback, user_data);
   RelabelTaskData *tdata = g_new (RelabelTaskData, 1);
   /* We can assume lifetime is greater than the task */
-  tdata->tmpdir_dfd = tmpdir_dfd;
+  tdata->rdata = rdata;
   tdata->name = dnf_package_get_name (pkg);
   tdata->evr = dnf_package_get_evr (pkg);
   tdata->arch = dnf_package_get_arch (pkg);
@@ -3343,18 +4558,13 @@ relabel_package_async_finish (RpmOstreeContext *self, GAsyncResult *result, GErr
   return g_task_propagate_int ((GTask *)result, error);
 }
 
-typedef struct
-{
-  RpmOstreeContext *self;
-  guint n_changed_files;
-  guint n_changed_pkgs;
-} RpmOstreeAsyncRelabelData;
+static void async_relabel_mainctx_iter (RpmOstreeRelabelData *rdata);
 
 static void
 on_async_relabel_done (GObject *obj, GAsyncResult *res, gpointer user_data)
 {
-  auto data = static_cast<RpmOstreeAsyncRelabelData *> (user_data);
-  RpmOstreeContext *self = data->self;
+  auto rdata = static_cast<RpmOstreeRelabelData *> (user_data);
+  RpmOstreeContext *self = rdata->self;
   gssize n_relabeled
       = relabel_package_async_finish (self, res, self->async_error ? NULL : &self->async_error);
   if (n_relabeled < 0)
@@ -3366,14 +4576,40 @@ on_async_relabel_done (GObject *obj, GAsyncResult *res, gpointer user_data)
 
   g_assert_cmpint (self->n_async_pkgs_relabeled, <, self->pkgs_to_relabel->len);
   self->n_async_pkgs_relabeled++;
+  g_assert_cmpint (self->n_async_running, >, 0);
+  self->n_async_running--;
   if (n_relabeled > 0)
     {
-      data->n_changed_files += n_relabeled;
-      data->n_changed_pkgs++;
+      rdata->n_changed_objects += n_relabeled;
+      rdata->n_changed_pkgs++;
     }
   self->async_progress->nitems_update (self->n_async_pkgs_relabeled);
-  if (self->n_async_pkgs_relabeled == self->pkgs_to_relabel->len)
-    self->async_running = FALSE;
+  async_relabel_mainctx_iter (rdata);
+}
+
+/* Like async_imports_mainctx_iter(); keep a bounded number of relabels
+ * running until we're done. */
+static void
+async_relabel_mainctx_iter (RpmOstreeRelabelData *rdata)
+{
+  RpmOstreeContext *self = rdata->self;
+  GPtrArray *pkgs = self->pkgs_to_relabel;
+
+  while (self->async_index < pkgs->len && self->n_async_running < self->n_async_max
+         && self->async_error == NULL)
+    {
+      auto pkg = static_cast<DnfPackage *> (pkgs->pdata[self->async_index]);
+      relabel_package_async (self, pkg, rdata, self->async_cancellable, on_async_relabel_done,
+                             rdata);
+      self->async_index++;
+      self->n_async_running++;
+    }
+
+  if (self->n_async_running == 0)
+    {
+      self->async_running = FALSE;
+      g_main_context_wakeup (g_main_context_get_thread_default ());
+    }
 }
 
 static gboolean
@@ -3392,41 +4628,39 @@ relabel_if_necessary (RpmOstreeContext *self, GCancellable *cancellable, GError
 
   g_assert (ostreerepo != NULL);
 
-  /* Prep a txn and tmpdir for all of the relabels */
+  /* Prep a txn for all of the relabels */
   g_auto (RpmOstreeRepoAutoTransaction) txn = {
     0,
   };
   if (!rpmostree_repo_auto_transaction_start (&txn, ostreerepo, FALSE, cancellable, error))
     return FALSE;
 
-  g_auto (GLnxTmpDir) relabel_tmpdir = {
-    0,
+  RpmOstreeRelabelData rdata = {
+    self,
   };
-  if (!glnx_mkdtempat (ostree_repo_get_dfd (ostreerepo), "tmp/rpm-ostree-relabel.XXXXXX", 0700,
-                       &relabel_tmpdir, error))
-    return FALSE;
+  g_mutex_init (&rdata.label_lock);
+  rdata.label_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
 
   self->async_running = TRUE;
+  self->async_index = 0;
+  self->n_async_running = 0;
+  /* Mostly CPU bound (label lookups and checksumming) */
+  self->n_async_max = g_get_num_processors ();
   self->async_cancellable = cancellable;
+  self->async_error = NULL;
 
-  RpmOstreeAsyncRelabelData data = {
-    self,
-    0,
-  };
   const guint n_to_relabel = self->pkgs_to_relabel->len;
   self->async_progress = rpmostreecxx::progress_nitems_begin (n_to_relabel, "Relabeling");
-  for (guint i = 0; i < n_to_relabel; i++)
-    {
-      auto pkg = static_cast<DnfPackage *> (self->pkgs_to_relabel->pdata[i]);
-      relabel_package_async (self, pkg, relabel_tmpdir.fd, cancellable, on_async_relabel_done,
-                             &data);
-    }
+  async_relabel_mainctx_iter (&rdata);
 
   /* Wait for all of the relabeling to complete */
   GMainContext *mainctx = g_main_context_get_thread_default ();
-  self->async_error = NULL;
   while (self->async_running)
     g_main_context_iteration (mainctx, TRUE);
+
+  g_clear_pointer (&rdata.label_cache, g_hash_table_unref);
+  g_mutex_clear (&rdata.label_lock);
+
   if (self->async_error)
     {
       g_propagate_error (error, util::move_nullify (self->async_error));
@@ -3442,8 +4676,9 @@ relabel_if_necessary (RpmOstreeContext *self, GCancellable *cancellable, GError
 
   sd_journal_send ("MESSAGE_ID=" SD_ID128_FORMAT_STR,
                    SD_ID128_FORMAT_VAL (RPMOSTREE_MESSAGE_SELINUX_RELABEL),
-                   "MESSAGE=Relabeled %u/%u pkgs", data.n_changed_pkgs, n_to_relabel,
-                   "RELABELED_PKGS=%u/%u", data.n_changed_pkgs, n_to_relabel, NULL);
+                   "MESSAGE=Relabeled %u/%u pkgs (%u objects)", rdata.n_changed_pkgs, n_to_relabel,
+                   rdata.n_changed_objects, "RELABELED_PKGS=%u/%u", rdata.n_changed_pkgs,
+                   n_to_relabel, NULL);
 
   g_clear_pointer (&self->pkgs_to_relabel, (GDestroyNotify)g_ptr_array_unref);
   self->n_async_pkgs_relabeled = 0;
@@ -3584,9 +4819,9 @@ rpmts_add_erase (RpmOstreeContext *self, rpmts ts, DnfPackage *pkg, GCancellable
  * to the script core to execute.
  */
 static gboolean
-run_script_sync (RpmOstreeContext *self, int rootfs_dfd, GLnxTmpDir *var_lib_rpm_statedir,
-                 DnfPackage *pkg, RpmOstreeScriptKind kind, guint *out_n_run,
-                 GCancellable *cancellable, GError **error)
+run_script_sync (RpmOstreeContext *self, RpmOstreeScriptRunner *runner, DnfPackage *pkg,
+                 RpmOstreeScriptKind kind, guint *out_n_run, GCancellable *cancellable,
+                 GError **error)
 {
   g_auto (Header) hdr = NULL;
   g_autofree char *path = get_package_relpath (pkg);
@@ -3596,9 +4831,8 @@ run_script_sync (RpmOstreeContext *self, int rootfs_dfd, GLnxTmpDir *var_lib_rpm
 
   const bool use_kernel_install = self->treefile_rs->use_kernel_install ();
 
-  if (!rpmostree_script_run_sync (pkg, hdr, kind, rootfs_dfd, var_lib_rpm_statedir,
-                                  self->enable_rofiles, use_kernel_install, out_n_run, cancellable,
-                                  error))
+  if (!rpmostree_script_run_sync (pkg, hdr, kind, runner, use_kernel_install, out_n_run,
+                                  cancellable, error))
     return FALSE;
 
   return TRUE;
@@ -3656,13 +4890,10 @@ apply_rpmfi_overrides (RpmOstreeContext *self, int tmprootfs_dfd, DnfPackage *pk
         continue;
 
       g_assert (fn != NULL);
-      fn += strspn (fn, "/");
-      g_assert (fn[0]);
+      g_assert (fn[strspn (fn, "/")]);
 
       /* Be sure we've canonicalized usr/ */
-      g_autofree char *fn_canonical = canonicalize_non_usrmove_path (self, fn);
-      if (fn_canonical)
-        fn = fn_canonical;
+      fn = get_rootfs_path (self, fn, FALSE);
 
       /* /run and /var paths have already been translated to tmpfiles during
        * unpacking */
@@ -3697,74 +4928,444 @@ apply_rpmfi_overrides (RpmOstreeContext *self, int tmprootfs_dfd, DnfPackage *pk
           return glnx_throw_errno_prefix (error, "fstatat(%s)", fn);
         }
 
-      if ((S_IFMT & stbuf.st_mode) != (S_IFMT & mode))
-        {
-          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                       "Inconsistent file type between RPM and checkout "
-                       "for file '%s' in package '%s'",
-                       fn, dnf_package_get_name (pkg));
-          return FALSE;
-        }
+      if ((S_IFMT & stbuf.st_mode) != (S_IFMT & mode))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Inconsistent file type between RPM and checkout "
+                       "for file '%s' in package '%s'",
+                       fn, dnf_package_get_name (pkg));
+          return FALSE;
+        }
+
+      if (!S_ISDIR (stbuf.st_mode))
+        {
+          // Break the hardlink into the object store, making a copy.
+          // Ignore any underlying xattrs here; we'll always relabel security.selinux
+          // at the end, and otherwise the RPM is canonical for things like
+          // security.capability.
+          if (!ostree_break_hardlink (tmprootfs_dfd, fn, TRUE, cancellable, error))
+            return glnx_prefix_error (error, "Copyup %s", fn);
+        }
+
+      uid_t uid = 0;
+      if (!g_str_equal (user, "root"))
+        {
+          if (!passwd_entries.contains_user (user))
+            {
+              g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           "Could not find user '%s' in passwd file", user);
+              return FALSE;
+            }
+          CXX_TRY_VAR (uidv, passwd_entries.lookup_user_id (user), error);
+          uid = std::move (uidv);
+        }
+
+      gid_t gid = 0;
+      if (!g_str_equal (group, "root"))
+        {
+          if (!passwd_entries.contains_group (group))
+            {
+              g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           "Could not find group '%s' in group file", group);
+              return FALSE;
+            }
+
+          CXX_TRY_VAR (gidv, passwd_entries.lookup_group_id (group), error);
+          gid = std::move (gidv);
+        }
+
+      if (fchownat (tmprootfs_dfd, fn, uid, gid, AT_SYMLINK_NOFOLLOW) != 0)
+        return glnx_throw_errno_prefix (error, "fchownat(%s)", fn);
+
+      /* the chown clears away file caps, so reapply it here */
+      if (have_fcaps)
+        {
+          g_autoptr (GVariant) xattrs = rpmostree_fcap_to_xattr_variant (fcaps, error);
+          if (!xattrs)
+            return FALSE;
+          if (!glnx_dfd_name_set_all_xattrs (tmprootfs_dfd, fn, xattrs, cancellable, error))
+            return glnx_prefix_error (error, "%s", fn);
+        }
+
+      /* also reapply chmod since e.g. at least the setuid gets taken off */
+      if (S_ISREG (mode))
+        {
+          g_assert (S_ISREG (stbuf.st_mode));
+          if (fchmodat (tmprootfs_dfd, fn, mode, 0) != 0)
+            return glnx_throw_errno_prefix (error, "fchmodat(%s)", fn);
+        }
+    }
+
+  return TRUE;
+}
+
+/* Add @i to the packages providing @name */
+static void
+add_script_provider (GHashTable *providers, const char *name, guint i)
+{
+  auto indices = static_cast<GArray *> (g_hash_table_lookup (providers, name));
+  if (!indices)
+    {
+      indices = g_array_new (FALSE, FALSE, sizeof (guint));
+      g_hash_table_insert (providers, g_strdup (name), indices);
+    }
+  if (indices->len == 0 || g_array_index (indices, guint, indices->len - 1) != i)
+    g_array_append_val (indices, i);
+}
+
+/* Record that whichever of @i and the packages in @indices comes later in
+ * @blockers must wait for the other */
+static void
+add_script_blockers (GPtrArray *blockers, guint i, GArray *indices)
+{
+  if (!indices)
+    return;
+  for (guint k = 0; k < indices->len; k++)
+    {
+      guint j = g_array_index (indices, guint, k);
+      if (j == i)
+        continue;
+      g_hash_table_add (static_cast<GHashTable *> (blockers->pdata[MAX (i, j)]),
+                        GUINT_TO_POINTER (MIN (i, j)));
+    }
+}
+
+/* For each of @tes (in rpmts order), find the earlier ones whose %post must
+ * run before its own: those it requires something from, or which require
+ * something from it (rpmtsOrder() may have broken a cycle there).  We match
+ * on names and file paths only, ignoring versions, which errs on the side of
+ * more ordering.  A path can be provided either by a file or by an explicit
+ * Provides (e.g. bash's /bin/sh), so we check both.  Returns an array of GHashTable sets of indices.
+ */
+static GPtrArray *
+find_script_blockers (GPtrArray *tes)
+{
+  g_autoptr (GHashTable) providers = g_hash_table_new_full (
+      g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_array_unref);
+  g_autoptr (GHashTable) file_providers = g_hash_table_new_full (
+      g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_array_unref);
+
+  for (guint i = 0; i < tes->len; i++)
+    {
+      auto te = static_cast<rpmte> (tes->pdata[i]);
+      rpmds provides = rpmdsInit (rpmteDS (te, RPMTAG_PROVIDENAME));
+      while (rpmdsNext (provides) >= 0)
+        add_script_provider (providers, rpmdsN (provides), i);
+
+      rpmds requires = rpmdsInit (rpmteDS (te, RPMTAG_REQUIRENAME));
+      while (rpmdsNext (requires) >= 0)
+        {
+          const char *name = rpmdsN (requires);
+          if (*name == '/' && !g_hash_table_contains (file_providers, name))
+            g_hash_table_insert (file_providers, g_strdup (name),
+                                 g_array_new (FALSE, FALSE, sizeof (guint)));
+        }
+    }
+
+  /* Only look for the files something actually requires */
+  if (g_hash_table_size (file_providers) > 0)
+    {
+      for (guint i = 0; i < tes->len; i++)
+        {
+          g_auto (rpmfiles) files = rpmteFiles (static_cast<rpmte> (tes->pdata[i]));
+          g_auto (rpmfi) fi = rpmfilesIter (files, RPMFI_ITER_FWD);
+          while (rpmfiNext (fi) >= 0)
+            {
+              const char *fn = rpmfiFN (fi);
+              if (g_hash_table_contains (file_providers, fn))
+                add_script_provider (file_providers, fn, i);
+            }
+        }
+    }
+
+  GPtrArray *ret = g_ptr_array_new_with_free_func ((GDestroyNotify)g_hash_table_unref);
+  for (guint i = 0; i < tes->len; i++)
+    g_ptr_array_add (ret, g_hash_table_new (NULL, NULL));
+
+  for (guint i = 0; i < tes->len; i++)
+    {
+      auto te = static_cast<rpmte> (tes->pdata[i]);
+      rpmds requires = rpmdsInit (rpmteDS (te, RPMTAG_REQUIRENAME));
+      while (rpmdsNext (requires) >= 0)
+        {
+          const char *name = rpmdsN (requires);
+          /* Rich dependencies; don't try to be clever, just wait for everything before */
+          if (*name == '(')
+            {
+              for (guint j = 0; j < i; j++)
+                g_hash_table_add (static_cast<GHashTable *> (ret->pdata[i]), GUINT_TO_POINTER (j));
+              continue;
+            }
+          add_script_blockers (ret, i,
+                               static_cast<GArray *> (g_hash_table_lookup (providers, name)));
+          if (*name == '/')
+            add_script_blockers (
+                ret, i, static_cast<GArray *> (g_hash_table_lookup (file_providers, name)));
+        }
+    }
+
+  return ret;
+}
+
+typedef struct
+{
+  RpmOstreeContext *self;
+  GPtrArray *pkgs;       /* DnfPackage, in rpmts order */
+  GPtrArray *scripts;    /* RpmOstreePreparedScript, or NULL if none */
+  GPtrArray *dependents; /* GArray of indices waiting for each package */
+  GArray *n_blockers;    /* guint; number of packages each one is waiting for */
+  GArray *ready;         /* guint; indices which can run now, sorted */
+  GPtrArray *outputs;    /* GString */
+  GArray *done;          /* gboolean */
+  guint n_reported;
+  GPtrArray *runners;    /* RpmOstreeScriptRunner, one per concurrent script */
+  GArray *free_runners;  /* guint */
+  guint n_run;
+  rpmostreecxx::Progress *task;
+} RpmOstreePostScriptsData;
+
+typedef struct
+{
+  RpmOstreePostScriptsData *data;
+  guint index;
+  guint runner_index;
+} PostScriptTaskData;
+
+/* Note this must not touch the DnfPackage; see rpmostree_script_prepare() */
+static void
+post_script_in_thread (GTask *task, gpointer source, gpointer task_data, GCancellable *cancellable)
+{
+  g_autoptr (GError) local_error = NULL;
+  auto tdata = static_cast<PostScriptTaskData *> (task_data);
+  RpmOstreePostScriptsData *data = tdata->data;
+
+  auto script = static_cast<RpmOstreePreparedScript *> (data->scripts->pdata[tdata->index]);
+  auto runner = static_cast<RpmOstreeScriptRunner *> (data->runners->pdata[tdata->runner_index]);
+  if (script && !rpmostree_prepared_script_run (script, runner, cancellable, &local_error))
+    g_task_return_error (task, util::move_nullify (local_error));
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+static void
+post_script_output_free (GString *output)
+{
+  g_string_free (output, TRUE);
+}
+
+/* Print output in rpmts order, for scripts which completed; unless @all is
+ * set, stop at the first one which didn't. */
+static void
+report_post_script_outputs (RpmOstreePostScriptsData *data, gboolean all)
+{
+  for (; data->n_reported < data->pkgs->len; data->n_reported++)
+    {
+      if (!g_array_index (data->done, gboolean, data->n_reported))
+        {
+          if (all)
+            continue;
+          break;
+        }
+      auto output = static_cast<GString *> (data->outputs->pdata[data->n_reported]);
+      fputs (output->str, stdout);
+    }
+}
+
+static void async_post_scripts_mainctx_iter (RpmOstreePostScriptsData *data);
+
+static void
+on_async_post_script_done (GObject *obj, GAsyncResult *res, gpointer user_data)
+{
+  auto data = static_cast<RpmOstreePostScriptsData *> (user_data);
+  RpmOstreeContext *self = data->self;
+  auto tdata = static_cast<PostScriptTaskData *> (g_task_get_task_data ((GTask *)res));
+  if (!g_task_propagate_boolean ((GTask *)res, self->async_error ? NULL : &self->async_error))
+    {
+      g_assert (self->async_error != NULL);
+      if (self->async_cancellable)
+        g_cancellable_cancel (self->async_cancellable);
+    }
+
+  const guint i = tdata->index;
+  if (data->scripts->pdata[i] != NULL)
+    data->n_run++;
+  g_array_index (data->done, gboolean, i) = TRUE;
+  g_array_append_val (data->free_runners, tdata->runner_index);
+
+  GArray *dependents = static_cast<GArray *> (data->dependents->pdata[i]);
+  for (guint k = 0; k < dependents->len; k++)
+    {
+      guint j = g_array_index (dependents, guint, k);
+      if (--g_array_index (data->n_blockers, guint, j) > 0)
+        continue;
+      guint pos = 0;
+      while (pos < data->ready->len && g_array_index (data->ready, guint, pos) < j)
+        pos++;
+      g_array_insert_val (data->ready, pos, j);
+    }
+
+  /* Print output as soon as everything before it is done */
+  report_post_script_outputs (data, FALSE);
+
+  g_assert_cmpint (self->n_async_running, >, 0);
+  self->n_async_running--;
+  async_post_scripts_mainctx_iter (data);
+}
+
+/* Keep as many scripts running as we have runners for */
+static void
+async_post_scripts_mainctx_iter (RpmOstreePostScriptsData *data)
+{
+  RpmOstreeContext *self = data->self;
+
+  while (data->ready->len > 0 && data->free_runners->len > 0 && self->async_error == NULL)
+    {
+      const guint i = g_array_index (data->ready, guint, 0);
+      g_array_remove_index (data->ready, 0);
+      const guint runner_index
+          = g_array_index (data->free_runners, guint, data->free_runners->len - 1);
+      g_array_set_size (data->free_runners, data->free_runners->len - 1);
+
+      auto runner = static_cast<RpmOstreeScriptRunner *> (data->runners->pdata[runner_index]);
+      rpmostree_script_runner_set_output (runner,
+                                          static_cast<GString *> (data->outputs->pdata[i]));
+      data->task->set_sub_message (
+          dnf_package_get_name (static_cast<DnfPackage *> (data->pkgs->pdata[i])));
+
+      PostScriptTaskData *tdata = g_new0 (PostScriptTaskData, 1);
+      tdata->data = data;
+      tdata->index = i;
+      tdata->runner_index = runner_index;
+      g_autoptr (GTask) task
+          = g_task_new (self, self->async_cancellable, on_async_post_script_done, data);
+      g_task_set_task_data (task, tdata, g_free);
+      g_task_run_in_thread (task, post_script_in_thread);
+      self->n_async_running++;
+    }
+
+  if (self->n_async_running == 0)
+    {
+      self->async_running = FALSE;
+      g_main_context_wakeup (g_main_context_get_thread_default ());
+    }
+}
+
+/* Run the %post scripts of @tes (in rpmts order), starting each one as soon
+ * as the scripts of the packages it depends on are done; see
+ * find_script_blockers().  Each concurrent script gets its own container.
+ * Output is collected and printed in rpmts order.
+ *
+ * The rpmfi overrides of all packages are applied up front, rather than just
+ * before each package's %post.
+ */
+static gboolean
+run_post_scripts_parallel (RpmOstreeContext *self, int tmprootfs_dfd, GPtrArray *tes,
+                           GLnxTmpDir *var_lib_rpm_statedir,
+                           rpmostreecxx::PasswdEntries &passwd_entries,
+                           rpmostreecxx::Progress &task, guint *out_n_run,
+                           GCancellable *cancellable, GError **error)
+{
+  if (tes->len == 0)
+    return TRUE;
+
+  const gboolean use_kernel_install = self->treefile_rs->use_kernel_install ();
+  g_autoptr (GPtrArray) pkgs = g_ptr_array_new ();
+  g_autoptr (GPtrArray) scripts
+      = g_ptr_array_new_with_free_func ((GDestroyNotify)rpmostree_prepared_script_free);
+  g_autoptr (GPtrArray) outputs
+      = g_ptr_array_new_with_free_func ((GDestroyNotify)post_script_output_free);
+  for (guint i = 0; i < tes->len; i++)
+    {
+      auto pkg = (DnfPackage *)rpmteKey (static_cast<rpmte> (tes->pdata[i]));
+      g_assert (pkg);
+      g_ptr_array_add (pkgs, pkg);
 
-      if (!S_ISDIR (stbuf.st_mode))
-        {
-          // Break the hardlink into the object store, making a copy.
-          // Ignore any underlying xattrs here; we'll always relabel security.selinux
-          // at the end, and otherwise the RPM is canonical for things like
-          // security.capability.
-          if (!ostree_break_hardlink (tmprootfs_dfd, fn, TRUE, cancellable, error))
-            return glnx_prefix_error (error, "Copyup %s", fn);
-        }
+      task.set_sub_message (dnf_package_get_name (pkg));
+      if (!apply_rpmfi_overrides (self, tmprootfs_dfd, pkg, passwd_entries, cancellable, error))
+        return glnx_prefix_error (error, "While applying overrides for pkg %s",
+                                  dnf_package_get_name (pkg));
 
-      uid_t uid = 0;
-      if (!g_str_equal (user, "root"))
-        {
-          if (!passwd_entries.contains_user (user))
-            {
-              g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                           "Could not find user '%s' in passwd file", user);
-              return FALSE;
-            }
-          CXX_TRY_VAR (uidv, passwd_entries.lookup_user_id (user), error);
-          uid = std::move (uidv);
-        }
+      /* Work out what to run here; libsolv isn't thread-safe, so the
+       * threads can't look at the package */
+      g_autofree char *path = get_package_relpath (pkg);
+      g_auto (Header) hdr = NULL;
+      if (!get_package_metainfo (self, path, &hdr, NULL, error))
+        return FALSE;
+      g_autoptr (RpmOstreePreparedScript) script = NULL;
+      if (!rpmostree_script_prepare (pkg, hdr, RPMOSTREE_SCRIPT_POSTIN, use_kernel_install,
+                                     &script, error))
+        return FALSE;
+      g_ptr_array_add (scripts, util::move_nullify (script));
+      g_ptr_array_add (outputs, g_string_new (""));
+    }
 
-      gid_t gid = 0;
-      if (!g_str_equal (group, "root"))
-        {
-          if (!passwd_entries.contains_group (group))
-            {
-              g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                           "Could not find group '%s' in group file", group);
-              return FALSE;
-            }
+  g_autoptr (GPtrArray) blockers = find_script_blockers (tes);
+  g_autoptr (GPtrArray) dependents
+      = g_ptr_array_new_with_free_func ((GDestroyNotify)g_array_unref);
+  g_autoptr (GArray) n_blockers = g_array_sized_new (FALSE, TRUE, sizeof (guint), tes->len);
+  g_array_set_size (n_blockers, tes->len);
+  g_autoptr (GArray) ready = g_array_new (FALSE, FALSE, sizeof (guint));
+  for (guint i = 0; i < tes->len; i++)
+    g_ptr_array_add (dependents, g_array_new (FALSE, FALSE, sizeof (guint)));
+  for (guint i = 0; i < tes->len; i++)
+    {
+      auto pkg_blockers = static_cast<GHashTable *> (blockers->pdata[i]);
+      g_array_index (n_blockers, guint, i) = g_hash_table_size (pkg_blockers);
+      GLNX_HASH_TABLE_FOREACH (pkg_blockers, gpointer, j)
+        g_array_append_val (static_cast<GArray *> (dependents->pdata[GPOINTER_TO_UINT (j)]), i);
+      if (g_array_index (n_blockers, guint, i) == 0)
+        g_array_append_val (ready, i);
+    }
 
-          CXX_TRY_VAR (gidv, passwd_entries.lookup_group_id (group), error);
-          gid = std::move (gidv);
-        }
+  const guint n_runners = MIN (g_get_num_processors (), tes->len);
+  g_autoptr (GPtrArray) runners
+      = g_ptr_array_new_with_free_func ((GDestroyNotify)rpmostree_script_runner_free);
+  g_autoptr (GArray) free_runners = g_array_new (FALSE, FALSE, sizeof (guint));
+  for (guint i = 0; i < n_runners; i++)
+    {
+      g_ptr_array_add (runners, rpmostree_script_runner_new (tmprootfs_dfd, var_lib_rpm_statedir,
+                                                             self->enable_rofiles));
+      g_array_append_val (free_runners, i);
+    }
 
-      if (fchownat (tmprootfs_dfd, fn, uid, gid, AT_SYMLINK_NOFOLLOW) != 0)
-        return glnx_throw_errno_prefix (error, "fchownat(%s)", fn);
+  g_autoptr (GArray) done = g_array_sized_new (FALSE, TRUE, sizeof (gboolean), tes->len);
+  g_array_set_size (done, tes->len);
 
-      /* the chown clears away file caps, so reapply it here */
-      if (have_fcaps)
-        {
-          g_autoptr (GVariant) xattrs = rpmostree_fcap_to_xattr_variant (fcaps, error);
-          if (!xattrs)
-            return FALSE;
-          if (!glnx_dfd_name_set_all_xattrs (tmprootfs_dfd, fn, xattrs, cancellable, error))
-            return glnx_prefix_error (error, "%s", fn);
-        }
+  RpmOstreePostScriptsData data = {
+    self,
+  };
+  data.pkgs = pkgs;
+  data.scripts = scripts;
+  data.dependents = dependents;
+  data.n_blockers = n_blockers;
+  data.ready = ready;
+  data.outputs = outputs;
+  data.done = done;
+  data.runners = runners;
+  data.free_runners = free_runners;
+  data.task = &task;
 
-      /* also reapply chmod since e.g. at least the setuid gets taken off */
-      if (S_ISREG (mode))
-        {
-          g_assert (S_ISREG (stbuf.st_mode));
-          if (fchmodat (tmprootfs_dfd, fn, mode, 0) != 0)
-            return glnx_throw_errno_prefix (error, "fchmodat(%s)", fn);
-        }
+  self->async_running = TRUE;
+  self->n_async_running = 0;
+  self->async_cancellable = cancellable;
+  self->async_error = NULL;
+  async_post_scripts_mainctx_iter (&data);
+
+  /* Wait for all of the scripts to complete */
+  GMainContext *mainctx = g_main_context_get_thread_default ();
+  while (self->async_running)
+    g_main_context_iteration (mainctx, TRUE);
+
+  if (self->async_error)
+    {
+      /* Make sure the output of the failed script is shown */
+      report_post_script_outputs (&data, TRUE);
+      g_propagate_error (error, util::move_nullify (self->async_error));
+      return FALSE;
     }
 
+  g_assert_cmpint (data.n_reported, ==, tes->len);
+  *out_n_run += data.n_run;
   return TRUE;
 }
 
@@ -3807,26 +5408,32 @@ add_install (RpmOstreeContext *self, DnfPackage *pkg, rpmts ts, gboolean is_upgr
   return TRUE;
 }
 
-/* Run %transfiletriggerin */
+/* Run %transfiletriggerin.  For packages which were already installed, only
+ * the triggers matching @files_changed run; the base tree already has the
+ * results of running them on everything else.  If there was no base rpmdb,
+ * @files_changed is %NULL and only the new packages' triggers run.
+ */
 static gboolean
-run_all_transfiletriggers (RpmOstreeContext *self, rpmts ts, int rootfs_dfd, guint *out_n_run,
-                           GCancellable *cancellable, GError **error)
+run_all_transfiletriggers (RpmOstreeContext *self, rpmts ts, int rootfs_dfd,
+                           GPtrArray *files_changed, guint *out_n_run, GCancellable *cancellable,
+                           GError **error)
 {
   const gboolean use_kernel_install = self->treefile_rs->use_kernel_install ();
+  /* Shared by all triggers, so we only walk the tree once */
+  g_autoptr (RpmOstreeFileIndex) file_index = rpmostree_file_index_new (rootfs_dfd);
+  g_autoptr (RpmOstreeScriptRunner) runner
+      = rpmostree_script_runner_new (rootfs_dfd, NULL, self->enable_rofiles);
 
   /* Triggers from base packages, but only if we already have an rpmdb,
    * otherwise librpm will whine on our stderr.
    */
-  if (!glnx_fstatat_allow_noent (rootfs_dfd, RPMOSTREE_RPMDB_LOCATION, NULL, AT_SYMLINK_NOFOLLOW,
-                                 error))
-    return FALSE;
-  if (errno == 0)
+  if (files_changed)
     {
       g_auto (rpmdbMatchIterator) mi = rpmtsInitIterator (ts, RPMDBI_PACKAGES, NULL, 0);
       Header hdr;
       while ((hdr = rpmdbNextIterator (mi)) != NULL)
         {
-          if (!rpmostree_transfiletriggers_run_sync (hdr, rootfs_dfd, self->enable_rofiles,
+          if (!rpmostree_transfiletriggers_run_sync (hdr, runner, file_index, files_changed,
                                                      use_kernel_install, out_n_run, cancellable,
                                                      error))
             return FALSE;
@@ -3846,8 +5453,9 @@ run_all_transfiletriggers (RpmOstreeContext *self, rpmts ts, int rootfs_dfd, gui
       if (!get_package_metainfo (self, path, &hdr, NULL, error))
         return FALSE;
 
-      if (!rpmostree_transfiletriggers_run_sync (hdr, rootfs_dfd, self->enable_rofiles,
-                                                 use_kernel_install, out_n_run, cancellable, error))
+      if (!rpmostree_transfiletriggers_run_sync (hdr, runner, file_index, NULL,
+                                                 use_kernel_install, out_n_run, cancellable,
+                                                 error))
         return FALSE;
     }
   return TRUE;
@@ -3960,12 +5568,198 @@ process_ostree_layers (RpmOstreeContext *self, int rootfs_dfd, GCancellable *can
   return TRUE;
 }
 
+/* Add the tags that librpm would add when installing @h into the rpmdb;
+ * see dbAdd() in librpm's psm.c. This assumes a plain install, i.e. no
+ * relocations and all files in the normal state; see
+ * rpmdb_needs_transaction(). */
+static void
+add_rpmdb_install_tags (Header h, rpm_tid_t tid, rpm_color_t color)
+{
+  struct rpmtd_s td;
+  rpm_count_t fc = 0;
+  if (headerGet (h, RPMTAG_BASENAMES, &td, HEADERGET_MINMEM))
+    {
+      fc = rpmtdCount (&td);
+      rpmtdFreeData (&td);
+    }
+  if (fc > 0)
+    {
+      g_autofree char *states = static_cast<char *> (g_malloc (fc));
+      memset (states, RPMFILE_STATE_NORMAL, fc);
+      headerDel (h, RPMTAG_FILESTATES);
+      headerPutChar (h, RPMTAG_FILESTATES, states, fc);
+    }
+
+  if (!headerIsEntry (h, RPMTAG_INSTPREFIXES) && headerGet (h, RPMTAG_PREFIXES, &td, 0))
+    {
+      td.tag = RPMTAG_INSTPREFIXES;
+      headerPut (h, &td, HEADERPUT_DEFAULT);
+      rpmtdFreeData (&td);
+    }
+
+  headerDel (h, RPMTAG_INSTALLTID);
+  headerPutUint32 (h, RPMTAG_INSTALLTID, &tid, 1);
+  headerDel (h, RPMTAG_INSTALLTIME);
+  headerPutUint32 (h, RPMTAG_INSTALLTIME, &tid, 1);
+  headerDel (h, RPMTAG_INSTALLCOLOR);
+  headerPutUint32 (h, RPMTAG_INSTALLCOLOR, &color, 1);
+}
+
+static gboolean
+write_rpmdb_bulk_locked (RpmOstreeContext *self, rpmts rpmdb_ts, rpmtxn txn,
+                         GCancellable *cancellable, GError **error)
+{
+  if (rpmtsOpenDB (rpmdb_ts, O_RDWR | O_CREAT) != 0)
+    return glnx_throw (error, "Failed to open rpmdb");
+  rpmdb db = rpmtsGetRdb (rpmdb_ts);
+
+  /* Do all the inserts as part of one database transaction rather than one
+   * per package. */
+  if (rpmdbCtrl (db, RPMDB_CTRL_LOCK_RW) != 0)
+    return glnx_throw (error, "Failed to lock rpmdb");
+
+  const rpm_tid_t tid = (rpm_tid_t)time (NULL);
+  const rpm_color_t color = rpmtsColor (rpmdb_ts);
+  const int n = rpmtsNElements (rpmdb_ts);
+  gboolean ret = TRUE;
+  for (int i = 0; i < n && ret; i++)
+    {
+      rpmte te = rpmtsElement (rpmdb_ts, i);
+      g_assert_cmpint (rpmteType (te), ==, TR_ADDED);
+      auto pkg = static_cast<DnfPackage *> ((void *)rpmteKey (te));
+
+      /* This is the same header librpm would read back in ts_callback() */
+      g_auto (Header) hdr = NULL;
+      g_autofree char *path = get_package_relpath (pkg);
+      if (g_cancellable_set_error_if_cancelled (cancellable, error)
+          || !get_package_metainfo (self, path, &hdr, NULL, error))
+        {
+          ret = FALSE;
+          break;
+        }
+
+      add_rpmdb_install_tags (hdr, tid, color);
+      if (rpmtsImportHeader (txn, hdr, 0) != 0)
+        ret = glnx_throw (error, "Failed to add %s to rpmdb", dnf_package_get_nevra (pkg));
+    }
+
+  if (rpmdbCtrl (db, RPMDB_CTRL_UNLOCK_RW) != 0 && ret)
+    return glnx_throw (error, "Failed to commit rpmdb");
+  return ret;
+}
+
+/* Whether a macro which makes librpm skip files is set */
+static gboolean
+rpm_macro_is_set (const char *name, const char *unset_value)
+{
+  g_autofree char *query = g_strdup_printf ("%%{?%s}", name);
+  g_autofree char *value = rpmExpand (query, NULL);
+  return value[0] != '\0' && g_strcmp0 (value, unset_value) != 0;
+}
+
+/* write_rpmdb_bulk() marks every file as installed normally.  librpm instead
+ * decides this per file while running the transaction: files excluded by
+ * %_install_langs, %_excludedocs or %_netsharedpath aren't installed, and
+ * when multilib packages share a path, the file of the other color is marked
+ * as such.  In those cases, let librpm compute the file states.
+ */
+static gboolean
+rpmdb_needs_transaction (rpmts ts)
+{
+  if (rpm_macro_is_set ("_install_langs", "all") || rpm_macro_is_set ("_excludedocs", "0")
+      || rpm_macro_is_set ("_netsharedpath", NULL))
+    return TRUE;
+
+  rpm_color_t colors = 0;
+  const int n = rpmtsNElements (ts);
+  for (int i = 0; i < n; i++)
+    colors |= rpmteColor (rpmtsElement (ts, i));
+  /* More than one color bit set means e.g. both i686 and x86_64 ELF files */
+  return (colors & (colors - 1)) != 0;
+}
+
+/* A faster alternative to rpmtsRun() for populating an empty rpmdb with just
+ * the packages in @rpmdb_ts, which must have been ordered already. Running a
+ * full transaction, even with RPMTRANS_FLAG_JUSTDB, still computes file
+ * fingerprints and disk usage across all packages and commits every package
+ * separately; here we only insert the headers, in the same order. */
+static gboolean
+write_rpmdb_bulk (RpmOstreeContext *self, rpmts rpmdb_ts, GCancellable *cancellable,
+                  GError **error)
+{
+  rpmtxn txn = rpmtxnBegin (rpmdb_ts, RPMTXN_WRITE);
+  if (txn == NULL)
+    return glnx_throw (error, "Failed to lock rpmdb");
+
+  gboolean ret = write_rpmdb_bulk_locked (self, rpmdb_ts, txn, cancellable, error);
+  rpmtxnEnd (txn);
+  return ret;
+}
+
+/* Whether the directory @dirpath in @dfd has no entries */
+static gboolean
+dir_is_empty_at (int dfd, const char *dirpath, gboolean *out_empty, GCancellable *cancellable,
+                 GError **error)
+{
+  g_auto (GLnxDirFdIterator) dfd_iter = {
+    FALSE,
+  };
+  if (!glnx_dirfd_iterator_init_at (dfd, dirpath, TRUE, &dfd_iter, error))
+    return FALSE;
+  struct dirent *dent = NULL;
+  if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, cancellable, error))
+    return FALSE;
+  *out_empty = (dent == NULL);
+  return TRUE;
+}
+
+/* Run the JUSTDB transaction set up by write_rpmdb() */
+static gboolean
+run_rpmdb_transaction (rpmts rpmdb_ts, GError **error)
+{
+  rpmprobFilterFlags flags = 0;
+
+  /* Because we're using the real root here (see write_rpmdb() for why), rpm
+   * will see the read-only /usr mount and think that there isn't any disk space
+   * available for install. For now, we just tell rpm to ignore space
+   * calculations, but then we lose that nice check. What we could do is set a
+   * root dir at least if we have CAP_SYS_CHROOT, or maybe do the space req
+   * check ourselves if rpm makes that information easily accessible (doesn't
+   * look like it from a quick glance). */
+  flags |= RPMPROB_FILTER_DISKSPACE;
+
+  /* Enable OLDPACKAGE to allow replacement overrides to older version. */
+  flags |= RPMPROB_FILTER_OLDPACKAGE;
+
+  /* Allow replacing files. If there are fileoverrides, we need
+   * this. But even if not, in some obscure cases, librpm may think
+   * that files are being replaced even though they're not. See
+   * https://github.com/coreos/coreos-assembler/issues/4083. Note that file
+   * conflicts are in fact already checked by libostree when we checkout the
+   * packages. */
+  flags |= RPMPROB_FILTER_REPLACENEWFILES | RPMPROB_FILTER_REPLACEOLDFILES;
+
+  int r = rpmtsRun (rpmdb_ts, NULL, flags);
+  if (r < 0)
+    return glnx_throw (error, "Failed to update rpmdb (rpmtsRun code %d)", r);
+  if (r > 0)
+    {
+      if (!dnf_rpmts_look_for_problems (rpmdb_ts, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
 static gboolean
 write_rpmdb (RpmOstreeContext *self, int tmprootfs_dfd, GPtrArray *overlays,
              GPtrArray *overrides_replace, GPtrArray *overrides_remove, GCancellable *cancellable,
              GError **error)
 {
   auto task = rpmostreecxx::progress_begin_task ("Writing rpmdb");
+  guint64 bytes_cloned = 0;
+  guint64 bytes_copied = 0;
+  gboolean bulk = FALSE;
 
   if (!glnx_shutil_mkdir_p_at (tmprootfs_dfd, RPMOSTREE_RPMDB_LOCATION, 0755, cancellable, error))
     return FALSE;
@@ -3980,10 +5774,17 @@ write_rpmdb (RpmOstreeContext *self, int tmprootfs_dfd, GPtrArray *overlays,
   {
     g_autofree char *rpmdb_abspath = glnx_fdrel_abspath (tmprootfs_dfd, RPMOSTREE_RPMDB_LOCATION);
 
+    /* In the compose case, we're starting from scratch and only adding packages */
+    if (!dir_is_empty_at (tmprootfs_dfd, RPMOSTREE_RPMDB_LOCATION, &bulk, cancellable, error))
+      return FALSE;
+    bulk = bulk && overrides_replace->len == 0 && overrides_remove->len == 0
+           && !g_getenv ("RPMOSTREE_RPMDB_FULL_TRANSACTION");
+
     /* if we were passed an existing tmprootfs, and that tmprootfs already has
      * an rpmdb, we have to make sure to break its hardlinks as librpm mutates
      * the db in place */
-    if (!break_hardlinks_at (tmprootfs_dfd, RPMOSTREE_RPMDB_LOCATION, cancellable, error))
+    if (!break_hardlinks_at (tmprootfs_dfd, RPMOSTREE_RPMDB_LOCATION, &bytes_cloned,
+                             &bytes_copied, cancellable, error))
       return FALSE;
 
     set_rpm_macro_define ("_dbpath", rpmdb_abspath);
@@ -4047,38 +5848,23 @@ write_rpmdb (RpmOstreeContext *self, int tmprootfs_dfd, GPtrArray *overlays,
 
   rpmtsOrder (rpmdb_ts);
 
-  rpmprobFilterFlags flags = 0;
-
-  /* Because we're using the real root here (see above for reason why), rpm
-   * will see the read-only /usr mount and think that there isn't any disk space
-   * available for install. For now, we just tell rpm to ignore space
-   * calculations, but then we lose that nice check. What we could do is set a
-   * root dir at least if we have CAP_SYS_CHROOT, or maybe do the space req
-   * check ourselves if rpm makes that information easily accessible (doesn't
-   * look like it from a quick glance). */
-  flags |= RPMPROB_FILTER_DISKSPACE;
-
-  /* Enable OLDPACKAGE to allow replacement overrides to older version. */
-  flags |= RPMPROB_FILTER_OLDPACKAGE;
-
-  /* Allow replacing files. If there are fileoverrides, we need
-   * this. But even if not, in some obscure cases, librpm may think
-   * that files are being replaced even though they're not. See
-   * https://github.com/coreos/coreos-assembler/issues/4083. Note that file
-   * conflicts are in fact already checked by libostree when we checkout the
-   * packages. */
-  flags |= RPMPROB_FILTER_REPLACENEWFILES | RPMPROB_FILTER_REPLACEOLDFILES;
-
-  int r = rpmtsRun (rpmdb_ts, NULL, flags);
-  if (r < 0)
-    return glnx_throw (error, "Failed to update rpmdb (rpmtsRun code %d)", r);
-  if (r > 0)
+  if (bulk && !rpmdb_needs_transaction (rpmdb_ts))
     {
-      if (!dnf_rpmts_look_for_problems (rpmdb_ts, error))
+      if (!write_rpmdb_bulk (self, rpmdb_ts, cancellable, error))
         return FALSE;
     }
+  else if (!run_rpmdb_transaction (rpmdb_ts, error))
+    return FALSE;
 
-  task->end ("");
+  if (bytes_cloned > 0 || bytes_copied > 0)
+    {
+      g_autofree char *cloned = g_format_size (bytes_cloned);
+      g_autofree char *copied = g_format_size (bytes_copied);
+      g_autofree char *msg = g_strdup_printf ("%s cloned, %s copied", cloned, copied);
+      task->end (msg);
+    }
+  else
+    task->end ("");
 
   /* And finally revert the _dbpath setting because libsolv relies on it as well
    * to find the rpmdb and RPM macros are global state. */
@@ -4130,6 +5916,9 @@ rpmostree_context_assemble (RpmOstreeContext *self, GCancellable *cancellable, G
    */
   if (!build_rootfs_usrlinks (self, error))
     return FALSE;
+  /* May be left over from a previous call which failed */
+  g_clear_pointer (&self->path_table, path_table_free);
+  self->path_table = path_table_new ();
 
   /* This is purely for making it easier for people to test out the
    * state-overlay stuff until it's stabilized and part of base composes. */
@@ -4338,11 +6127,20 @@ rpmostree_context_assemble (RpmOstreeContext *self, GCancellable *cancellable, G
 
   g_autoptr (GHashTable) files_skip_add = NULL;
   g_autoptr (GHashTable) files_skip_delete = NULL;
+  /* Only base packages' file triggers need the changed files, so don't
+   * collect them if there isn't a base rpmdb (e.g. on compose). */
+  if (!glnx_fstatat_allow_noent (tmprootfs_dfd, RPMOSTREE_RPMDB_LOCATION, NULL,
+                                 AT_SYMLINK_NOFOLLOW, error))
+    return FALSE;
+  const gboolean have_base_rpmdb = (errno == 0);
+  g_autoptr (GPtrArray) files_changed = NULL;
   if (!handle_file_dispositions (self, tmprootfs_dfd, ordering_ts, &files_skip_add,
-                                 &files_skip_delete, cancellable, error))
+                                 &files_skip_delete, have_base_rpmdb ? &files_changed : NULL,
+                                 cancellable, error))
     return FALSE;
 
-  g_autoptr (GSequence) dirs_to_remove = g_sequence_new (g_free);
+  g_autoptr (GHashTable) paths_to_delete
+      = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_ptr_array_unref);
   for (guint i = 0; i < n_rpmts_elements; i++)
     {
       rpmte te = rpmtsElement (ordering_ts, i);
@@ -4364,7 +6162,7 @@ rpmostree_context_assemble (RpmOstreeContext *self, GCancellable *cancellable, G
             return FALSE;
         }
 
-      if (!delete_package_from_root (self, te, tmprootfs_dfd, files_skip_delete, dirs_to_remove,
+      if (!delete_package_from_root (self, te, tmprootfs_dfd, files_skip_delete, paths_to_delete,
                                      cancellable, error))
         return FALSE;
       n_rpmts_done++;
@@ -4372,10 +6170,35 @@ rpmostree_context_assemble (RpmOstreeContext *self, GCancellable *cancellable, G
     }
   g_clear_pointer (&files_skip_delete, g_hash_table_unref);
 
+  g_autoptr (GSequence) dirs_to_remove = g_sequence_new (g_free);
+  if (!delete_queued_paths (self, tmprootfs_dfd, paths_to_delete, dirs_to_remove, cancellable,
+                            error))
+    return FALSE;
+  g_clear_pointer (&paths_to_delete, g_hash_table_unref);
+
   if (!handle_package_deletion_directories (tmprootfs_dfd, dirs_to_remove, cancellable, error))
     return FALSE;
   g_clear_pointer (&dirs_to_remove, g_sequence_free);
 
+  /* Packages which don't overlap with any others can be checked out in any
+   * order, so we do those in parallel after the rest. */
+  g_autoptr (GHashTable) order_sensitive = NULL;
+  g_autoptr (GPtrArray) parallel_pkgs = g_ptr_array_new ();
+  if (self->devino_cache == NULL)
+    {
+      g_autoptr (GPtrArray) candidates = g_ptr_array_new ();
+      for (guint i = 0; i < n_rpmts_elements; i++)
+        {
+          rpmte te = rpmtsElement (ordering_ts, i);
+          DnfPackage *pkg = (DnfPackage *)rpmteKey (te);
+          if (rpmteType (te) != TR_ADDED || pkg == filesystem_package
+              || g_hash_table_contains (self->fileoverride_pkgs, dnf_package_get_nevra (pkg)))
+            continue;
+          g_ptr_array_add (candidates, te);
+        }
+      order_sensitive = find_order_sensitive_packages (self, candidates);
+    }
+
   for (guint i = 0; i < n_rpmts_elements; i++)
     {
       rpmte te = rpmtsElement (ordering_ts, i);
@@ -4395,6 +6218,12 @@ rpmostree_context_assemble (RpmOstreeContext *self, GCancellable *cancellable, G
         /* we checkout those last */
         continue;
 
+      if (order_sensitive && pkg != setup_package && !g_hash_table_contains (order_sensitive, te))
+        {
+          g_ptr_array_add (parallel_pkgs, pkg);
+          continue;
+        }
+
       /* The "setup" package currently contains /etc/passwd; in the treecompose
        * case we need to inject that beforehand, so use "add files" just for
        * that.
@@ -4412,6 +6241,9 @@ rpmostree_context_assemble (RpmOstreeContext *self, GCancellable *cancellable, G
       n_rpmts_done++;
       progress->nitems_update (n_rpmts_done);
     }
+  if (!checkout_packages_parallel (self, parallel_pkgs, pkg_to_ostree_commit, files_skip_add,
+                                   *progress, &n_rpmts_done, cancellable, error))
+    return FALSE;
   g_clear_pointer (&files_skip_add, g_hash_table_unref);
 
   /* And last, any fileoverride RPMs. These *must* be done last. */
@@ -4520,6 +6352,8 @@ rpmostree_context_assemble (RpmOstreeContext *self, GCancellable *cancellable, G
       {
         auto task = rpmostreecxx::progress_begin_task ("Running pre scripts");
         guint n_pre_scripts_run = 0;
+        g_autoptr (RpmOstreeScriptRunner) runner = rpmostree_script_runner_new (
+            tmprootfs_dfd, &var_lib_rpm_statedir, self->enable_rofiles);
         for (guint i = 0; i < n_rpmts_elements; i++)
           {
             rpmte te = rpmtsElement (ordering_ts, i);
@@ -4530,8 +6364,8 @@ rpmostree_context_assemble (RpmOstreeContext *self, GCancellable *cancellable, G
             g_assert (pkg);
 
             task->set_sub_message (dnf_package_get_name (pkg));
-            if (!run_script_sync (self, tmprootfs_dfd, &var_lib_rpm_statedir, pkg,
-                                  RPMOSTREE_SCRIPT_PREIN, &n_pre_scripts_run, cancellable, error))
+            if (!run_script_sync (self, runner, pkg, RPMOSTREE_SCRIPT_PREIN, &n_pre_scripts_run,
+                                  cancellable, error))
               return FALSE;
           }
         auto msg = g_strdup_printf ("%u done", n_pre_scripts_run);
@@ -4558,32 +6392,57 @@ rpmostree_context_assemble (RpmOstreeContext *self, GCancellable *cancellable, G
       {
         auto task = rpmostreecxx::progress_begin_task ("Running post scripts");
         guint n_post_scripts_run = 0;
+        /* Debugging a script needs the terminal, so one at a time in that case */
+        const gboolean parallel_post = self->treefile_rs->get_parallel_post_scripts ()
+                                       && g_getenv ("RPMOSTREE_SCRIPT_DEBUG") == NULL;
 
-        /* %post */
-        for (guint i = 0; i < n_rpmts_elements; i++)
+        if (parallel_post)
           {
-            rpmte te = rpmtsElement (ordering_ts, i);
-            if (rpmteType (te) != TR_ADDED)
-              continue;
+            g_autoptr (GPtrArray) tes = g_ptr_array_new ();
+            for (guint i = 0; i < n_rpmts_elements; i++)
+              {
+                rpmte te = rpmtsElement (ordering_ts, i);
+                if (rpmteType (te) == TR_ADDED)
+                  g_ptr_array_add (tes, te);
+              }
+            if (!run_post_scripts_parallel (self, tmprootfs_dfd, tes, &var_lib_rpm_statedir,
+                                            *passwd_entries, *task, &n_post_scripts_run,
+                                            cancellable, error))
+              return FALSE;
+          }
+        else
+          {
+            g_autoptr (RpmOstreeScriptRunner) runner = rpmostree_script_runner_new (
+                tmprootfs_dfd, &var_lib_rpm_statedir, self->enable_rofiles);
 
-            auto pkg = (DnfPackage *)(rpmteKey (te));
-            g_assert (pkg);
+            /* %post */
+            for (guint i = 0; i < n_rpmts_elements; i++)
+              {
+                rpmte te = rpmtsElement (ordering_ts, i);
+                if (rpmteType (te) != TR_ADDED)
+                  continue;
 
-            task->set_sub_message (dnf_package_get_name (pkg));
-            if (!apply_rpmfi_overrides (self, tmprootfs_dfd, pkg, *passwd_entries, cancellable,
-                                        error))
-              return glnx_prefix_error (error, "While applying overrides for pkg %s",
-                                        dnf_package_get_name (pkg));
+                auto pkg = (DnfPackage *)(rpmteKey (te));
+                g_assert (pkg);
 
-            if (!run_script_sync (self, tmprootfs_dfd, &var_lib_rpm_statedir, pkg,
-                                  RPMOSTREE_SCRIPT_POSTIN, &n_post_scripts_run, cancellable, error))
-              return FALSE;
+                task->set_sub_message (dnf_package_get_name (pkg));
+                if (!apply_rpmfi_overrides (self, tmprootfs_dfd, pkg, *passwd_entries,
+                                            cancellable, error))
+                  return glnx_prefix_error (error, "While applying overrides for pkg %s",
+                                            dnf_package_get_name (pkg));
+
+                if (!run_script_sync (self, runner, pkg, RPMOSTREE_SCRIPT_POSTIN,
+                                      &n_post_scripts_run, cancellable, error))
+                  return FALSE;
+              }
           }
       }
 
       {
         auto task = rpmostreecxx::progress_begin_task ("Running posttrans scripts");
         guint n_posttrans_scripts_run = 0;
+        g_autoptr (RpmOstreeScriptRunner) runner = rpmostree_script_runner_new (
+            tmprootfs_dfd, &var_lib_rpm_statedir, self->enable_rofiles);
 
         /* %posttrans */
         for (guint i = 0; i < n_rpmts_elements; i++)
@@ -4596,15 +6455,15 @@ rpmostree_context_assemble (RpmOstreeContext *self, GCancellable *cancellable, G
             g_assert (pkg);
 
             task->set_sub_message (dnf_package_get_name (pkg));
-            if (!run_script_sync (self, tmprootfs_dfd, &var_lib_rpm_statedir, pkg,
-                                  RPMOSTREE_SCRIPT_POSTTRANS, &n_posttrans_scripts_run, cancellable,
-                                  error))
+            if (!run_script_sync (self, runner, pkg, RPMOSTREE_SCRIPT_POSTTRANS,
+                                  &n_posttrans_scripts_run, cancellable, error))
               return FALSE;
           }
+        g_clear_pointer (&runner, rpmostree_script_runner_free);
 
         /* file triggers */
-        if (!run_all_transfiletriggers (self, ordering_ts, tmprootfs_dfd, &n_posttrans_scripts_run,
-                                        cancellable, error))
+        if (!run_all_transfiletriggers (self, ordering_ts, tmprootfs_dfd, files_changed,
+                                        &n_posttrans_scripts_run, cancellable, error))
           return FALSE;
 
         auto msg = g_strdup_printf ("%u done", n_posttrans_scripts_run);
@@ -4650,6 +6509,7 @@ rpmostree_context_assemble (RpmOstreeContext *self, GCancellable *cancellable, G
     return FALSE;
 
   g_clear_pointer (&ordering_ts, rpmtsFree);
+  g_clear_pointer (&self->path_table, path_table_free);
 
   if (!write_rpmdb (self, tmprootfs_dfd, overlays, overrides_replace, overrides_remove, cancellable,
                     error))
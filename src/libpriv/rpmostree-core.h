@@ -116,6 +116,7 @@ void rpmostree_context_set_repos_dir (RpmOstreeContext *self, const char *reposd
 
 void rpmostree_context_set_repos (RpmOstreeContext *self, OstreeRepo *base_repo,
                                   OstreeRepo *pkgcache_repo);
+void rpmostree_context_set_import_stats (RpmOstreeContext *self, gboolean enabled);
 void rpmostree_context_set_devino_cache (RpmOstreeContext *self,
                                          OstreeRepoDevInoCache *devino_cache);
 void rpmostree_context_disable_rofiles (RpmOstreeContext *self);
@@ -165,6 +166,9 @@ gboolean rpmostree_context_consume_package (RpmOstreeContext *self, DnfPackage *
 gboolean rpmostree_context_import (RpmOstreeContext *self, GCancellable *cancellable,
                                    GError **error);
 
+gboolean rpmostree_context_download_and_import (RpmOstreeContext *self, GCancellable *cancellable,
+                                                GError **error);
+
 gboolean rpmostree_context_force_relabel (RpmOstreeContext *self, GCancellable *cancellable,
                                           GError **error);
 
@@ -0,0 +1,220 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Licensed under the GNU Lesser General Public License Version 2.1
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/**
+ * An index from (device, inode) to ostree content objects, for compose commits.
+ *
+ * In unified core mode with rofiles-fuse, almost every regular file in the
+ * rootfs is a hardlink to an object in the pkgcache repo, and nothing can
+ * modify those in place.  So once we've committed a given inode with given
+ * metadata, we know its content checksum, and the next compose on the same
+ * builder doesn't need to read and checksum it again.  Only the files written
+ * by scriptlets or postprocessing (which are new inodes) need to be hashed.
+ * While the index is empty, compose commits serially using ostree's devino
+ * cache instead, and seeds the index afterwards.
+ *
+ * Inode numbers get reused once the pkgcache is pruned, so each entry is
+ * also keyed on the inode generation, and the whole index is dropped if the
+ * pkgcache repo itself was recreated.  Like the digest index, this is only
+ * populated from checksums ostree computed, and entries are only used if the
+ * object is still in the repo we're committing to.  Only the entries used by
+ * the last compose are kept, so the index doesn't grow with every package
+ * version the builder has ever seen.
+ */
+
+#include "config.h"
+
+#include "rpmostree-checksum-map.h"
+#include "rpmostree-devino-index.h"
+#include "rpmostree-util.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+#ifndef FS_IOC_GETVERSION
+#define FS_IOC_GETVERSION _IOR ('v', 1, long)
+#endif
+
+/* Version 1 wasn't stored as a checksum map */
+#define DEVINO_INDEX_VERSION 2
+
+struct RpmOstreeDevinoIndex
+{
+  gboolean have_generations;
+  RpmOstreeChecksumMap *map;
+};
+
+/*
+ * rpmostree_devino_index_load:
+ * @pkgcache_repo: Repo whose objects are hardlinked into the rootfs
+ * @commit_repo: Repo the rootfs is committed to
+ *
+ * Load the devino index stored in @pkgcache_repo, or create an empty one if
+ * it doesn't exist yet or no longer applies.
+ */
+RpmOstreeDevinoIndex *
+rpmostree_devino_index_load (OstreeRepo *pkgcache_repo, OstreeRepo *commit_repo,
+                             GCancellable *cancellable, GError **error)
+{
+  g_autoptr (RpmOstreeDevinoIndex) index = g_new0 (RpmOstreeDevinoIndex, 1);
+
+  int repo_dfd = ostree_repo_get_dfd (pkgcache_repo);
+  struct stat stbuf;
+  if (!glnx_fstatat (repo_dfd, "objects", &stbuf, 0, error))
+    return (RpmOstreeDevinoIndex *)glnx_prefix_error_null (error, "Loading devino index");
+  /* Different filesystem, or the pkgcache was recreated */
+  g_autoptr (GVariant) scope = g_variant_ref_sink (
+      g_variant_new ("(tt)", (guint64)stbuf.st_dev, (guint64)stbuf.st_ino));
+
+  /* Without inode generations (e.g. tmpfs, overlayfs) nothing gets a key */
+  glnx_autofd int objects_dfd = -1;
+  if (!glnx_opendirat (repo_dfd, "objects", TRUE, &objects_dfd, error))
+    return (RpmOstreeDevinoIndex *)glnx_prefix_error_null (error, "Loading devino index");
+  long generation = 0;
+  if (ioctl (objects_dfd, FS_IOC_GETVERSION, &generation) == 0)
+    index->have_generations = TRUE;
+  else if (!G_IN_SET (errno, ENOTTY, EOPNOTSUPP, EINVAL))
+    return (RpmOstreeDevinoIndex *)glnx_null_throw_errno_prefix (error,
+                                                                 "ioctl(FS_IOC_GETVERSION)");
+  if (!index->have_generations)
+    {
+      index->map = rpmostree_checksum_map_new (pkgcache_repo, RPMOSTREE_DEVINO_INDEX_PATH,
+                                               DEVINO_INDEX_VERSION, scope, commit_repo);
+      return util::move_nullify (index);
+    }
+
+  index->map = rpmostree_checksum_map_load (pkgcache_repo, RPMOSTREE_DEVINO_INDEX_PATH,
+                                            DEVINO_INDEX_VERSION, scope, commit_repo,
+                                            cancellable, error);
+  if (!index->map)
+    return (RpmOstreeDevinoIndex *)glnx_prefix_error_null (error, "Loading devino index");
+  return util::move_nullify (index);
+}
+
+void
+rpmostree_devino_index_free (RpmOstreeDevinoIndex *index)
+{
+  g_clear_pointer (&index->map, rpmostree_checksum_map_free);
+  g_free (index);
+}
+
+/*
+ * rpmostree_devino_index_make_key:
+ * @fd: File descriptor for the file
+ * @stbuf: Its stat data
+ * @file_info: File info as it will be committed
+ * @xattrs: Extended attributes as they will be committed
+ * @out_key: (out) (nullable): Key, or %NULL if the file can't be indexed
+ *
+ * Compute a key covering the inode and everything else that goes into the
+ * ostree content checksum for this regular file.  Only files hardlinked from
+ * elsewhere (i.e. the pkgcache) on a filesystem that exposes inode
+ * generations get a key.
+ */
+gboolean
+rpmostree_devino_index_make_key (int fd, const struct stat *stbuf, GFileInfo *file_info,
+                                 GVariant *xattrs, char **out_key, GError **error)
+{
+  *out_key = NULL;
+  if (stbuf->st_nlink < 2)
+    return TRUE;
+
+  long generation = 0;
+  if (ioctl (fd, FS_IOC_GETVERSION, &generation) < 0)
+    {
+      if (G_IN_SET (errno, ENOTTY, EOPNOTSUPP, EINVAL))
+        return TRUE;
+      return glnx_throw_errno_prefix (error, "ioctl(FS_IOC_GETVERSION)");
+    }
+
+  g_autoptr (GVariant) xattrs_v
+      = xattrs ? g_variant_ref (xattrs) : g_variant_new_array (G_VARIANT_TYPE ("(ayay)"), NULL, 0);
+  g_autoptr (GVariant) key_v = g_variant_ref_sink (
+      g_variant_new ("(tttuuu@a(ayay))", (guint64)stbuf->st_dev, (guint64)stbuf->st_ino,
+                     (guint64)generation, g_file_info_get_attribute_uint32 (file_info, "unix::uid"),
+                     g_file_info_get_attribute_uint32 (file_info, "unix::gid"),
+                     g_file_info_get_attribute_uint32 (file_info, "unix::mode"), xattrs_v));
+  g_autoptr (GVariant) normalized = g_variant_get_normal_form (key_v);
+  *out_key = g_compute_checksum_for_data (G_CHECKSUM_SHA256,
+                                          (const guint8 *)g_variant_get_data (normalized),
+                                          g_variant_get_size (normalized));
+  return TRUE;
+}
+
+/*
+ * rpmostree_devino_index_lookup:
+ * @out_checksum: (out) (nullable): Content checksum, or %NULL if not known
+ *
+ * Look up the content object for @key.  This only returns a checksum if the
+ * object is actually present in the commit repo.  Safe to call from multiple
+ * threads.
+ */
+gboolean
+rpmostree_devino_index_lookup (RpmOstreeDevinoIndex *index, const char *key, char **out_checksum,
+                               GCancellable *cancellable, GError **error)
+{
+  return rpmostree_checksum_map_lookup (index->map, key, out_checksum, cancellable, error);
+}
+
+/* Record that @key maps to content object @checksum.  Safe to call from
+ * multiple threads. */
+void
+rpmostree_devino_index_insert (RpmOstreeDevinoIndex *index, const char *key, const char *checksum)
+{
+  rpmostree_checksum_map_insert (index->map, key, checksum);
+}
+
+/* Returns: %TRUE if the index has entries which may be used for this compose */
+gboolean
+rpmostree_devino_index_can_serve (RpmOstreeDevinoIndex *index)
+{
+  return index->have_generations && rpmostree_checksum_map_get_size (index->map) > 0;
+}
+
+/* Returns: %TRUE if files on the pkgcache filesystem can be indexed at all */
+gboolean
+rpmostree_devino_index_is_supported (RpmOstreeDevinoIndex *index)
+{
+  return index->have_generations;
+}
+
+/* Returns: The number of files whose checksum came from the index */
+guint
+rpmostree_devino_index_get_n_hits (RpmOstreeDevinoIndex *index)
+{
+  return rpmostree_checksum_map_get_n_hits (index->map);
+}
+
+/*
+ * rpmostree_devino_index_save:
+ *
+ * Write the index back to the pkgcache repo, keeping only the entries this
+ * compose looked up or added.  Anything else is for files no longer in the
+ * tree (or at least not hardlinked from the pkgcache any more).
+ */
+gboolean
+rpmostree_devino_index_save (RpmOstreeDevinoIndex *index, GCancellable *cancellable,
+                             GError **error)
+{
+  if (!rpmostree_checksum_map_save (index->map, RPMOSTREE_CHECKSUM_MAP_SAVE_ONLY_USED,
+                                    cancellable, error))
+    return glnx_prefix_error (error, "Saving devino index");
+  return TRUE;
+}
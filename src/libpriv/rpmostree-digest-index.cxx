@@ -0,0 +1,147 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Licensed under the GNU Lesser General Public License Version 2.1
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/**
+ * An index from RPM file digests to ostree content objects in the pkgcache.
+ *
+ * RPM headers carry a digest for each regular file.  Combined with everything
+ * else that goes into an ostree file object (mode, ownership and the final
+ * xattrs, including the SELinux label), this fully determines the content
+ * checksum.  So if we've imported the same file before (e.g. from a previous
+ * build of the same package), we can reference the existing object instead of
+ * checksumming and writing it again.
+ *
+ * The index is only ever populated from checksums ostree computed itself, for
+ * objects whose content we checked against the header digest; otherwise one
+ * package with a bogus payload could poison the index for every other
+ * package shipping a file with that digest.  We always verify the object is
+ * still present before using an entry (and drop it if not), so a stale or
+ * lost index just means we do more work.
+ */
+
+#include "config.h"
+
+#include "rpmostree-checksum-map.h"
+#include "rpmostree-digest-index.h"
+#include "rpmostree-util.h"
+
+#include <string.h>
+
+/* Version 1 indexed unverified objects; version 2 wasn't stored as a
+ * checksum map */
+#define DIGEST_INDEX_VERSION 3
+
+struct RpmOstreeDigestIndex
+{
+  RpmOstreeChecksumMap *map;
+};
+
+/*
+ * rpmostree_digest_index_load:
+ * @repo: pkgcache repo
+ *
+ * Load the digest index for @repo, or create an empty one if it doesn't exist
+ * yet.  An index written by an incompatible version is silently discarded.
+ */
+RpmOstreeDigestIndex *
+rpmostree_digest_index_load (OstreeRepo *repo, GCancellable *cancellable, GError **error)
+{
+  g_autoptr (RpmOstreeDigestIndex) index = g_new0 (RpmOstreeDigestIndex, 1);
+  index->map = rpmostree_checksum_map_load (repo, RPMOSTREE_DIGEST_INDEX_PATH,
+                                            DIGEST_INDEX_VERSION, NULL, repo, cancellable, error);
+  if (!index->map)
+    return (RpmOstreeDigestIndex *)glnx_prefix_error_null (error, "Loading digest index");
+  return util::move_nullify (index);
+}
+
+void
+rpmostree_digest_index_free (RpmOstreeDigestIndex *index)
+{
+  g_clear_pointer (&index->map, rpmostree_checksum_map_free);
+  g_free (index);
+}
+
+/*
+ * rpmostree_digest_index_make_key:
+ * @digest_algo: RPM digest algorithm (a `pgpHashAlgo`)
+ * @digest: Hex digest of the file from the RPM header
+ * @file_info: File info as it will be committed
+ * @xattrs: (nullable): Extended attributes from the commit modifier callback
+ * @label: (nullable): SELinux label ostree will apply
+ *
+ * Returns: A key covering everything that goes into the ostree content
+ * checksum for this regular file.
+ */
+char *
+rpmostree_digest_index_make_key (guint32 digest_algo, const char *digest, GFileInfo *file_info,
+                                 GVariant *xattrs, const char *label)
+{
+  g_autoptr (GVariant) xattrs_v
+      = xattrs ? g_variant_ref (xattrs) : g_variant_new_array (G_VARIANT_TYPE ("(ayay)"), NULL, 0);
+  g_autoptr (GVariant) key_v = g_variant_ref_sink (g_variant_new (
+      "(usuuu@a(ayay)s)", digest_algo, digest,
+      g_file_info_get_attribute_uint32 (file_info, "unix::uid"),
+      g_file_info_get_attribute_uint32 (file_info, "unix::gid"),
+      g_file_info_get_attribute_uint32 (file_info, "unix::mode"), xattrs_v, label ?: ""));
+  g_autoptr (GVariant) normalized = g_variant_get_normal_form (key_v);
+  return g_compute_checksum_for_data (G_CHECKSUM_SHA256,
+                                      (const guint8 *)g_variant_get_data (normalized),
+                                      g_variant_get_size (normalized));
+}
+
+/*
+ * rpmostree_digest_index_lookup:
+ * @out_checksum: (out) (nullable): Content checksum, or %NULL if not known
+ *
+ * Look up the content object for @key.  This only returns a checksum if the
+ * object is actually present in the repo.  Safe to call from multiple threads.
+ */
+gboolean
+rpmostree_digest_index_lookup (RpmOstreeDigestIndex *index, const char *key, char **out_checksum,
+                               GCancellable *cancellable, GError **error)
+{
+  return rpmostree_checksum_map_lookup (index->map, key, out_checksum, cancellable, error);
+}
+
+/* Record that @key maps to content object @checksum.  Safe to call from
+ * multiple threads. */
+void
+rpmostree_digest_index_insert (RpmOstreeDigestIndex *index, const char *key, const char *checksum)
+{
+  rpmostree_checksum_map_insert (index->map, key, checksum);
+}
+
+/*
+ * rpmostree_digest_index_save:
+ *
+ * Write the index back to the repo if it changed.  Entries for objects which
+ * have since been pruned from the repo are dropped, since once a package
+ * version is gone, nothing will look up its digests again.  Unlike the devino
+ * index, we keep entries this run didn't use: the next build of a package
+ * we didn't import this time is exactly what the index is for.
+ */
+gboolean
+rpmostree_digest_index_save (RpmOstreeDigestIndex *index, GCancellable *cancellable,
+                             GError **error)
+{
+  if (!rpmostree_checksum_map_save (index->map, RPMOSTREE_CHECKSUM_MAP_SAVE_PRUNE_MISSING,
+                                    cancellable, error))
+    return glnx_prefix_error (error, "Saving digest index");
+  return TRUE;
+}
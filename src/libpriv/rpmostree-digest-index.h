@@ -0,0 +1,53 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Licensed under the GNU Lesser General Public License Version 2.1
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#pragma once
+
+#include <ostree.h>
+
+#include "libglnx.h"
+
+G_BEGIN_DECLS
+
+/* Where the index lives, relative to the pkgcache repo */
+#define RPMOSTREE_DIGEST_INDEX_PATH "extensions/rpmostree/digest-index"
+
+typedef struct RpmOstreeDigestIndex RpmOstreeDigestIndex;
+
+RpmOstreeDigestIndex *rpmostree_digest_index_load (OstreeRepo *repo, GCancellable *cancellable,
+                                                   GError **error);
+
+void rpmostree_digest_index_free (RpmOstreeDigestIndex *index);
+
+char *rpmostree_digest_index_make_key (guint32 digest_algo, const char *digest,
+                                       GFileInfo *file_info, GVariant *xattrs, const char *label);
+
+gboolean rpmostree_digest_index_lookup (RpmOstreeDigestIndex *index, const char *key,
+                                        char **out_checksum, GCancellable *cancellable,
+                                        GError **error);
+
+void rpmostree_digest_index_insert (RpmOstreeDigestIndex *index, const char *key,
+                                    const char *checksum);
+
+gboolean rpmostree_digest_index_save (RpmOstreeDigestIndex *index, GCancellable *cancellable,
+                                      GError **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (RpmOstreeDigestIndex, rpmostree_digest_index_free)
+
+G_END_DECLS
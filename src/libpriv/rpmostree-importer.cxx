@@ -31,6 +31,7 @@
 
 #include "rpmostree-core.h"
 #include "rpmostree-importer.h"
+#include "rpmostree-label-manifest.h"
 #include "rpmostree-rpm-util.h"
 #include "rpmostree-unpacker-core.h"
 #include "rpmostree-util.h"
@@ -43,6 +44,7 @@
 #include <rpm/rpmfiles.h>
 #include <rpm/rpmlib.h>
 #include <rpm/rpmlog.h>
+#include <rpm/rpmpgp.h>
 #include <rpm/rpmts.h>
 
 #include <optional>
@@ -58,6 +60,12 @@ struct RpmOstreeImporter
   OstreeSePolicy *sepolicy;
   struct archive *archive;
   int fd;
+  RpmOstreeUnpackStats *stats; /* Shared with the archive reader */
+  RpmOstreeDigestIndex *digest_index;     /* Borrowed */
+  GHashTable *dedup_candidates;           /* rpmfi path -> rpmfi index */
+  GHashTable *dedup_keys;                 /* path -> digest index key */
+  GHashTable *dedup_xattrs;               /* path -> xattrs computed for the lookup */
+  RpmOstreeLabelManifest *label_manifest; /* If labeling, the labels we assigned */
   Header hdr;
   rpmfi fi;
   off_t cpio_offset;
@@ -76,6 +84,11 @@ rpmostree_importer_finalize (GObject *object)
     headerFree (self->hdr);
   if (self->archive)
     archive_read_free (self->archive);
+  g_free (self->stats);
+  g_clear_pointer (&self->dedup_candidates, g_hash_table_unref);
+  g_clear_pointer (&self->dedup_keys, g_hash_table_unref);
+  g_clear_pointer (&self->dedup_xattrs, g_hash_table_unref);
+  g_clear_pointer (&self->label_manifest, rpmostree_label_manifest_free);
   if (self->fi)
     (void)rpmfiFree (self->fi);
   glnx_close_fd (&self->fd);
@@ -224,6 +237,7 @@ build_rpmfi_overrides (RpmOstreeImporter *self, GCancellable *cancellable, GErro
  * @pkg: (optional): Package reference, used for metadata
  * @flags: flags
  * @sepolicy: (optional): SELinux policy
+ * @allow_mmap: Whether @fd may be mmap()ed; only for files we own
  * @cancellable: Cancellable
  * @error: error
  *
@@ -234,14 +248,15 @@ build_rpmfi_overrides (RpmOstreeImporter *self, GCancellable *cancellable, GErro
 RpmOstreeImporter *
 rpmostree_importer_new_take_fd (int *fd, OstreeRepo *repo, DnfPackage *pkg,
                                 rpmostreecxx::RpmImporterFlags &flags, OstreeSePolicy *sepolicy,
-                                GCancellable *cancellable, GError **error)
+                                gboolean allow_mmap, GCancellable *cancellable, GError **error)
 {
   RpmOstreeImporter *ret = NULL;
   g_auto (Header) hdr = NULL;
   g_auto (rpmfi) fi = NULL;
   gsize cpio_offset = 0;
+  g_autofree RpmOstreeUnpackStats *stats = g_new0 (RpmOstreeUnpackStats, 1);
 
-  g_autoptr (archive) ar = rpmostree_unpack_rpm2cpio (*fd, error);
+  g_autoptr (archive) ar = rpmostree_unpack_rpm2cpio (*fd, allow_mmap, stats, error);
   if (ar == NULL)
     return NULL;
 
@@ -258,8 +273,11 @@ rpmostree_importer_new_take_fd (int *fd, OstreeRepo *repo, DnfPackage *pkg,
   ret = (RpmOstreeImporter *)g_object_new (RPMOSTREE_TYPE_IMPORTER, NULL);
   ret->importer_rs.emplace (std::move (importer_rs));
   ret->fd = glnx_steal_fd (fd);
+  ret->stats = util::move_nullify (stats);
   ret->repo = (OstreeRepo *)g_object_ref (repo);
   ret->sepolicy = (OstreeSePolicy *)(sepolicy ? g_object_ref (sepolicy) : NULL);
+  if (sepolicy)
+    ret->label_manifest = rpmostree_label_manifest_new ();
   ret->fi = util::move_nullify (fi);
   ret->archive = util::move_nullify (ar);
   ret->hdr = util::move_nullify (hdr);
@@ -273,6 +291,19 @@ rpmostree_importer_new_take_fd (int *fd, OstreeRepo *repo, DnfPackage *pkg,
   return ret;
 }
 
+/*
+ * rpmostree_importer_set_digest_index:
+ * @index: (nullable): Index, must outlive the importer
+ *
+ * Use @index to avoid writing regular files whose content we've already
+ * imported, and record the files we do write in it.
+ */
+void
+rpmostree_importer_set_digest_index (RpmOstreeImporter *self, RpmOstreeDigestIndex *index)
+{
+  self->digest_index = index;
+}
+
 static void
 get_rpmfi_override (RpmOstreeImporter *self, const char *abs_filepath, const char **out_user,
                     const char **out_group, const char **out_fcaps, GVariant **out_ima)
@@ -412,18 +443,26 @@ build_metadata_variant (RpmOstreeImporter *self, GVariant **out_variant, char **
    * to record. It will help us during future overlays to determine whether the
    * files should be relabeled. */
   if (self->sepolicy)
-    g_variant_builder_add (&metadata_builder, "{sv}", "rpmostree.sepolicy",
-                           g_variant_new_string (ostree_sepolicy_get_csum (self->sepolicy)));
+    {
+      g_variant_builder_add (&metadata_builder, "{sv}", "rpmostree.sepolicy",
+                             g_variant_new_string (ostree_sepolicy_get_csum (self->sepolicy)));
+      /* And the labels themselves, so relabeling can only touch what changed */
+      GVariant *manifest_v = rpmostree_label_manifest_to_variant (self->label_manifest);
+      if (manifest_v)
+        g_variant_builder_add (&metadata_builder, "{sv}", RPMOSTREE_LABEL_MANIFEST_KEY,
+                               manifest_v);
+    }
 
   /* let's be nice to our future selves just in case */
   g_variant_builder_add (&metadata_builder, "{sv}", "rpmostree.unpack_version",
                          g_variant_new_uint32 (1));
 
   /* Originally we just had unpack_version = 1, let's add a minor version for
-   * compatible increments.  Bumped 4 → 5 for timestamp, and 5 → 6 for docs.
+   * compatible increments.  Bumped 4 → 5 for timestamp, 5 → 6 for docs, and
+   * 6 → 7 for the label manifest.
    */
   g_variant_builder_add (&metadata_builder, "{sv}", "rpmostree.unpack_minor_version",
-                         g_variant_new_uint32 (6));
+                         g_variant_new_uint32 (7));
 
   if (self->pkg)
     {
@@ -458,9 +497,196 @@ build_metadata_variant (RpmOstreeImporter *self, GVariant **out_variant, char **
 typedef struct
 {
   RpmOstreeImporter *self;
+  OstreeMutableTree *mtree;
   GError **error;
 } cb_data;
 
+static GVariant *compute_xattrs (RpmOstreeImporter *self, const char *path,
+                                 GFileInfo *file_info, GError **error);
+
+/* Gather the regular files we can look up in the digest index.  Hardlinks are
+ * resolved by path within the archive, so we leave those to ostree. */
+static void
+build_dedup_candidates (RpmOstreeImporter *self)
+{
+  self->dedup_candidates = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  self->dedup_keys = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  self->dedup_xattrs
+      = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_variant_unref);
+
+  int i;
+  rpmfiInit (self->fi, 0);
+  while ((i = rpmfiNext (self->fi)) >= 0)
+    {
+      if (!S_ISREG (rpmfiFMode (self->fi)) || rpmfiFNlink (self->fi) != 1)
+        continue;
+      if (rpmfiFFlags (self->fi) & RPMFILE_GHOST)
+        continue;
+      g_hash_table_insert (self->dedup_candidates, g_strdup (rpmfiFN (self->fi)),
+                           GINT_TO_POINTER (i));
+    }
+}
+
+/* Find the directory in @root that would hold @path, if it exists yet */
+static OstreeMutableTree *
+mtree_lookup_parent (OstreeMutableTree *root, const char *path, const char **out_name)
+{
+  g_auto (GStrv) parts = g_strsplit (path + 1, "/", -1);
+  const guint n = g_strv_length (parts);
+  if (n == 0)
+    return NULL;
+
+  OstreeMutableTree *dir = root;
+  for (guint i = 0; i + 1 < n && dir != NULL; i++)
+    dir = (OstreeMutableTree *)g_hash_table_lookup (ostree_mutable_tree_get_subdirs (dir),
+                                                    parts[i]);
+  *out_name = strrchr (path, '/') + 1;
+  return dir;
+}
+
+/* If we've imported this exact file before, reference the existing content
+ * object directly rather than having ostree checksum and write it again.
+ * Otherwise, remember its key so we can record what ostree wrote.
+ */
+static gboolean
+try_dedup_file (cb_data *data, const char *path, GFileInfo *file_info, gboolean *out_deduped,
+                GError **error)
+{
+  RpmOstreeImporter *self = data->self;
+  *out_deduped = FALSE;
+
+  gpointer fi_index;
+  if (!g_hash_table_lookup_extended (self->dedup_candidates, path, NULL, &fi_index))
+    return TRUE;
+  rpmfiInit (self->fi, GPOINTER_TO_INT (fi_index));
+  if (rpmfiNext (self->fi) < 0)
+    return TRUE;
+  int algo = 0;
+  g_autofree char *digest = rpmfiFDigestHex (self->fi, &algo);
+  if (digest == NULL || *digest == '\0')
+    return TRUE;
+
+  /* These are the final xattrs for the object, including the SELinux label */
+  g_autoptr (GVariant) xattrs = compute_xattrs (self, path, file_info, error);
+  if (!xattrs)
+    return FALSE;
+
+  g_autofree char *key = rpmostree_digest_index_make_key (algo, digest, file_info, xattrs, NULL);
+  g_autofree char *checksum = NULL;
+  if (!rpmostree_digest_index_lookup (self->digest_index, key, &checksum, NULL, error))
+    return FALSE;
+
+  /* Parent directories are normally created as ostree walks the archive; if
+   * this is the first entry in its directory, we need ostree to do that. */
+  const char *name = NULL;
+  OstreeMutableTree *parent = checksum ? mtree_lookup_parent (data->mtree, path, &name) : NULL;
+  if (parent == NULL)
+    {
+      g_hash_table_replace (self->dedup_keys, g_strdup (path), util::move_nullify (key));
+      /* ostree will ask for these again via xattr_cb(); don't label twice */
+      g_hash_table_replace (self->dedup_xattrs, g_strdup (path), util::move_nullify (xattrs));
+      return TRUE;
+    }
+
+  if (!ostree_mutable_tree_replace_file (parent, name, checksum, error))
+    return FALSE;
+  self->stats->n_deduped++;
+  *out_deduped = TRUE;
+  return TRUE;
+}
+
+static gboolean
+digest_algo_to_checksum_type (int algo, GChecksumType *out_type)
+{
+  switch (algo)
+    {
+    case PGPHASHALGO_MD5:
+      *out_type = G_CHECKSUM_MD5;
+      return TRUE;
+    case PGPHASHALGO_SHA1:
+      *out_type = G_CHECKSUM_SHA1;
+      return TRUE;
+    case PGPHASHALGO_SHA256:
+      *out_type = G_CHECKSUM_SHA256;
+      return TRUE;
+    case PGPHASHALGO_SHA384:
+      *out_type = G_CHECKSUM_SHA384;
+      return TRUE;
+    case PGPHASHALGO_SHA512:
+      *out_type = G_CHECKSUM_SHA512;
+      return TRUE;
+    default:
+      return FALSE;
+    }
+}
+
+/* The header digests are only as trustworthy as the payload that came with
+ * them; check that the content object ostree wrote actually hashes to the
+ * digest in the header before we let other packages reference it. */
+static gboolean
+object_matches_digest (OstreeRepo *repo, const char *checksum, int algo, const char *digest,
+                       gboolean *out_matches, GCancellable *cancellable, GError **error)
+{
+  *out_matches = FALSE;
+  GChecksumType type;
+  if (!digest_algo_to_checksum_type (algo, &type))
+    return TRUE;
+
+  g_autoptr (GInputStream) in = NULL;
+  if (!ostree_repo_load_file (repo, checksum, &in, NULL, NULL, cancellable, error))
+    return FALSE;
+
+  g_autoptr (GChecksum) hasher = g_checksum_new (type);
+  guint8 buf[64 * 1024];
+  while (TRUE)
+    {
+      gssize n = g_input_stream_read (in, buf, sizeof (buf), cancellable, error);
+      if (n < 0)
+        return FALSE;
+      if (n == 0)
+        break;
+      g_checksum_update (hasher, buf, n);
+    }
+
+  *out_matches = g_str_equal (g_checksum_get_string (hasher), digest);
+  return TRUE;
+}
+
+/* Record the content checksums ostree computed for the files we couldn't
+ * find in the digest index, once we've verified them against the header. */
+static gboolean
+update_digest_index (RpmOstreeImporter *self, OstreeMutableTree *mtree, GCancellable *cancellable,
+                     GError **error)
+{
+  GLNX_HASH_TABLE_FOREACH_KV (self->dedup_keys, const char *, path, const char *, key)
+    {
+      const char *name = NULL;
+      OstreeMutableTree *parent = mtree_lookup_parent (mtree, path, &name);
+      if (parent == NULL)
+        continue;
+      auto checksum = (const char *)g_hash_table_lookup (ostree_mutable_tree_get_files (parent),
+                                                         name);
+      if (checksum == NULL)
+        continue;
+
+      rpmfiInit (self->fi, GPOINTER_TO_INT (g_hash_table_lookup (self->dedup_candidates, path)));
+      if (rpmfiNext (self->fi) < 0)
+        continue;
+      int algo = 0;
+      g_autofree char *digest = rpmfiFDigestHex (self->fi, &algo);
+      gboolean matches = FALSE;
+      if (!object_matches_digest (self->repo, checksum, algo, digest, &matches, cancellable,
+                                  error))
+        return glnx_prefix_error (error, "Verifying %s", path);
+      if (matches)
+        rpmostree_digest_index_insert (self->digest_index, key, checksum);
+      else
+        g_debug ("Not indexing %s: payload does not match header digest", path);
+    }
+
+  return TRUE;
+}
+
 static OstreeRepoCommitFilterResult
 compose_filter_cb (OstreeRepo *repo, const char *path, GFileInfo *file_info, gpointer user_data)
 {
@@ -521,23 +747,23 @@ compose_filter_cb (OstreeRepo *repo, const char *path, GFileInfo *file_info, gpo
 
   (*self->importer_rs)->tweak_imported_file_info (*file_info);
 
+  if (self->dedup_candidates && g_file_info_get_file_type (file_info) == G_FILE_TYPE_REGULAR)
+    {
+      gboolean deduped = FALSE;
+      if (!try_dedup_file ((cb_data *)user_data, path, file_info, &deduped, error))
+        return OSTREE_REPO_COMMIT_FILTER_SKIP;
+      if (deduped)
+        return OSTREE_REPO_COMMIT_FILTER_SKIP;
+    }
+
   return OSTREE_REPO_COMMIT_FILTER_ALLOW;
 }
 
+/* Returns: (transfer full): The final xattrs for @path, recording its label
+ * in the manifest if we're labeling. */
 static GVariant *
-xattr_cb (OstreeRepo *repo, const char *path, GFileInfo *file_info, gpointer user_data)
+compute_xattrs (RpmOstreeImporter *self, const char *path, GFileInfo *file_info, GError **error)
 {
-  // NOTE(lucab): `path` here is the ostree-compatible absolute filepath,
-  //  i.e. after translation by `translate_pathname` callback.
-
-  /* Sanity checks: path is absolute, data pointer is ok */
-  g_assert (path != NULL);
-  g_assert (*path == '/');
-  g_assert (user_data != NULL);
-
-  RpmOstreeImporter *self = ((cb_data *)user_data)->self;
-  GError **error = ((cb_data *)user_data)->error;
-
   const char *fcaps = NULL;
 
   GVariant *imasig = NULL;
@@ -560,9 +786,54 @@ xattr_cb (OstreeRepo *repo, const char *path, GFileInfo *file_info, gpointer use
                              imasig);
     }
 
+  /* We do the labeling ourselves rather than giving the policy to the commit
+   * modifier, so we can record it in the manifest without a second lookup.
+   * This matches what ostree does: the label always goes last. */
+  if (self->sepolicy)
+    {
+      g_assert (file_info != NULL);
+      const guint32 mode = g_file_info_get_attribute_uint32 (file_info, "unix::mode");
+      g_autofree char *label = NULL;
+      if (!ostree_sepolicy_get_label (self->sepolicy, path, mode, &label, NULL, error))
+        return NULL;
+      if (label == NULL)
+        return (GVariant *)glnx_null_throw (error, "Failed to look up SELinux label for '%s'",
+                                            path);
+      g_variant_builder_add (&builder, "(@ay@ay)", g_variant_new_bytestring ("security.selinux"),
+                             g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE, label,
+                                                        strlen (label) + 1, 1));
+      rpmostree_label_manifest_add (self->label_manifest, path, mode, label);
+    }
+
   return g_variant_ref_sink (g_variant_builder_end (&builder));
 }
 
+static GVariant *
+xattr_cb (OstreeRepo *repo, const char *path, GFileInfo *file_info, gpointer user_data)
+{
+  // NOTE(lucab): `path` here is the ostree-compatible absolute filepath,
+  //  i.e. after translation by `translate_pathname` callback.
+
+  /* Sanity checks: path is absolute, data pointer is ok */
+  g_assert (path != NULL);
+  g_assert (*path == '/');
+  g_assert (user_data != NULL);
+
+  RpmOstreeImporter *self = ((cb_data *)user_data)->self;
+  GError **error = ((cb_data *)user_data)->error;
+
+  /* Already computed by try_dedup_file() */
+  if (self->dedup_xattrs)
+    {
+      g_autofree char *key = NULL;
+      gpointer xattrs = NULL;
+      if (g_hash_table_steal_extended (self->dedup_xattrs, path, (gpointer *)&key, &xattrs))
+        return (GVariant *)xattrs;
+    }
+
+  return compute_xattrs (self, path, file_info, error);
+}
+
 /* Given a path in an RPM archive, possibly translate it for ostree convention. */
 static char *
 handle_translate_pathname (OstreeRepo *_repo, const struct stat *_stbuf, const char *path,
@@ -589,14 +860,18 @@ import_rpm_to_repo (RpmOstreeImporter *self, char **out_csum, char **out_metadat
   OstreeRepo *repo = self->repo;
   /* Passed to the commit modifier */
   GError *cb_error = NULL;
-  cb_data fdata = { self, &cb_error };
+  g_autoptr (OstreeMutableTree) mtree = ostree_mutable_tree_new ();
+  cb_data fdata = { self, mtree, &cb_error };
+
+  if (self->digest_index)
+    build_dedup_candidates (self);
 
   /* If changing this, also look at changing rpmostree-postprocess.cxx */
   int modifier_flags = OSTREE_REPO_COMMIT_MODIFIER_FLAGS_ERROR_ON_UNLABELED;
   g_autoptr (OstreeRepoCommitModifier) modifier = ostree_repo_commit_modifier_new (
       static_cast<OstreeRepoCommitModifierFlags> (modifier_flags), compose_filter_cb, &fdata, NULL);
+  /* NB: labeling is done by xattr_cb() */
   ostree_repo_commit_modifier_set_xattr_callback (modifier, xattr_cb, NULL, &fdata);
-  ostree_repo_commit_modifier_set_sepolicy (modifier, self->sepolicy);
 
   OstreeRepoImportArchiveOptions opts = { 0 };
   opts.ignore_unsupported_content = TRUE;
@@ -604,7 +879,6 @@ import_rpm_to_repo (RpmOstreeImporter *self, char **out_csum, char **out_metadat
   opts.translate_pathname = handle_translate_pathname;
   opts.translate_pathname_user_data = self;
 
-  g_autoptr (OstreeMutableTree) mtree = ostree_mutable_tree_new ();
   if (!ostree_repo_import_archive_to_mtree (repo, &opts, self->archive, mtree, modifier,
                                             cancellable, error))
     return glnx_prefix_error (error, "Importing archive");
@@ -616,6 +890,9 @@ import_rpm_to_repo (RpmOstreeImporter *self, char **out_csum, char **out_metadat
       return FALSE;
     }
 
+  if (self->dedup_keys && !update_digest_index (self, mtree, cancellable, error))
+    return FALSE;
+
   /* Handle any data we've accumulated to write to tmpfiles.d.
    * I originally tried to do this entirely in memory but things
    * like selinux labeling only happen as callbacks out of using
@@ -691,11 +968,13 @@ rpmostree_importer_run (RpmOstreeImporter *self, char **out_csum, char **out_met
 
   g_autofree char *metadata_sha256 = NULL;
   g_autofree char *csum = NULL;
+  const gint64 start_time = g_get_monotonic_time ();
   if (!import_rpm_to_repo (self, &csum, &metadata_sha256, cancellable, error))
     {
       auto pkg_name = (*self->importer_rs)->pkg_name ();
       return glnx_prefix_error (error, "Importing package '%s'", pkg_name.c_str ());
     }
+  self->stats->elapsed_us = g_get_monotonic_time () - start_time;
 
   auto branch = (*self->importer_rs)->ostree_branch ();
   ostree_repo_transaction_set_ref (self->repo, NULL, branch.c_str (), csum);
@@ -746,3 +1025,10 @@ rpmostree_importer_get_nevra (RpmOstreeImporter *self)
       (RpmOstreePkgNevraFlags)(PKG_NEVRA_FLAGS_NAME | PKG_NEVRA_FLAGS_EPOCH_VERSION_RELEASE
                                | PKG_NEVRA_FLAGS_ARCH));
 }
+
+/* Statistics about reading the package; only meaningful after a successful run. */
+const RpmOstreeUnpackStats *
+rpmostree_importer_get_stats (RpmOstreeImporter *self)
+{
+  return self->stats;
+}
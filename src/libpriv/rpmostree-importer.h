@@ -23,6 +23,8 @@
 #include <ostree.h>
 
 #include "libglnx.h"
+#include "rpmostree-digest-index.h"
+#include "rpmostree-unpacker-core.h"
 #include <libdnf/libdnf.h>
 #include <rpm/rpmlib.h>
 
@@ -41,9 +43,11 @@ G_DEFINE_AUTOPTR_CLEANUP_FUNC (RpmOstreeImporter, g_object_unref)
 
 RpmOstreeImporter *rpmostree_importer_new_take_fd (int *fd, OstreeRepo *repo, DnfPackage *pkg,
                                                    rpmostreecxx::RpmImporterFlags &flags,
-                                                   OstreeSePolicy *sepolicy,
+                                                   OstreeSePolicy *sepolicy, gboolean allow_mmap,
                                                    GCancellable *cancellable, GError **error);
 
+void rpmostree_importer_set_digest_index (RpmOstreeImporter *self, RpmOstreeDigestIndex *index);
+
 gboolean rpmostree_importer_read_metainfo (int fd, rpmostreecxx::RpmImporterFlags &flags,
                                            Header *out_header, gsize *out_cpio_offset,
                                            rpmfi *out_fi, GError **error);
@@ -60,4 +64,6 @@ char *rpmostree_importer_run_async_finish (RpmOstreeImporter *self, GAsyncResult
 
 char *rpmostree_importer_get_nevra (RpmOstreeImporter *self);
 
+const RpmOstreeUnpackStats *rpmostree_importer_get_stats (RpmOstreeImporter *self);
+
 G_END_DECLS
@@ -0,0 +1,188 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Licensed under the GNU Lesser General Public License Version 2.1
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/**
+ * A record of the SELinux label assigned to each path in a pkgcache commit.
+ *
+ * When the policy changes, we can look up every path again under the new
+ * policy and compare against the manifest; only the paths whose label
+ * actually differs need their objects rewritten.  The label strings are
+ * stored once in a table, since a package typically only uses a handful.
+ *
+ * Serialized as (asa(qsyu)): the label table, then for each path in sorted
+ * order (length of the prefix shared with the previous path, the rest of the
+ * path, file type >> 12, index into the table), with G_MAXUINT32 meaning
+ * unlabeled.  Sharing prefixes keeps this to roughly the size of the
+ * basenames.  This is still one entry per path rather than per labeling
+ * decision, since relabeling needs to look every path up again anyway; to
+ * keep the commit metadata reasonable, packages with huge file lists just
+ * don't get a manifest, and are relabeled by walking the whole tree.
+ */
+
+#include "config.h"
+
+#include "rpmostree-label-manifest.h"
+
+#include <string.h>
+#include <sys/stat.h>
+
+#define LABEL_MANIFEST_VARIANT_TYPE "(asa(qsyu))"
+#define LABEL_INDEX_NONE G_MAXUINT32
+/* Upper bound on the serialized size */
+#define LABEL_MANIFEST_MAX_SIZE (4 * 1024 * 1024)
+
+struct RpmOstreeLabelManifest
+{
+  GHashTable *entries; /* path --> RpmOstreeLabelManifestEntry */
+};
+
+RpmOstreeLabelManifest *
+rpmostree_label_manifest_new (void)
+{
+  RpmOstreeLabelManifest *manifest = g_new0 (RpmOstreeLabelManifest, 1);
+  manifest->entries = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  return manifest;
+}
+
+/*
+ * rpmostree_label_manifest_new_from_metadata:
+ * @metadata: Commit metadata
+ *
+ * Returns: (nullable): The manifest stored in @metadata, or %NULL if there
+ * isn't one (e.g. the package was imported by an older version), or it's
+ * malformed.
+ */
+RpmOstreeLabelManifest *
+rpmostree_label_manifest_new_from_metadata (GVariantDict *metadata)
+{
+  g_autoptr (GVariant) v = g_variant_dict_lookup_value (
+      metadata, RPMOSTREE_LABEL_MANIFEST_KEY, G_VARIANT_TYPE (LABEL_MANIFEST_VARIANT_TYPE));
+  if (!v)
+    return NULL;
+
+  g_autofree const char **labels = NULL;
+  g_autoptr (GVariant) entries = NULL;
+  g_variant_get (v, "(^a&s@a(qsyu))", &labels, &entries);
+  const guint n_labels = g_strv_length ((char **)labels);
+
+  g_autoptr (RpmOstreeLabelManifest) manifest = rpmostree_label_manifest_new ();
+  g_autoptr (GString) path = g_string_new ("");
+  const guint n = g_variant_n_children (entries);
+  for (guint i = 0; i < n; i++)
+    {
+      guint16 shared;
+      const char *suffix = NULL;
+      guint8 type;
+      guint32 label_idx;
+      g_variant_get_child (entries, i, "(q&syu)", &shared, &suffix, &type, &label_idx);
+      if (shared > path->len || (label_idx != LABEL_INDEX_NONE && label_idx >= n_labels))
+        return NULL;
+      g_string_truncate (path, shared);
+      g_string_append (path, suffix);
+      rpmostree_label_manifest_add (manifest, path->str, ((guint32)type) << 12,
+                                    label_idx == LABEL_INDEX_NONE ? NULL : labels[label_idx]);
+    }
+
+  return (RpmOstreeLabelManifest *)g_steal_pointer (&manifest);
+}
+
+void
+rpmostree_label_manifest_free (RpmOstreeLabelManifest *manifest)
+{
+  g_clear_pointer (&manifest->entries, g_hash_table_unref);
+  g_free (manifest);
+}
+
+/* Record (or update) the label for @path.  Labels only depend on the file
+ * type, so that's all we keep of @mode. */
+void
+rpmostree_label_manifest_add (RpmOstreeLabelManifest *manifest, const char *path, guint32 mode,
+                              const char *label)
+{
+  RpmOstreeLabelManifestEntry *entry = g_new (RpmOstreeLabelManifestEntry, 1);
+  entry->mode = mode & S_IFMT;
+  entry->label = g_intern_string (label);
+  g_hash_table_replace (manifest->entries, g_strdup (path), entry);
+}
+
+/* Returns: (transfer none): Map of path --> RpmOstreeLabelManifestEntry;
+ * entries may be updated in place. */
+GHashTable *
+rpmostree_label_manifest_get_entries (RpmOstreeLabelManifest *manifest)
+{
+  return manifest->entries;
+}
+
+static int
+compare_strings (gconstpointer a, gconstpointer b)
+{
+  return strcmp (*(const char **)a, *(const char **)b);
+}
+
+/* Returns: (transfer floating) (nullable): Serialized manifest, sorted by
+ * path so that importing the same package twice yields the same commit, or
+ * %NULL if it would be too large to be worth storing. */
+GVariant *
+rpmostree_label_manifest_to_variant (RpmOstreeLabelManifest *manifest)
+{
+  g_autoptr (GPtrArray) paths = g_ptr_array_new ();
+  GLNX_HASH_TABLE_FOREACH (manifest->entries, const char *, path)
+    g_ptr_array_add (paths, (gpointer)path);
+  g_ptr_array_sort (paths, compare_strings);
+
+  /* Labels are interned, so we can index them by pointer */
+  g_autoptr (GHashTable) label_to_idx = g_hash_table_new (NULL, NULL);
+  g_autoptr (GPtrArray) labels = g_ptr_array_new ();
+  g_auto (GVariantBuilder) builder;
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(qsyu)"));
+  /* Rough, but close enough for a bound */
+  gsize size = 0;
+  for (guint i = 0; i < paths->len; i++)
+    {
+      auto path = static_cast<const char *> (paths->pdata[i]);
+      auto entry = static_cast<RpmOstreeLabelManifestEntry *> (
+          g_hash_table_lookup (manifest->entries, path));
+      guint32 label_idx = LABEL_INDEX_NONE;
+      if (entry->label)
+        {
+          gpointer idx;
+          if (g_hash_table_lookup_extended (label_to_idx, entry->label, NULL, &idx))
+            label_idx = GPOINTER_TO_UINT (idx);
+          else
+            {
+              label_idx = labels->len;
+              g_ptr_array_add (labels, (gpointer)entry->label);
+              g_hash_table_insert (label_to_idx, (gpointer)entry->label,
+                                   GUINT_TO_POINTER (label_idx));
+            }
+        }
+      const char *prev = i > 0 ? static_cast<const char *> (paths->pdata[i - 1]) : "";
+      gsize shared = 0;
+      while (prev[shared] && prev[shared] == path[shared] && shared < G_MAXUINT16)
+        shared++;
+      size += strlen (path + shared) + 12;
+      if (size > LABEL_MANIFEST_MAX_SIZE)
+        return NULL;
+      g_variant_builder_add (&builder, "(qsyu)", (guint16)shared, path + shared,
+                             (guint8)(entry->mode >> 12), label_idx);
+    }
+
+  GVariant *labels_v = g_variant_new_strv ((const char *const *)labels->pdata, labels->len);
+  return g_variant_new ("(@as@a(qsyu))", labels_v, g_variant_builder_end (&builder));
+}
@@ -0,0 +1,54 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Licensed under the GNU Lesser General Public License Version 2.1
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#pragma once
+
+#include <ostree.h>
+
+#include "libglnx.h"
+
+G_BEGIN_DECLS
+
+/* Commit metadata key for pkgcache commits */
+#define RPMOSTREE_LABEL_MANIFEST_KEY "rpmostree.selabels"
+
+typedef struct RpmOstreeLabelManifest RpmOstreeLabelManifest;
+
+typedef struct
+{
+  guint32 mode;      /* Only the file type bits */
+  const char *label; /* Interned; NULL if unlabeled */
+} RpmOstreeLabelManifestEntry;
+
+RpmOstreeLabelManifest *rpmostree_label_manifest_new (void);
+
+RpmOstreeLabelManifest *rpmostree_label_manifest_new_from_metadata (GVariantDict *metadata);
+
+void rpmostree_label_manifest_free (RpmOstreeLabelManifest *manifest);
+
+void rpmostree_label_manifest_add (RpmOstreeLabelManifest *manifest, const char *path,
+                                   guint32 mode, const char *label);
+
+GHashTable *rpmostree_label_manifest_get_entries (RpmOstreeLabelManifest *manifest);
+
+GVariant *rpmostree_label_manifest_to_variant (RpmOstreeLabelManifest *manifest);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (RpmOstreeLabelManifest, rpmostree_label_manifest_free)
+
+G_END_DECLS
@@ -42,6 +42,7 @@
 #include <vector>
 
 #include "rpmostree-core.h"
+#include "rpmostree-devino-index.h"
 #include "rpmostree-kernel.h"
 #include "rpmostree-output.h"
 #include "rpmostree-postprocess.h"
@@ -651,9 +652,13 @@ struct CommitThreadData
   OstreeMutableTree *mtree;
   OstreeSePolicy *sepolicy;
   OstreeRepoCommitModifier *commit_modifier;
+  RpmOstreeDevinoIndex *devino_index;
+  GHashTable *written_regfiles; /* Paths already written by write_regfiles_parallel() */
   gboolean success;
   GCancellable *cancellable;
   GError **error;
+  RpmOstreeSELinuxMode selinux;
+  GMutex progress_lock; /* Protects n_processed */
 };
 
 // In unified core mode, we'll see user-mode checkout files.
@@ -686,14 +691,24 @@ extend_ostree_xattrs (GVariantBuilder *builder, GVariant *vbytes)
     }
 }
 
+/* Count @file_info towards the "Committing" progress */
+static void
+add_progress (struct CommitThreadData *tdata, GFileInfo *file_info)
+{
+  if (g_file_info_get_file_type (file_info) == G_FILE_TYPE_DIRECTORY)
+    return;
+  /* May be called from the parallel writer threads */
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&tdata->progress_lock);
+  tdata->n_processed += g_file_info_get_size (file_info);
+  g_atomic_int_set (&tdata->percent, (gint)((100.0 * tdata->n_processed) / tdata->n_bytes));
+}
+
 /* Filters out all xattrs that aren't accepted. */
 static GVariant *
-filter_xattrs_cb (OstreeRepo *repo, const char *relpath, GFileInfo *file_info, gpointer user_data)
+filter_xattrs (int rootfs_fd, const char *relpath)
 {
   g_assert (relpath);
 
-  auto tdata = static_cast<struct CommitThreadData *> (user_data);
-  int rootfs_fd = tdata->rootfs_fd;
   /* If you have a use case for something else, file an issue */
   static const char *accepted_xattrs[] = {
     "security.capability", /* https://lwn.net/Articles/211883/ */
@@ -719,12 +734,6 @@ filter_xattrs_cb (OstreeRepo *repo, const char *relpath, GFileInfo *file_info, g
         g_error ("Reading xattrs on %s: %s", relpath, local_error->message);
     }
 
-  if (g_file_info_get_file_type (file_info) != G_FILE_TYPE_DIRECTORY)
-    {
-      tdata->n_processed += g_file_info_get_size (file_info);
-      g_atomic_int_set (&tdata->percent, (gint)((100.0 * tdata->n_processed) / tdata->n_bytes));
-    }
-
   GVariantBuilder builder;
   g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ayay)"));
 
@@ -773,6 +782,385 @@ filter_xattrs_cb (OstreeRepo *repo, const char *relpath, GFileInfo *file_info, g
   return g_variant_ref_sink (g_variant_builder_end (&builder));
 }
 
+static GVariant *
+filter_xattrs_cb (OstreeRepo *repo, const char *relpath, GFileInfo *file_info, gpointer user_data)
+{
+  auto tdata = static_cast<struct CommitThreadData *> (user_data);
+  add_progress (tdata, file_info);
+  return filter_xattrs (tdata->rootfs_fd, relpath);
+}
+
+/* Shared by the write_regfiles_in_thread() workers */
+typedef struct
+{
+  struct CommitThreadData *tdata;
+  GPtrArray *paths;     /* Regular files, as absolute paths into the rootfs */
+  GPtrArray *checksums; /* Content checksums, in the same order as @paths */
+  guint n_running;
+  gint next;   /* Atomic; index of the next path to write */
+  gint failed; /* Atomic; lets the other workers stop early */
+  GError *error;
+} ParallelCommitData;
+
+static gboolean
+collect_regfiles (int dfd, const char *path, GPtrArray *out_paths, GCancellable *cancellable,
+                  GError **error)
+{
+  g_auto (GLnxDirFdIterator) dfd_iter = {
+    FALSE,
+  };
+  if (!glnx_dirfd_iterator_init_at (dfd, *path ? path + 1 : ".", FALSE, &dfd_iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      struct dirent *dent = NULL;
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&dfd_iter, &dent, cancellable, error))
+        return FALSE;
+      if (!dent)
+        break;
+
+      g_autofree char *subpath = g_strconcat (path, "/", dent->d_name, NULL);
+      if (dent->d_type == DT_DIR)
+        {
+          if (!collect_regfiles (dfd, subpath, out_paths, cancellable, error))
+            return FALSE;
+        }
+      else if (dent->d_type == DT_REG)
+        g_ptr_array_add (out_paths, util::move_nullify (subpath));
+    }
+
+  return TRUE;
+}
+
+/* Compute the xattrs ostree would commit for @path: whatever the xattr callback
+ * accepts, plus the SELinux label from the modifier's policy.  Unlike the
+ * callback, this doesn't count towards the progress.
+ */
+static gboolean
+get_regfile_xattrs (struct CommitThreadData *tdata, const char *path, GFileInfo *file_info,
+                    GVariant **out_xattrs, GCancellable *cancellable, GError **error)
+{
+  g_autoptr (GVariant) xattrs = filter_xattrs (tdata->rootfs_fd, path);
+  if (!tdata->sepolicy)
+    {
+      *out_xattrs = util::move_nullify (xattrs);
+      return TRUE;
+    }
+
+  /* See OSTREE_REPO_COMMIT_MODIFIER_FLAGS_SELINUX_LABEL_V1 */
+  const char *label_path = path;
+  g_autofree char *etc_path = NULL;
+  if (tdata->selinux == RPMOSTREE_SELINUX_MODE_V1
+      && (g_str_equal (path, "/usr/etc") || g_str_has_prefix (path, "/usr/etc/")))
+    label_path = etc_path = g_strconcat ("/etc", path + strlen ("/usr/etc"), NULL);
+
+  g_autofree char *label = NULL;
+  if (!ostree_sepolicy_get_label (tdata->sepolicy, label_path,
+                                  g_file_info_get_attribute_uint32 (file_info, "unix::mode"),
+                                  &label, cancellable, error))
+    return FALSE;
+  /* We always commit with OSTREE_REPO_COMMIT_MODIFIER_FLAGS_ERROR_ON_UNLABELED */
+  if (!label)
+    return glnx_throw (error, "Failed to look up SELinux label for '%s'", path);
+
+  g_autoptr (GVariantBuilder) builder = g_variant_builder_new (G_VARIANT_TYPE ("a(ayay)"));
+  GVariantIter viter;
+  g_variant_iter_init (&viter, xattrs);
+  GVariant *key, *value;
+  while (g_variant_iter_loop (&viter, "(@ay@ay)", &key, &value))
+    {
+      if (!g_str_equal (g_variant_get_bytestring (key), "security.selinux"))
+        g_variant_builder_add (builder, "(@ay@ay)", key, value);
+    }
+  /* Stored labels include the trailing NUL */
+  g_variant_builder_add (builder, "(^ay@ay)", "security.selinux",
+                         g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE, label,
+                                                    strlen (label) + 1, 1));
+  *out_xattrs = g_variant_ref_sink (g_variant_builder_end (builder));
+  return TRUE;
+}
+
+static GFileInfo *
+regfile_info_new (const struct stat *stbuf)
+{
+  GFileInfo *file_info = g_file_info_new ();
+  g_file_info_set_file_type (file_info, G_FILE_TYPE_REGULAR);
+  g_file_info_set_size (file_info, stbuf->st_size);
+  g_file_info_set_attribute_uint32 (file_info, "unix::uid", stbuf->st_uid);
+  g_file_info_set_attribute_uint32 (file_info, "unix::gid", stbuf->st_gid);
+  g_file_info_set_attribute_uint32 (file_info, "unix::mode", stbuf->st_mode);
+  return file_info;
+}
+
+/* Write @path as a content object; it's left in place for consume_rootfs().
+ */
+static gboolean
+write_one_regfile (struct CommitThreadData *tdata, const char *path, char **out_checksum,
+                   GCancellable *cancellable, GError **error)
+{
+  glnx_autofd int fd = -1;
+  if (!glnx_openat_rdonly (tdata->rootfs_fd, path + 1, FALSE, &fd, error))
+    return FALSE;
+  struct stat stbuf;
+  if (!glnx_fstat (fd, &stbuf, error))
+    return FALSE;
+
+  g_autoptr (GFileInfo) file_info = regfile_info_new (&stbuf);
+  add_progress (tdata, file_info);
+  g_autoptr (GVariant) xattrs = NULL;
+  if (!get_regfile_xattrs (tdata, path, file_info, &xattrs, cancellable, error))
+    return FALSE;
+
+  /* If it's a pkgcache file we've committed before, there's no need to read it */
+  g_autofree char *devino_key = NULL;
+  if (tdata->devino_index)
+    {
+      if (!rpmostree_devino_index_make_key (fd, &stbuf, file_info, xattrs, &devino_key, error))
+        return FALSE;
+      g_autofree char *checksum = NULL;
+      if (devino_key
+          && !rpmostree_devino_index_lookup (tdata->devino_index, devino_key, &checksum,
+                                             cancellable, error))
+        return FALSE;
+      if (checksum)
+        {
+          *out_checksum = util::move_nullify (checksum);
+          return TRUE;
+        }
+    }
+
+  g_autoptr (GInputStream) input = g_unix_input_stream_new (fd, FALSE);
+  g_autoptr (GInputStream) content = NULL;
+  guint64 length = 0;
+  if (!ostree_raw_file_to_content_stream (input, file_info, xattrs, &content, &length,
+                                          cancellable, error))
+    return FALSE;
+  g_autofree guchar *csum = NULL;
+  if (!ostree_repo_write_content (tdata->repo, NULL, content, length, &csum, cancellable, error))
+    return FALSE;
+
+  *out_checksum = ostree_checksum_from_bytes (csum);
+  if (devino_key)
+    rpmostree_devino_index_insert (tdata->devino_index, devino_key, *out_checksum);
+  return TRUE;
+}
+
+static gboolean
+write_regfiles_worker (ParallelCommitData *data, GCancellable *cancellable, GError **error)
+{
+  while (!g_atomic_int_get (&data->failed))
+    {
+      const guint i = g_atomic_int_add (&data->next, 1);
+      if (i >= data->paths->len)
+        break;
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        return FALSE;
+
+      auto path = static_cast<const char *> (data->paths->pdata[i]);
+      char *checksum = NULL;
+      if (!write_one_regfile (data->tdata, path, &checksum, cancellable, error))
+        return glnx_prefix_error (error, "Writing %s", path);
+      /* Each index is only ever handed out once */
+      data->checksums->pdata[i] = checksum;
+    }
+  return TRUE;
+}
+
+static void
+write_regfiles_in_thread (GTask *task, gpointer source, gpointer task_data,
+                          GCancellable *cancellable)
+{
+  auto data = static_cast<ParallelCommitData *> (task_data);
+  g_autoptr (GError) local_error = NULL;
+  if (!write_regfiles_worker (data, cancellable, &local_error))
+    {
+      g_atomic_int_set (&data->failed, TRUE);
+      g_task_return_error (task, util::move_nullify (local_error));
+    }
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+static void
+on_write_regfiles_done (GObject *object, GAsyncResult *result, gpointer user_data)
+{
+  auto data = static_cast<ParallelCommitData *> (user_data);
+  g_autoptr (GError) local_error = NULL;
+  if (!g_task_propagate_boolean (G_TASK (result), &local_error) && !data->error)
+    data->error = util::move_nullify (local_error);
+  data->n_running--;
+}
+
+/* ostree_repo_write_dfd_to_mtree() checksums and writes every file on one
+ * thread, which dominates commit time for a large rootfs.  Instead, write all
+ * the regular files here across all CPUs first; the serial walk afterwards
+ * skips them (see skip_written_regfiles_cb()), so it only has to deal with
+ * directories and symlinks.  The xattrs and labels are computed exactly as the
+ * commit modifier would, so the resulting commit is identical.
+ *
+ * Unlike the serial walk, this doesn't consume the files; that's left to
+ * consume_rootfs() once the mtree is complete, so that on error the rootfs
+ * is still intact.
+ */
+static gboolean
+write_regfiles_parallel (struct CommitThreadData *tdata, GPtrArray *paths, GPtrArray *checksums,
+                         GCancellable *cancellable, GError **error)
+{
+  if (!collect_regfiles (tdata->rootfs_fd, "", paths, cancellable, error))
+    return FALSE;
+  g_ptr_array_set_size (checksums, paths->len);
+
+  ParallelCommitData data = {
+    tdata, paths, checksums, 0, 0, FALSE, NULL,
+  };
+  const guint n_workers = MIN (g_get_num_processors (), paths->len);
+  for (guint i = 0; i < n_workers; i++)
+    {
+      g_autoptr (GTask) task = g_task_new (NULL, cancellable, on_write_regfiles_done, &data);
+      g_task_set_task_data (task, &data, NULL);
+      g_task_run_in_thread (task, write_regfiles_in_thread);
+      data.n_running++;
+    }
+  /* Wait for all of them, even on error; they borrow @data.  This also
+   * dispatches the progress updates. */
+  while (data.n_running > 0)
+    g_main_context_iteration (NULL, TRUE);
+
+  if (data.error)
+    {
+      g_propagate_error (error, data.error);
+      return FALSE;
+    }
+  return TRUE;
+}
+
+/* Commit filter for the serial walk, to skip what we already wrote in parallel */
+static OstreeRepoCommitFilterResult
+skip_written_regfiles_cb (OstreeRepo *repo, const char *path, GFileInfo *file_info,
+                          gpointer user_data)
+{
+  auto tdata = static_cast<struct CommitThreadData *> (user_data);
+  if (tdata->written_regfiles && g_hash_table_contains (tdata->written_regfiles, path))
+    return OSTREE_REPO_COMMIT_FILTER_SKIP;
+  return OSTREE_REPO_COMMIT_FILTER_ALLOW;
+}
+
+/* The parallel path commits without OSTREE_REPO_COMMIT_MODIFIER_FLAGS_CONSUME,
+ * since the serial walk would try to remove directories still holding the
+ * files it skipped; seeding the devino index needs the files too.  So once
+ * the mtree is complete, consume the rootfs here.
+ */
+static gboolean
+consume_rootfs (int rootfs_fd, GCancellable *cancellable, GError **error)
+{
+  g_auto (GLnxDirFdIterator) dfd_iter = {
+    FALSE,
+  };
+  if (!glnx_dirfd_iterator_init_at (rootfs_fd, ".", FALSE, &dfd_iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      struct dirent *dent = NULL;
+      if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, cancellable, error))
+        return FALSE;
+      if (!dent)
+        break;
+      if (!glnx_shutil_rm_rf_at (dfd_iter.fd, dent->d_name, cancellable, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Find the directory in @mtree containing the file at absolute @path */
+static gboolean
+walk_mtree_to_parent (OstreeMutableTree *mtree, const char *path, OstreeMutableTree **out_parent,
+                      GError **error)
+{
+  g_autofree char *dirname = g_path_get_dirname (path);
+  g_auto (GStrv) components = g_strsplit (dirname, "/", -1);
+  g_autoptr (GPtrArray) split_path = g_ptr_array_new ();
+  for (char **it = components; it && *it; it++)
+    {
+      if (**it)
+        g_ptr_array_add (split_path, *it);
+    }
+  return ostree_mutable_tree_walk (mtree, split_path, 0, out_parent, error);
+}
+
+/* Add the files written by write_regfiles_parallel() to @mtree, which by now
+ * has all of their parent directories.
+ */
+static gboolean
+add_regfiles_to_mtree (OstreeMutableTree *mtree, GPtrArray *paths, GPtrArray *checksums,
+                       GError **error)
+{
+  for (guint i = 0; i < paths->len; i++)
+    {
+      auto path = static_cast<const char *> (paths->pdata[i]);
+      g_autofree char *basename = g_path_get_basename (path);
+      g_autoptr (OstreeMutableTree) parent = NULL;
+      if (!walk_mtree_to_parent (mtree, path, &parent, error))
+        return glnx_prefix_error (error, "Adding %s", path);
+      if (!ostree_mutable_tree_replace_file (parent, basename,
+                                             static_cast<const char *> (checksums->pdata[i]),
+                                             error))
+        return glnx_prefix_error (error, "Adding %s", path);
+    }
+  return TRUE;
+}
+
+/* The serial walk can use ostree's devino cache, but doesn't tell us what it
+ * found there.  So after it, fill in the devino index from @mtree, so that
+ * the next compose can take the parallel path.  Nothing here is read or
+ * checksummed; it's just the xattrs and labels again.
+ */
+static gboolean
+seed_devino_index (struct CommitThreadData *tdata, GCancellable *cancellable, GError **error)
+{
+  g_autoptr (GPtrArray) paths = g_ptr_array_new_with_free_func (g_free);
+  if (!collect_regfiles (tdata->rootfs_fd, "", paths, cancellable, error))
+    return FALSE;
+
+  for (guint i = 0; i < paths->len; i++)
+    {
+      auto path = static_cast<const char *> (paths->pdata[i]);
+      glnx_autofd int fd = -1;
+      if (!glnx_openat_rdonly (tdata->rootfs_fd, path + 1, FALSE, &fd, error))
+        return FALSE;
+      struct stat stbuf;
+      if (!glnx_fstat (fd, &stbuf, error))
+        return FALSE;
+      /* Not a pkgcache file; don't bother with the xattrs */
+      if (stbuf.st_nlink < 2)
+        continue;
+
+      g_autoptr (GFileInfo) file_info = regfile_info_new (&stbuf);
+      g_autoptr (GVariant) xattrs = NULL;
+      if (!get_regfile_xattrs (tdata, path, file_info, &xattrs, cancellable, error))
+        return FALSE;
+      g_autofree char *devino_key = NULL;
+      if (!rpmostree_devino_index_make_key (fd, &stbuf, file_info, xattrs, &devino_key, error))
+        return FALSE;
+      if (!devino_key)
+        continue;
+
+      g_autofree char *basename = g_path_get_basename (path);
+      g_autoptr (OstreeMutableTree) parent = NULL;
+      g_autofree char *checksum = NULL;
+      g_autoptr (OstreeMutableTree) subdir = NULL;
+      if (!walk_mtree_to_parent (tdata->mtree, path, &parent, error)
+          || !ostree_mutable_tree_lookup (parent, basename, &checksum, &subdir, error))
+        return glnx_prefix_error (error, "Indexing %s", path);
+      if (checksum)
+        rpmostree_devino_index_insert (tdata->devino_index, devino_key, checksum);
+    }
+
+  return TRUE;
+}
+
 static gpointer
 write_dfd_thread (gpointer datap)
 {
@@ -806,7 +1194,8 @@ gboolean
 rpmostree_compose_commit (int rootfs_fd, OstreeRepo *repo, const char *parent_revision,
                           GVariant *src_metadata, GVariant *detached_metadata,
                           const char *gpg_keyid, gboolean container, RpmOstreeSELinuxMode selinux,
-                          OstreeRepoDevInoCache *devino_cache, char **out_new_revision,
+                          OstreeRepoDevInoCache *devino_cache,
+                          RpmOstreeDevinoIndex *devino_index, char **out_new_revision,
                           GCancellable *cancellable, GError **error)
 {
   int label_modifier_flags = 0;
@@ -820,23 +1209,41 @@ rpmostree_compose_commit (int rootfs_fd, OstreeRepo *repo, const char *parent_re
         label_modifier_flags |= OSTREE_REPO_COMMIT_MODIFIER_FLAGS_SELINUX_LABEL_V1;
     }
 
+  /* ostree's devino cache can't be consulted by the parallel writer, but our
+   * own persistent index can.  Until it has something to offer though (the
+   * first compose on this builder, or a filesystem without inode generations),
+   * the serial walk with the devino cache is faster; in the former case we
+   * seed the index from it.
+   */
+  const gboolean parallel
+      = (devino_cache == NULL || (devino_index && rpmostree_devino_index_can_serve (devino_index)))
+        && ostree_repo_get_mode (repo) != OSTREE_REPO_MODE_BARE_USER_ONLY
+        && !g_getenv ("RPMOSTREE_COMPOSE_SERIAL_COMMIT");
+  const gboolean seed_index
+      = !parallel && devino_index && rpmostree_devino_index_is_supported (devino_index);
+  /* Either way, we need the rootfs around after the walk */
+  const gboolean defer_consume = parallel || seed_index;
+
   g_autoptr (OstreeMutableTree) mtree = ostree_mutable_tree_new ();
   /* We may make this configurable if someone complains about including some
    * unlabeled content, but I think the fix for that is to ensure that policy is
    * labeling it.
    *
-   * Also right now we unconditionally use the CONSUME flag, but this will need
-   * to change for the split compose/commit root patches.
+   * Also right now we always consume the rootfs (sometimes only once the mtree
+   * is complete), but this will need to change for the split compose/commit
+   * root patches.
    */
   auto modifier_flags = static_cast<OstreeRepoCommitModifierFlags> (
-      OSTREE_REPO_COMMIT_MODIFIER_FLAGS_ERROR_ON_UNLABELED
-      | OSTREE_REPO_COMMIT_MODIFIER_FLAGS_CONSUME | label_modifier_flags);
+      OSTREE_REPO_COMMIT_MODIFIER_FLAGS_ERROR_ON_UNLABELED | label_modifier_flags);
+  if (!defer_consume)
+    modifier_flags = static_cast<OstreeRepoCommitModifierFlags> (
+        modifier_flags | OSTREE_REPO_COMMIT_MODIFIER_FLAGS_CONSUME);
   /* If changing this, also look at changing rpmostree-unpacker.c */
-  g_autoptr (OstreeRepoCommitModifier) commit_modifier
-      = ostree_repo_commit_modifier_new (modifier_flags, NULL, NULL, NULL);
   struct CommitThreadData tdata = {
     0,
   };
+  g_autoptr (OstreeRepoCommitModifier) commit_modifier = ostree_repo_commit_modifier_new (
+      modifier_flags, parallel ? skip_written_regfiles_cb : NULL, &tdata, NULL);
   ostree_repo_commit_modifier_set_xattr_callback (commit_modifier, filter_xattrs_cb, NULL, &tdata);
 
   if (sepolicy && ostree_sepolicy_get_name (sepolicy) != NULL)
@@ -856,28 +1263,56 @@ rpmostree_compose_commit (int rootfs_fd, OstreeRepo *repo, const char *parent_re
   tdata.sepolicy = sepolicy;
   tdata.commit_modifier = commit_modifier;
   tdata.error = error;
+  tdata.selinux = selinux;
+  tdata.devino_index = devino_index;
+  g_mutex_init (&tdata.progress_lock);
 
-  {
-    g_autoptr (GThread) commit_thread = g_thread_new ("commit", write_dfd_thread, &tdata);
+  g_autoptr (GPtrArray) regfiles = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr (GPtrArray) regfile_checksums = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr (GHashTable) written_regfiles = NULL; /* Borrows from @regfiles */
 
+  {
     tdata.progress = rpmostreecxx::progress_percent_begin ("Committing");
 
     g_autoptr (GSource) progress_src = g_timeout_source_new_seconds (1);
     g_source_set_callback (progress_src, on_progress_timeout, &tdata, NULL);
     g_source_attach (progress_src, NULL);
 
-    while (g_atomic_int_get (&tdata.done) == 0)
-      g_main_context_iteration (NULL, TRUE);
+    tdata.success = !parallel
+                    || write_regfiles_parallel (&tdata, regfiles, regfile_checksums, cancellable,
+                                                error);
+    if (tdata.success)
+      {
+        written_regfiles = g_hash_table_new (g_str_hash, g_str_equal);
+        for (guint i = 0; i < regfiles->len; i++)
+          g_hash_table_add (written_regfiles, regfiles->pdata[i]);
+        tdata.written_regfiles = written_regfiles;
+
+        g_autoptr (GThread) commit_thread = g_thread_new ("commit", write_dfd_thread, &tdata);
+
+        while (g_atomic_int_get (&tdata.done) == 0)
+          g_main_context_iteration (NULL, TRUE);
+
+        g_thread_join (util::move_nullify (commit_thread));
+      }
+    if (tdata.success && seed_index)
+      tdata.success = seed_devino_index (&tdata, cancellable, error);
 
     g_source_destroy (progress_src);
-    g_thread_join (util::move_nullify (commit_thread));
 
     tdata.progress->percent_update (100);
   }
 
+  g_mutex_clear (&tdata.progress_lock);
+
   if (!tdata.success)
     return glnx_prefix_error (error, "While writing rootfs to mtree");
 
+  if (!add_regfiles_to_mtree (mtree, regfiles, regfile_checksums, error))
+    return glnx_prefix_error (error, "While writing rootfs to mtree");
+  if (defer_consume && !consume_rootfs (rootfs_fd, cancellable, error))
+    return glnx_prefix_error (error, "While writing rootfs to mtree");
+
   g_autoptr (GFile) root_tree = NULL;
   if (!ostree_repo_write_mtree (repo, mtree, &root_tree, cancellable, error))
     return glnx_prefix_error (error, "While writing tree");
@@ -21,6 +21,7 @@
 #pragma once
 
 #include "rpmostree-cxxrs.h"
+#include "rpmostree-devino-index.h"
 #include <ostree.h>
 
 G_BEGIN_DECLS
@@ -45,7 +46,8 @@ gboolean rpmostree_compose_commit (int rootfs_dfd, OstreeRepo *repo, const char
                                    GVariant *metadata, GVariant *detached_metadata,
                                    const char *gpg_keyid, gboolean container,
                                    RpmOstreeSELinuxMode selinux,
-                                   OstreeRepoDevInoCache *devino_cache, char **out_new_revision,
+                                   OstreeRepoDevInoCache *devino_cache,
+                                   RpmOstreeDevinoIndex *devino_index, char **out_new_revision,
                                    GCancellable *cancellable, GError **error);
 
 G_END_DECLS
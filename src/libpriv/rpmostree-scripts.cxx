@@ -257,20 +257,19 @@ rpmostree_script_txn_validate (DnfPackage *package, Header hdr, bool use_kernel_
 }
 
 /* Print the output of a script, with each line prefixed with
- * the script identifier (e.g. foo.post: bla bla bla).
+ * the script identifier (e.g. foo.post: bla bla bla).  Takes
+ * ownership of @fd.  If @out is set, append to it instead of printing.
  */
 static gboolean
-dump_buffered_output (const char *prefix, GLnxTmpfile *tmpf, GError **error)
+dump_output_fd (const char *prefix, int fd, GString *out, GError **error)
 {
-  /* The tmpf won't be initialized in the journal case */
-  if (!tmpf->initialized)
-    return TRUE;
-  if (lseek (tmpf->fd, 0, SEEK_SET) < 0)
+  glnx_autofd int owned_fd = fd;
+  if (lseek (owned_fd, 0, SEEK_SET) < 0)
     return glnx_throw_errno_prefix (error, "lseek");
-  g_autoptr (FILE) buf = fdopen (tmpf->fd, "r");
+  g_autoptr (FILE) buf = fdopen (owned_fd, "r");
   if (!buf)
     return glnx_throw_errno_prefix (error, "fdopen");
-  tmpf->fd = -1; /* Ownership of fd was transferred */
+  owned_fd = -1; /* Ownership of fd was transferred */
 
   while (TRUE)
     {
@@ -285,41 +284,63 @@ dump_buffered_output (const char *prefix, GLnxTmpfile *tmpf, GError **error)
           else
             break;
         }
-      printf ("%s: %s", prefix, line);
-      if (bytes_read > 0 && line[bytes_read - 1] != '\n')
-        fputc ('\n', stdout);
+      const char *nl = (bytes_read > 0 && line[bytes_read - 1] != '\n') ? "\n" : "";
+      if (out)
+        g_string_append_printf (out, "%s: %s%s", prefix, line, nl);
+      else
+        printf ("%s: %s%s", prefix, line, nl);
     }
 
   return TRUE;
 }
 
+static gboolean
+dump_buffered_output (const char *prefix, GLnxTmpfile *tmpf, GString *out, GError **error)
+{
+  /* The tmpf won't be initialized in the journal case */
+  if (!tmpf->initialized)
+    return TRUE;
+  return dump_output_fd (prefix, glnx_steal_fd (&tmpf->fd), out, error);
+}
+
 /* Since it doesn't make sense to fatally error if printing output fails, catch
  * any errors there and print.
  */
 static void
-dump_buffered_output_noerr (const char *prefix, GLnxTmpfile *tmpf)
+dump_buffered_output_noerr (const char *prefix, GLnxTmpfile *tmpf, GString *out)
 {
   g_autoptr (GError) local_error = NULL;
-  if (!dump_buffered_output (prefix, tmpf, &local_error))
+  if (!dump_buffered_output (prefix, tmpf, out, &local_error))
     g_printerr ("While writing output: %s\n", local_error->message);
 }
 
-/* Lowest level script handler in this file; create a bwrap instance and run it
- * synchronously.
- */
-gboolean
-rpmostree_run_script_in_bwrap_container (int rootfs_fd, GLnxTmpDir *var_lib_rpm_statedir,
-                                         gboolean enable_fuse, const char *name,
-                                         const char *scriptdesc, const char *interp,
-                                         const char *script, const char *script_arg,
-                                         int provided_stdin_fd, GCancellable *cancellable,
-                                         GError **error)
+static rpmostreecxx::BubblewrapMutability
+default_script_mutability (gboolean enable_fuse)
 {
-  g_assert (name != NULL);
-  g_assert (name[0] != '\0');
+  return enable_fuse ? rpmostreecxx::BubblewrapMutability::RoFiles
+                     : rpmostreecxx::BubblewrapMutability::MutateFreely;
+}
 
-  const char *pkg_script = scriptdesc ? glnx_strjoina (name, ".", scriptdesc + 1) : name;
+/* See above for why we special case glibc. */
+static rpmostreecxx::BubblewrapMutability
+script_get_mutability (const char *pkg_script, gboolean enable_fuse)
+{
+  gboolean is_glibc_locales = strcmp (pkg_script, "glibc-all-langpacks.posttrans") == 0
+                              || strcmp (pkg_script, "glibc-common.post") == 0;
+  if (is_glibc_locales)
+    return rpmostreecxx::BubblewrapMutability::MutateFreely;
+  return default_script_mutability (enable_fuse);
+}
 
+/* Set up a bwrap instance with the environment scripts expect; the caller
+ * adds the child process.
+ */
+static gboolean
+new_script_bwrap (int rootfs_fd, GLnxTmpDir *var_lib_rpm_statedir,
+                  rpmostreecxx::BubblewrapMutability mutability,
+                  std::optional<rust::Box<rpmostreecxx::Bubblewrap>> &out_bwrap,
+                  GCancellable *cancellable, GError **error)
+{
   // A dance just to pass a well-known fd for /dev/null to bwrap as fd 3
   // so that we can use it for --ro-bind-data.
   glnx_autofd int devnull_fd = -1;
@@ -332,14 +353,7 @@ rpmostree_run_script_in_bwrap_container (int rootfs_fd, GLnxTmpDir *var_lib_rpm_
    * var/tmp, so we need to tmpfs mount on top of it. See also
    * https://github.com/projectatomic/bubblewrap/issues/182
    * Similarly for /var/lib/rpm-state.
-   *
-   * See above for why we special case glibc.
    */
-  gboolean is_glibc_locales = strcmp (pkg_script, "glibc-all-langpacks.posttrans") == 0
-                              || strcmp (pkg_script, "glibc-common.post") == 0;
-  rpmostreecxx::BubblewrapMutability mutability
-      = (is_glibc_locales || !enable_fuse) ? rpmostreecxx::BubblewrapMutability::MutateFreely
-                                           : rpmostreecxx::BubblewrapMutability::RoFiles;
   CXX_TRY_VAR (bwrap, rpmostreecxx::bubblewrap_new_with_mutability (rootfs_fd, mutability), error);
   /* Scripts can see a /var with compat links like alternatives */
   CXX_TRY (bwrap->setup_compat_var (), error);
@@ -373,8 +387,6 @@ rpmostree_run_script_in_bwrap_container (int rootfs_fd, GLnxTmpDir *var_lib_rpm_
   if (var_lib_rpm_statedir)
     bwrap->bind_readwrite (var_lib_rpm_statedir->path, "/var/lib/rpm-state");
 
-  gboolean debugging_script = g_strcmp0 (g_getenv ("RPMOSTREE_SCRIPT_DEBUG"), pkg_script) == 0;
-
   const char *bridge_sysusers = g_getenv ("RPMOSTREE_EXP_BRIDGE_SYSUSERS");
   if (bridge_sysusers != NULL)
     bwrap->setenv ("RPMOSTREE_EXP_BRIDGE_SYSUSERS", rust::String (bridge_sysusers));
@@ -385,6 +397,34 @@ rpmostree_run_script_in_bwrap_container (int rootfs_fd, GLnxTmpDir *var_lib_rpm_
    */
   bwrap->setenv ("SYSTEMD_OFFLINE", "1");
 
+  out_bwrap.emplace (std::move (bwrap));
+  return TRUE;
+}
+
+/* Lowest level script handler in this file; create a bwrap instance and run it
+ * synchronously.  Buffered output goes to @out if set.
+ */
+static gboolean
+run_script_in_bwrap_container (int rootfs_fd, GLnxTmpDir *var_lib_rpm_statedir,
+                               gboolean enable_fuse, const char *name, const char *scriptdesc,
+                               const char *interp, const char *script, const char *script_arg,
+                               int provided_stdin_fd, GString *out, GCancellable *cancellable,
+                               GError **error)
+{
+  g_assert (name != NULL);
+  g_assert (name[0] != '\0');
+
+  const char *pkg_script = scriptdesc ? glnx_strjoina (name, ".", scriptdesc + 1) : name;
+
+  std::optional<rust::Box<rpmostreecxx::Bubblewrap>> bwrap_owned;
+  if (!new_script_bwrap (rootfs_fd, var_lib_rpm_statedir,
+                         script_get_mutability (pkg_script, enable_fuse), bwrap_owned,
+                         cancellable, error))
+    return FALSE;
+  auto &bwrap = *bwrap_owned;
+
+  gboolean debugging_script = g_strcmp0 (g_getenv ("RPMOSTREE_SCRIPT_DEBUG"), pkg_script) == 0;
+
   /* FDs that need to be held open until we exec; they're
    * owned by the GSubprocessLauncher instance.
    */
@@ -458,7 +498,7 @@ rpmostree_run_script_in_bwrap_container (int rootfs_fd, GLnxTmpDir *var_lib_rpm_
   g_autoptr (GError) local_error = NULL;
   if (!CXX (bwrap->run (*cancellable), &local_error))
     {
-      dump_buffered_output_noerr (pkg_script, &buffered_output);
+      dump_buffered_output_noerr (pkg_script, &buffered_output, out);
       /* If errors go to the journal, help the user/admin find them there */
       if (rpmostreecxx::running_in_systemd ())
         return glnx_throw (error, "%s; run `journalctl -t '%s'` for more information",
@@ -466,11 +506,430 @@ rpmostree_run_script_in_bwrap_container (int rootfs_fd, GLnxTmpDir *var_lib_rpm_
       else
         return g_propagate_error (error, util::move_nullify (local_error)), FALSE;
     }
-  dump_buffered_output_noerr (pkg_script, &buffered_output);
+  dump_buffered_output_noerr (pkg_script, &buffered_output, out);
 
   return TRUE;
 }
 
+gboolean
+rpmostree_run_script_in_bwrap_container (int rootfs_fd, GLnxTmpDir *var_lib_rpm_statedir,
+                                         gboolean enable_fuse, const char *name,
+                                         const char *scriptdesc, const char *interp,
+                                         const char *script, const char *script_arg,
+                                         int provided_stdin_fd, GCancellable *cancellable,
+                                         GError **error)
+{
+  return run_script_in_bwrap_container (rootfs_fd, var_lib_rpm_statedir, enable_fuse, name,
+                                        scriptdesc, interp, script, script_arg, provided_stdin_fd,
+                                        NULL, cancellable, error);
+}
+
+/* Setting up a container (namespaces, rofiles-fuse mounts, spawning bwrap)
+ * costs far more than most scriptlets themselves.  A script runner is a
+ * container which lives for a whole phase of assemble (e.g. all %post
+ * scripts); inside it a shell loop executes the scripts we hand it one at a
+ * time.
+ *
+ * Requests go through a directory bind mounted read-only at
+ * /run/rpmostree-scripts: for each script we write its interpreter, body,
+ * argument and stdin there, then send the request id down a pipe.  The loop
+ * replies with the id and exit status, and we pick up the output it captured
+ * in a per-request directory under /run/rpmostree-scripts-output.  That one
+ * is writable by the scripts, so we don't follow anything we find there.
+ *
+ * Scripts which need a different container setup (e.g. the glibc locale ones,
+ * or a script being debugged interactively) are still run in a container of
+ * their own.  Note scripts run in the same container share /tmp and /var/tmp.
+ */
+struct RpmOstreeScriptRunner
+{
+  int rootfs_fd;                    /* Borrowed */
+  GLnxTmpDir *var_lib_rpm_statedir; /* Borrowed */
+  gboolean enable_fuse;
+  gboolean unavailable; /* If set, run everything in a container of its own */
+  gboolean log_to_journal;
+  guint n_requests;
+  GString *output; /* Borrowed; see rpmostree_script_runner_set_output() */
+
+  GLnxTmpDir workdir;
+  int requests_dfd; /* Read-only in the container */
+  int output_dfd;   /* Writable by the container */
+  int request_fd;
+  FILE *replies;
+  /* Our copy of the write side of the reply pipe, used to wake us up if the
+   * container exits */
+  int reply_writer_fd;
+
+  std::optional<rust::Box<rpmostreecxx::Bubblewrap>> bwrap;
+  GCancellable *cancellable;
+  GThread *thread;
+  GError *container_error; /* Set by the thread */
+};
+
+static const char script_runner_requests_dir[] = "/run/rpmostree-scripts";
+static const char script_runner_output_dir[] = "/run/rpmostree-scripts-output";
+static const int script_runner_request_fd = 6;
+static const int script_runner_reply_fd = 7;
+
+/* $1 is "1" if stdout and stderr should be captured together */
+static const char script_runner_loop[]
+    = "merge=$1\n"
+      "while read -r id <&6; do\n"
+      "  d=/run/rpmostree-scripts/$id\n"
+      "  o=/run/rpmostree-scripts-output/$id\n"
+      "  read -r interp < \"$d/interp\"\n"
+      "  set -- \"$d/script\"\n"
+      "  if test -f \"$d/arg\"; then read -r arg < \"$d/arg\"; set -- \"$@\" \"$arg\"; fi\n"
+      "  if test \"$merge\" = 1; then\n"
+      "    \"$interp\" \"$@\" < \"$d/stdin\" > \"$o/stdout\" 2>&1 6<&- 7>&-\n"
+      "  else\n"
+      "    \"$interp\" \"$@\" < \"$d/stdin\" > \"$o/stdout\" 2> \"$o/stderr\" 6<&- 7>&-\n"
+      "  fi\n"
+      "  echo \"$id $?\" >&7\n"
+      "done\n";
+
+/*
+ * rpmostree_script_runner_new:
+ * @rootfs_fd: Root; must outlive the runner
+ * @var_lib_rpm_statedir: (nullable): Bound to /var/lib/rpm-state; must outlive the runner
+ * @enable_fuse: Protect the hardlinked content via rofiles-fuse
+ *
+ * The container is only started when the first script is run.
+ */
+RpmOstreeScriptRunner *
+rpmostree_script_runner_new (int rootfs_fd, GLnxTmpDir *var_lib_rpm_statedir,
+                             gboolean enable_fuse)
+{
+  auto runner = new RpmOstreeScriptRunner{};
+  runner->rootfs_fd = rootfs_fd;
+  runner->var_lib_rpm_statedir = var_lib_rpm_statedir;
+  runner->enable_fuse = enable_fuse;
+  runner->requests_dfd = -1;
+  runner->output_dfd = -1;
+  runner->request_fd = -1;
+  runner->reply_writer_fd = -1;
+  runner->cancellable = g_cancellable_new ();
+  return runner;
+}
+
+void
+rpmostree_script_runner_free (RpmOstreeScriptRunner *runner)
+{
+  /* This makes the loop exit, and hence the container */
+  glnx_close_fd (&runner->request_fd);
+  if (runner->thread)
+    (void)g_thread_join (util::move_nullify (runner->thread));
+  if (runner->container_error)
+    g_printerr ("While stopping script container: %s\n", runner->container_error->message);
+  /* Drops the rofiles-fuse mounts */
+  runner->bwrap.reset ();
+  g_clear_pointer (&runner->replies, fclose);
+  glnx_close_fd (&runner->reply_writer_fd);
+  glnx_close_fd (&runner->requests_dfd);
+  glnx_close_fd (&runner->output_dfd);
+  (void)glnx_tmpdir_delete (&runner->workdir, NULL, NULL);
+  g_clear_object (&runner->cancellable);
+  g_clear_error (&runner->container_error);
+  delete runner;
+}
+
+/* Collect the output of scripts in @output rather than printing it, so that the
+ * caller can print it when it sees fit.  Output going to the journal isn't
+ * affected.
+ */
+void
+rpmostree_script_runner_set_output (RpmOstreeScriptRunner *runner, GString *output)
+{
+  runner->output = output;
+}
+
+static gpointer
+script_runner_thread (gpointer data)
+{
+  auto runner = static_cast<RpmOstreeScriptRunner *> (data);
+  g_autoptr (GError) local_error = NULL;
+  if (!CXX ((*runner->bwrap)->run (*runner->cancellable), &local_error))
+    runner->container_error = util::move_nullify (local_error);
+  /* Wake up a pending request, if any */
+  (void)TEMP_FAILURE_RETRY (write (runner->reply_writer_fd, "!\n", 2));
+  return NULL;
+}
+
+static gboolean
+script_runner_ensure_started (RpmOstreeScriptRunner *runner, GCancellable *cancellable,
+                              GError **error)
+{
+  if (runner->thread || runner->unavailable)
+    return TRUE;
+
+  /* We need a shell in the target root to run the loop */
+  if (!glnx_fstatat_allow_noent (runner->rootfs_fd, "usr/bin/sh", NULL, AT_SYMLINK_NOFOLLOW,
+                                 error))
+    return FALSE;
+  if (errno == ENOENT)
+    {
+      runner->unavailable = TRUE;
+      return TRUE;
+    }
+
+  if (!glnx_mkdtempat (AT_FDCWD, "/tmp/rpmostree-scripts.XXXXXX", 0700, &runner->workdir, error))
+    return FALSE;
+  if (!glnx_ensure_dir (runner->workdir.fd, "requests", 0755, error))
+    return FALSE;
+  if (!glnx_opendirat (runner->workdir.fd, "requests", FALSE, &runner->requests_dfd, error))
+    return FALSE;
+  if (!glnx_ensure_dir (runner->workdir.fd, "output", 0755, error))
+    return FALSE;
+  if (!glnx_opendirat (runner->workdir.fd, "output", FALSE, &runner->output_dfd, error))
+    return FALSE;
+
+  int request_pipe[2];
+  if (pipe2 (request_pipe, O_CLOEXEC) < 0)
+    return glnx_throw_errno_prefix (error, "pipe2");
+  glnx_autofd int request_reader = request_pipe[0];
+  runner->request_fd = request_pipe[1];
+  int reply_pipe[2];
+  if (pipe2 (reply_pipe, O_CLOEXEC) < 0)
+    return glnx_throw_errno_prefix (error, "pipe2");
+  glnx_autofd int reply_reader = reply_pipe[0];
+  runner->reply_writer_fd = reply_pipe[1];
+  glnx_autofd int reply_writer_child = fcntl (runner->reply_writer_fd, F_DUPFD_CLOEXEC, 3);
+  if (reply_writer_child < 0)
+    return glnx_throw_errno_prefix (error, "fcntl");
+  runner->replies = fdopen (reply_reader, "r");
+  if (!runner->replies)
+    return glnx_throw_errno_prefix (error, "fdopen");
+  reply_reader = -1; /* Transferred */
+
+  if (!new_script_bwrap (runner->rootfs_fd, runner->var_lib_rpm_statedir,
+                         default_script_mutability (runner->enable_fuse), runner->bwrap,
+                         cancellable, error))
+    return FALSE;
+  auto &bwrap = *runner->bwrap;
+  g_autofree char *requests_path = g_build_filename (runner->workdir.path, "requests", NULL);
+  g_autofree char *output_path = g_build_filename (runner->workdir.path, "output", NULL);
+  bwrap->bind_read (requests_path, script_runner_requests_dir);
+  bwrap->bind_readwrite (output_path, script_runner_output_dir);
+  bwrap->take_fd (glnx_steal_fd (&request_reader), script_runner_request_fd);
+  bwrap->take_fd (glnx_steal_fd (&reply_writer_child), script_runner_reply_fd);
+
+  /* See the comment in rpmostree_run_script_in_bwrap_container() */
+  runner->log_to_journal = rpmostreecxx::running_in_systemd ();
+  bwrap->append_child_arg ("/usr/bin/sh");
+  bwrap->append_child_arg ("-c");
+  bwrap->append_child_arg (script_runner_loop);
+  bwrap->append_child_arg ("rpm-ostree-scripts");
+  bwrap->append_child_arg (runner->log_to_journal ? "0" : "1");
+
+  runner->thread = g_thread_new ("scripts", script_runner_thread, runner);
+  return TRUE;
+}
+
+/* Write a file in a request directory */
+static gboolean
+script_runner_write_file (int dfd, const char *name, const char *content, GCancellable *cancellable,
+                          GError **error)
+{
+  return glnx_file_replace_contents_at (dfd, name, (const guint8 *)content, strlen (content),
+                                        GLNX_FILE_REPLACE_NODATASYNC, cancellable, error);
+}
+
+/* Make a fresh directory for a request in @parent_dfd; it must not exist yet,
+ * since the container may have been able to put it there. */
+static gboolean
+script_runner_mkdir (int parent_dfd, const char *reqid, int *out_dfd, GError **error)
+{
+  if (mkdirat (parent_dfd, reqid, 0755) < 0)
+    return glnx_throw_errno_prefix (error, "mkdirat(%s)", reqid);
+  *out_dfd = openat (parent_dfd, reqid, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (*out_dfd < 0)
+    return glnx_throw_errno_prefix (error, "openat(%s)", reqid);
+  return TRUE;
+}
+
+/* Open a captured output stream; the scripts could have replaced it with
+ * anything, so only accept a regular file. */
+static gboolean
+script_runner_open_output (int dfd, const char *name, int *out_fd, struct stat *out_stbuf,
+                           GError **error)
+{
+  glnx_autofd int fd = openat (dfd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0)
+    return glnx_throw_errno_prefix (error, "openat(%s)", name);
+  if (!glnx_fstat (fd, out_stbuf, error))
+    return FALSE;
+  if (!S_ISREG (out_stbuf->st_mode))
+    return glnx_throw (error, "Script output %s is not a regular file", name);
+  *out_fd = glnx_steal_fd (&fd);
+  return TRUE;
+}
+
+/* Copy a captured output stream to the journal */
+static gboolean
+script_runner_forward_output (int dfd, const char *name, const char *id, int priority,
+                              GError **error)
+{
+  glnx_autofd int fd = -1;
+  struct stat stbuf;
+  if (!script_runner_open_output (dfd, name, &fd, &stbuf, error))
+    return FALSE;
+  if (stbuf.st_size == 0)
+    return TRUE;
+  glnx_autofd int journal_fd = sd_journal_stream_fd (id, priority, 0);
+  if (journal_fd < 0)
+    return glnx_throw_errno_prefix (error, "sd_journal_stream_fd");
+  if (glnx_regfile_copy_bytes (fd, journal_fd, (off_t)-1) < 0)
+    return glnx_throw_errno_prefix (error, "Copying output to journal");
+  return TRUE;
+}
+
+static gboolean
+script_runner_dump_output (RpmOstreeScriptRunner *runner, int dfd, const char *pkg_script,
+                           const char *id, GError **error)
+{
+  if (runner->log_to_journal)
+    {
+      if (!script_runner_forward_output (dfd, "stdout", id, LOG_INFO, error))
+        return FALSE;
+      return script_runner_forward_output (dfd, "stderr", id, LOG_ERR, error);
+    }
+
+  glnx_autofd int fd = -1;
+  struct stat stbuf;
+  if (!script_runner_open_output (dfd, "stdout", &fd, &stbuf, error))
+    return FALSE;
+  return dump_output_fd (pkg_script, glnx_steal_fd (&fd), runner->output, error);
+}
+
+static void
+on_script_cancelled (GCancellable *cancellable, gpointer user_data)
+{
+  g_cancellable_cancel (G_CANCELLABLE (user_data));
+}
+
+/* Hand a script to the container and wait for it to finish */
+static gboolean
+script_runner_exec (RpmOstreeScriptRunner *runner, const char *pkg_script, const char *interp,
+                    const char *script, const char *script_arg, int stdin_fd,
+                    GCancellable *cancellable, GError **error)
+{
+  const char *id = glnx_strjoina ("rpm-ostree(", pkg_script, ")");
+  g_autofree char *reqid = g_strdup_printf ("%u", runner->n_requests++);
+  glnx_autofd int dfd = -1;
+  if (!script_runner_mkdir (runner->requests_dfd, reqid, &dfd, error))
+    return FALSE;
+  glnx_autofd int output_dfd = -1;
+  if (!script_runner_mkdir (runner->output_dfd, reqid, &output_dfd, error))
+    return FALSE;
+
+  g_autofree char *interp_line = g_strconcat (interp, "\n", NULL);
+  if (!script_runner_write_file (dfd, "interp", interp_line, cancellable, error))
+    return FALSE;
+  if (!script_runner_write_file (dfd, "script", script, cancellable, error))
+    return FALSE;
+  if (script_arg != nullptr)
+    {
+      g_autofree char *arg_line = g_strconcat (script_arg, "\n", NULL);
+      if (!script_runner_write_file (dfd, "arg", arg_line, cancellable, error))
+        return FALSE;
+    }
+  {
+    glnx_autofd int stdin_copy_fd = openat (dfd, "stdin", O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (stdin_copy_fd < 0)
+      return glnx_throw_errno_prefix (error, "openat(stdin)");
+    if (stdin_fd != -1 && glnx_regfile_copy_bytes (stdin_fd, stdin_copy_fd, (off_t)-1) < 0)
+      return glnx_throw_errno_prefix (error, "Copying stdin");
+  }
+
+  g_autofree char *request = g_strconcat (reqid, "\n", NULL);
+  if (glnx_loop_write (runner->request_fd, request, strlen (request)) < 0)
+    return glnx_throw_errno_prefix (error, "Sending script request");
+
+  gulong cancel_id = 0;
+  if (cancellable)
+    cancel_id = g_cancellable_connect (cancellable, G_CALLBACK (on_script_cancelled),
+                                       runner->cancellable, NULL);
+  g_autofree char *reply = NULL;
+  size_t reply_len = 0;
+  errno = 0;
+  ssize_t bytes_read = getline (&reply, &reply_len, runner->replies);
+  int saved_errno = errno;
+  if (cancellable)
+    g_cancellable_disconnect (cancellable, cancel_id);
+
+  if (bytes_read < 0 || reply[0] == '!')
+    {
+      /* The container went away; stop using it */
+      if (runner->thread)
+        (void)g_thread_join (util::move_nullify (runner->thread));
+      runner->unavailable = TRUE;
+      if (runner->container_error)
+        return g_propagate_error (error, util::move_nullify (runner->container_error)), FALSE;
+      if (bytes_read < 0 && saved_errno != 0)
+        return glnx_throw (error, "Reading script result: %s", g_strerror (saved_errno));
+      return glnx_throw (error, "Script container exited unexpectedly");
+    }
+
+  const size_t reqid_len = strlen (reqid);
+  if (strncmp (reply, reqid, reqid_len) != 0 || reply[reqid_len] != ' ')
+    return glnx_throw (error, "Invalid script result: %s", reply);
+  int estatus = g_ascii_strtoll (reply + reqid_len + 1, NULL, 10);
+
+  g_autoptr (GError) output_error = NULL;
+  if (!script_runner_dump_output (runner, output_dfd, pkg_script, id, &output_error))
+    g_printerr ("While writing output: %s\n", output_error->message);
+  if (!glnx_shutil_rm_rf_at (runner->requests_dfd, reqid, cancellable, error))
+    return FALSE;
+  if (!glnx_shutil_rm_rf_at (runner->output_dfd, reqid, cancellable, error))
+    return FALSE;
+
+  if (estatus != 0)
+    {
+      /* Match the error a script in its own container would give */
+      if (runner->log_to_journal)
+        return glnx_throw (error,
+                           "bwrap(%s): Child process exited with code %d; run `journalctl -t "
+                           "'%s'` for more information",
+                           interp, estatus, id);
+      return glnx_throw (error, "bwrap(%s): Child process exited with code %d", interp, estatus);
+    }
+
+  return TRUE;
+}
+
+/* Run a script via @runner, or in a container of its own if it needs one; see
+ * rpmostree_run_script_in_bwrap_container() for the arguments.
+ */
+gboolean
+rpmostree_script_runner_run (RpmOstreeScriptRunner *runner, const char *name,
+                             const char *scriptdesc, const char *interp, const char *script,
+                             const char *script_arg, int stdin_fd, GCancellable *cancellable,
+                             GError **error)
+{
+  g_assert (name != NULL);
+  g_assert (name[0] != '\0');
+
+  const char *pkg_script = scriptdesc ? glnx_strjoina (name, ".", scriptdesc + 1) : name;
+  gboolean debugging_script = g_strcmp0 (g_getenv ("RPMOSTREE_SCRIPT_DEBUG"), pkg_script) == 0;
+  gboolean needs_own_container
+      = debugging_script || stdin_fd == STDIN_FILENO
+        || script_get_mutability (pkg_script, runner->enable_fuse)
+               != default_script_mutability (runner->enable_fuse);
+
+  if (!needs_own_container)
+    {
+      if (!script_runner_ensure_started (runner, cancellable, error))
+        return FALSE;
+      if (!runner->unavailable)
+        return script_runner_exec (runner, pkg_script, interp, script, script_arg, stdin_fd,
+                                   cancellable, error);
+    }
+
+  return run_script_in_bwrap_container (runner->rootfs_fd, runner->var_lib_rpm_statedir,
+                                        runner->enable_fuse, name, scriptdesc, interp, script,
+                                        script_arg, stdin_fd, runner->output, cancellable, error);
+}
+
 /* Check for a "magic comment" that signifies this lua script
  * should be skipped by us. For more, see docs/architecture-core.md
  */
@@ -491,15 +950,42 @@ lua_script_has_skip (const char *buf)
   return FALSE;
 }
 
-/* Medium level script entrypoint; we already validated it exists and isn't
- * ignored. Here we mostly compute arguments/input, then proceed into the lower
- * level bwrap execution.
+/* A script we've decided to run, with everything needed to do so resolved up
+ * front.  Looking at the DnfPackage isn't thread-safe (libsolv), so this is
+ * what gets handed to threads running scripts in parallel.
+ */
+struct RpmOstreePreparedScript
+{
+  const KnownRpmScriptKind *rpmscript;
+  char *pkg_name;
+  char *interp;      /* NULL if the script is suppressed */
+  char *script;
+  const char *script_arg;
+};
+
+void
+rpmostree_prepared_script_free (RpmOstreePreparedScript *prepared)
+{
+  if (!prepared)
+    return;
+  g_free (prepared->pkg_name);
+  g_free (prepared->interp);
+  g_free (prepared->script);
+  g_free (prepared);
+}
+
+/* Medium level script preparation; we already validated it exists and isn't
+ * ignored. Here we mostly compute arguments/input, which are then used for
+ * the lower level bwrap execution.
  */
 static gboolean
-impl_run_rpm_script (const KnownRpmScriptKind *rpmscript, DnfPackage *pkg, Header hdr,
-                     int rootfs_fd, GLnxTmpDir *var_lib_rpm_statedir, gboolean enable_fuse,
-                     GCancellable *cancellable, GError **error)
+impl_prepare_rpm_script (const KnownRpmScriptKind *rpmscript, DnfPackage *pkg, Header hdr,
+                         RpmOstreePreparedScript **out_prepared, GError **error)
 {
+  g_autoptr (RpmOstreePreparedScript) prepared = g_new0 (RpmOstreePreparedScript, 1);
+  prepared->rpmscript = rpmscript;
+  prepared->pkg_name = g_strdup (dnf_package_get_name (pkg));
+
   struct rpmtd_s td;
   g_autofree char **args = NULL;
   if (headerGet (hdr, rpmscript->progtag, &td, (HEADERGET_ALLOC | HEADERGET_ARGV)))
@@ -508,13 +994,14 @@ impl_run_rpm_script (const KnownRpmScriptKind *rpmscript, DnfPackage *pkg, Heade
   const rpmFlags flags = headerGetNumber (hdr, rpmscript->flagtag);
   const char *script = headerGetString (hdr, rpmscript->tag);
   const char *interp = (args && args[0]) ? args[0] : "/bin/sh";
-  const char *pkg_scriptid = glnx_strjoina (dnf_package_get_name (pkg), ".", rpmscript->desc + 1);
+  const char *pkg_scriptid = glnx_strjoina (prepared->pkg_name, ".", rpmscript->desc + 1);
   gboolean expand = (flags & RPMSCRIPT_FLAG_EXPAND) > 0;
   if (g_str_equal (interp, lua_builtin))
     {
       if (lua_script_has_skip (script))
         {
-          g_debug ("Skipping package %s script %%%s", dnf_package_get_name (pkg), rpmscript->desc);
+          g_debug ("Skipping package %s script %%%s", prepared->pkg_name, rpmscript->desc);
+          *out_prepared = util::move_nullify (prepared);
           return TRUE;
         }
       /* This is a lua script; look for a built-in override/replacement */
@@ -532,8 +1019,7 @@ impl_run_rpm_script (const KnownRpmScriptKind *rpmscript, DnfPackage *pkg, Heade
       if (!found_replacement)
         {
           /* No override found, throw an error and return */
-          g_assert (
-              !fail_if_interp_is_lua (interp, dnf_package_get_name (pkg), rpmscript->desc, error));
+          g_assert (!fail_if_interp_is_lua (interp, prepared->pkg_name, rpmscript->desc, error));
           return FALSE;
         }
 
@@ -553,20 +1039,20 @@ impl_run_rpm_script (const KnownRpmScriptKind *rpmscript, DnfPackage *pkg, Heade
             continue;
           /* Is this completely suppressing the script?  If so, we're done */
           if (!repl->interp)
-            return TRUE;
+            {
+              *out_prepared = util::move_nullify (prepared);
+              return TRUE;
+            }
           interp = repl->interp;
           script = repl->replacement;
           break;
         }
     }
-  g_autofree char *script_owned = NULL;
   g_assert (script);
-  if (expand)
-    script = script_owned = rpmExpand (script, NULL);
-  (void)script_owned; /* Pacify static analysis */
+  prepared->interp = g_strdup (interp);
+  prepared->script = expand ? rpmExpand (script, NULL) : g_strdup (script);
 
   /* http://ftp.rpm.org/max-rpm/s1-rpm-inside-scripts.html#S2-RPM-INSIDE-ERASE-TIME-SCRIPTS */
-  const char *script_arg = NULL;
   switch (dnf_package_get_action (pkg))
     {
       /* XXX: we're not running *un scripts for removals yet, though it'd look like:
@@ -576,13 +1062,13 @@ impl_run_rpm_script (const KnownRpmScriptKind *rpmscript, DnfPackage *pkg, Heade
          break;
       */
     case DNF_STATE_ACTION_INSTALL:
-      script_arg = "1";
+      prepared->script_arg = "1";
       break;
     case DNF_STATE_ACTION_UPDATE:
-      script_arg = "2";
+      prepared->script_arg = "2";
       break;
     case DNF_STATE_ACTION_DOWNGRADE:
-      script_arg = "2";
+      prepared->script_arg = "2";
       break;
     default:
       /* we shouldn't have been asked to perform for any other kind of action */
@@ -590,51 +1076,82 @@ impl_run_rpm_script (const KnownRpmScriptKind *rpmscript, DnfPackage *pkg, Heade
       break;
     }
 
-  guint64 start_time_ms = g_get_monotonic_time () / 1000;
-  if (!rpmostree_run_script_in_bwrap_container (rootfs_fd, var_lib_rpm_statedir, enable_fuse,
-                                                dnf_package_get_name (pkg), rpmscript->desc, interp,
-                                                script, script_arg, -1, cancellable, error))
-    return glnx_prefix_error (error, "Running %s for %s", rpmscript->desc,
-                              dnf_package_get_name (pkg));
-  guint64 end_time_ms = g_get_monotonic_time () / 1000;
-  guint64 elapsed_ms = end_time_ms - start_time_ms;
-
-  sd_journal_send (
-      "MESSAGE_ID=" SD_ID128_FORMAT_STR, SD_ID128_FORMAT_VAL (RPMOSTREE_MESSAGE_PREPOST),
-      "MESSAGE=Executed %s for %s in %" G_GUINT64_FORMAT " ms", rpmscript->desc,
-      dnf_package_get_name (pkg), elapsed_ms, "SCRIPT_TYPE=%s", rpmscript->desc, "PKG=%s",
-      dnf_package_get_name (pkg), "EXEC_TIME_MS=%" G_GUINT64_FORMAT, elapsed_ms, NULL);
-
+  *out_prepared = util::move_nullify (prepared);
   return TRUE;
 }
 
-/* High level script entrypoint; check a package to see whether a script exists,
- * execute it if it exists (and it's not ignored).
+/*
+ * rpmostree_script_prepare:
+ * @out_prepared: (out) (nullable): The script to run, or %NULL if none
+ *
+ * Check a package to see whether a script exists and isn't ignored, and if so
+ * work out what exactly to run.  This must be called from the thread owning
+ * the package's sack; the result can be run from any thread with
+ * rpmostree_prepared_script_run().
  */
-static gboolean
-run_script (const KnownRpmScriptKind *rpmscript, DnfPackage *pkg, Header hdr, int rootfs_fd,
-            GLnxTmpDir *var_lib_rpm_statedir, gboolean enable_fuse, gboolean use_kernel_install,
-            gboolean *out_did_run, GCancellable *cancellable, GError **error)
+gboolean
+rpmostree_script_prepare (DnfPackage *pkg, Header hdr, RpmOstreeScriptKind kind,
+                          gboolean use_kernel_install, RpmOstreePreparedScript **out_prepared,
+                          GError **error)
 {
-  rpmTagVal tagval = rpmscript->tag;
-  rpmTagVal progtagval = rpmscript->progtag;
+  *out_prepared = NULL;
 
-  *out_did_run = FALSE;
+  const KnownRpmScriptKind *rpmscript;
+  switch (kind)
+    {
+    case RPMOSTREE_SCRIPT_PREIN:
+      rpmscript = &pre_script;
+      break;
+    case RPMOSTREE_SCRIPT_POSTIN:
+      rpmscript = &post_script;
+      break;
+    case RPMOSTREE_SCRIPT_POSTTRANS:
+      rpmscript = &posttrans_script;
+      break;
+    default:
+      g_assert_not_reached ();
+    }
 
-  if (!(headerIsEntry (hdr, tagval) || headerIsEntry (hdr, progtagval)))
+  if (!(headerIsEntry (hdr, rpmscript->tag) || headerIsEntry (hdr, rpmscript->progtag)))
     return TRUE;
 
-  const char *script = headerGetString (hdr, tagval);
+  const char *script = headerGetString (hdr, rpmscript->tag);
   if (!script)
     return TRUE;
 
-  const char *desc = rpmscript->desc;
-  if (rpmostreecxx::script_is_ignored (dnf_package_get_name (pkg), desc, use_kernel_install))
+  if (rpmostreecxx::script_is_ignored (dnf_package_get_name (pkg), rpmscript->desc,
+                                       use_kernel_install))
     return TRUE; /* Note early return */
 
-  *out_did_run = TRUE;
-  return impl_run_rpm_script (rpmscript, pkg, hdr, rootfs_fd, var_lib_rpm_statedir, enable_fuse,
-                              cancellable, error);
+  return impl_prepare_rpm_script (rpmscript, pkg, hdr, out_prepared, error);
+}
+
+/* Run a script from rpmostree_script_prepare(); safe to call from any thread,
+ * with one @runner per thread. */
+gboolean
+rpmostree_prepared_script_run (RpmOstreePreparedScript *prepared, RpmOstreeScriptRunner *runner,
+                               GCancellable *cancellable, GError **error)
+{
+  /* Suppressed by a replacement */
+  if (!prepared->interp)
+    return TRUE;
+
+  const char *pkg_name = prepared->pkg_name;
+  const char *desc = prepared->rpmscript->desc;
+  guint64 start_time_ms = g_get_monotonic_time () / 1000;
+  if (!rpmostree_script_runner_run (runner, pkg_name, desc, prepared->interp, prepared->script,
+                                    prepared->script_arg, -1, cancellable, error))
+    return glnx_prefix_error (error, "Running %s for %s", desc, pkg_name);
+  guint64 end_time_ms = g_get_monotonic_time () / 1000;
+  guint64 elapsed_ms = end_time_ms - start_time_ms;
+
+  sd_journal_send ("MESSAGE_ID=" SD_ID128_FORMAT_STR,
+                   SD_ID128_FORMAT_VAL (RPMOSTREE_MESSAGE_PREPOST),
+                   "MESSAGE=Executed %s for %s in %" G_GUINT64_FORMAT " ms", desc, pkg_name,
+                   elapsed_ms, "SCRIPT_TYPE=%s", desc, "PKG=%s", pkg_name,
+                   "EXEC_TIME_MS=%" G_GUINT64_FORMAT, elapsed_ms, NULL);
+
+  return TRUE;
 }
 
 static gboolean
@@ -647,6 +1164,16 @@ write_filename (FILE *f, GString *prefix, GError **error)
   return TRUE;
 }
 
+static gboolean
+write_path (FILE *f, const char *path, GError **error)
+{
+  if (fputs_unlocked (path, f) == EOF)
+    return glnx_throw_errno_prefix (error, "fputs");
+  if (fputc_unlocked ('\n', f) == EOF)
+    return glnx_throw_errno_prefix (error, "fputc");
+  return TRUE;
+}
+
 /* Used for %transfiletriggerin - basically an implementation of `find -type f` that
  * writes the filenames to a tmpfile.
  */
@@ -708,13 +1235,183 @@ write_subdir (int dfd, const char *path, GString *prefix, FILE *f, guint *inout_
   return TRUE;
 }
 
-/* Given file trigger @pattern (really a subdirectory), traverse the
- * filesystem @rootfs_fd and write all matches as file names to @f.  Used
- * for %transfiletriggerin.
+/* An index of everything under /usr in the target root, so that we only need
+ * to walk it once rather than once per %transfiletriggerin pattern.  Paths are
+ * kept sorted, so everything under a given directory is a contiguous range.
+ */
+struct RpmOstreeFileIndex
+{
+  int rootfs_fd; /* Borrowed */
+  gboolean loaded;
+  GStringChunk *strings;
+  GArray *entries; /* FileIndexEntry */
+};
+
+typedef struct
+{
+  const char *path; /* Absolute */
+  guint8 d_type;
+} FileIndexEntry;
+
+/*
+ * rpmostree_file_index_new:
+ * @rootfs_fd: Root; must outlive the index
+ *
+ * The index is populated on first use, and isn't updated afterwards.  This
+ * means files created by scripts run in the meantime (e.g. caches generated
+ * by other triggers) won't be matched, which is closer to librpm's semantics
+ * anyway: it matches against the files of the packages in the transaction.
  */
+RpmOstreeFileIndex *
+rpmostree_file_index_new (int rootfs_fd)
+{
+  RpmOstreeFileIndex *index = g_new0 (RpmOstreeFileIndex, 1);
+  index->rootfs_fd = rootfs_fd;
+  index->strings = g_string_chunk_new (64 * 1024);
+  index->entries = g_array_new (FALSE, FALSE, sizeof (FileIndexEntry));
+  return index;
+}
+
+void
+rpmostree_file_index_free (RpmOstreeFileIndex *index)
+{
+  g_clear_pointer (&index->strings, g_string_chunk_free);
+  g_clear_pointer (&index->entries, g_array_unref);
+  g_free (index);
+}
+
 static gboolean
-find_and_write_matching_files (int rootfs_fd, const char *pattern, FILE *f, guint *out_n_matches,
-                               GCancellable *cancellable, GError **error)
+file_index_add_subdir (RpmOstreeFileIndex *index, int dfd, const char *name, GString *prefix,
+                       GCancellable *cancellable, GError **error)
+{
+  glnx_autofd int target_dfd = glnx_opendirat_with_errno (dfd, name, FALSE);
+  if (target_dfd < 0)
+    {
+      if (errno == ENOENT)
+        return TRUE;
+      return glnx_throw_errno_prefix (error, "opendirat(%s)", prefix->str);
+    }
+  g_auto (GLnxDirFdIterator) dfd_iter = {
+    0,
+  };
+  if (!glnx_dirfd_iterator_init_take_fd (&target_dfd, &dfd_iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&dfd_iter, &dent, cancellable, error))
+        return FALSE;
+      if (dent == NULL)
+        break;
+
+      const size_t origlen = prefix->len;
+      g_string_append_c (prefix, '/');
+      g_string_append (prefix, dent->d_name);
+      FileIndexEntry entry = { g_string_chunk_insert_len (index->strings, prefix->str, prefix->len),
+                               dent->d_type };
+      g_array_append_val (index->entries, entry);
+      if (dent->d_type == DT_DIR)
+        {
+          if (!file_index_add_subdir (index, dfd_iter.fd, dent->d_name, prefix, cancellable,
+                                      error))
+            return FALSE;
+        }
+      g_string_truncate (prefix, origlen);
+    }
+
+  return TRUE;
+}
+
+static int
+compare_file_index_entries (gconstpointer a, gconstpointer b)
+{
+  return strcmp (((const FileIndexEntry *)a)->path, ((const FileIndexEntry *)b)->path);
+}
+
+static gboolean
+file_index_ensure_loaded (RpmOstreeFileIndex *index, GCancellable *cancellable, GError **error)
+{
+  if (index->loaded)
+    return TRUE;
+
+  GLNX_AUTO_PREFIX_ERROR ("Indexing /usr", error);
+  /* We only support patterns under /usr, see find_and_write_matching_files() */
+  g_autoptr (GString) prefix = g_string_new ("/usr");
+  FileIndexEntry root = { "/usr", DT_DIR };
+  g_array_append_val (index->entries, root);
+  if (!file_index_add_subdir (index, index->rootfs_fd, "usr", prefix, cancellable, error))
+    return FALSE;
+  g_array_sort (index->entries, compare_file_index_entries);
+  index->loaded = TRUE;
+  return TRUE;
+}
+
+/* Returns the position of the first entry >= @path */
+static guint
+file_index_lower_bound (RpmOstreeFileIndex *index, const char *path)
+{
+  guint lo = 0;
+  guint hi = index->entries->len;
+  while (lo < hi)
+    {
+      const guint mid = lo + (hi - lo) / 2;
+      if (strcmp (g_array_index (index->entries, FileIndexEntry, mid).path, path) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  return lo;
+}
+
+/* Write all non-directories under @path (or @path itself if it's a file) to
+ * @f.  Sets @out_handled to %FALSE if the index can't answer this, i.e. @path
+ * doesn't exist as is, or is a symlink which we'd need to follow. */
+static gboolean
+file_index_write_matching (RpmOstreeFileIndex *index, const char *path, FILE *f,
+                           guint *inout_n_matched, gboolean *out_handled, GError **error)
+{
+  *out_handled = FALSE;
+  const guint pos = file_index_lower_bound (index, path);
+  if (pos == index->entries->len)
+    return TRUE;
+  const FileIndexEntry *entry = &g_array_index (index->entries, FileIndexEntry, pos);
+  if (!g_str_equal (entry->path, path) || entry->d_type == DT_LNK)
+    return TRUE;
+
+  *out_handled = TRUE;
+  if (entry->d_type != DT_DIR)
+    {
+      if (!write_path (f, entry->path, error))
+        return FALSE;
+      (*inout_n_matched)++;
+      return TRUE;
+    }
+
+  const char *dir_prefix = glnx_strjoina (path, "/");
+  for (guint i = file_index_lower_bound (index, dir_prefix); i < index->entries->len; i++)
+    {
+      entry = &g_array_index (index->entries, FileIndexEntry, i);
+      if (!g_str_has_prefix (entry->path, dir_prefix))
+        break;
+      if (entry->d_type == DT_DIR)
+        continue;
+      if (!write_path (f, entry->path, error))
+        return FALSE;
+      (*inout_n_matched)++;
+    }
+
+  return TRUE;
+}
+
+/* Given file trigger @pattern (really a subdirectory), write all matches as
+ * file names to @f, using @index if possible and otherwise traversing the
+ * filesystem @rootfs_fd.  Used for %transfiletriggerin.
+ */
+static gboolean
+find_and_write_matching_files (int rootfs_fd, RpmOstreeFileIndex *index, const char *pattern,
+                               FILE *f, guint *out_n_matches, GCancellable *cancellable,
+                               GError **error)
 {
   GLNX_AUTO_PREFIX_ERROR ("Finding matches", error);
 
@@ -733,56 +1430,91 @@ find_and_write_matching_files (int rootfs_fd, const char *pattern, FILE *f, guin
     g_string_truncate (buf, buf->len - 1);
 
   guint n_pattern_matches = 0;
-  if (!write_subdir (rootfs_fd, pattern, buf, f, &n_pattern_matches, cancellable, error))
+  gboolean handled = FALSE;
+  if (index)
+    {
+      if (!file_index_ensure_loaded (index, cancellable, error))
+        return FALSE;
+      if (!file_index_write_matching (index, buf->str, f, &n_pattern_matches, &handled, error))
+        return glnx_prefix_error (error, "pattern '%s'", pattern);
+    }
+  if (!handled
+      && !write_subdir (rootfs_fd, pattern, buf, f, &n_pattern_matches, cancellable, error))
     return glnx_prefix_error (error, "pattern '%s'", pattern);
   *out_n_matches += n_pattern_matches;
 
   return TRUE;
 }
 
+/* Whether any of @sorted_paths is @pattern, or under it */
+static gboolean
+pattern_matches_any (GPtrArray *sorted_paths, const char *pattern)
+{
+  g_autoptr (GString) dir = g_string_new ("/");
+  g_string_append (dir, pattern);
+  while (dir->len > 1 && dir->str[dir->len - 1] == '/')
+    g_string_truncate (dir, dir->len - 1);
+
+  /* Check for the path itself, then anything under it */
+  for (guint attempt = 0; attempt < 2; attempt++)
+    {
+      if (attempt == 1)
+        g_string_append_c (dir, '/');
+      guint lo = 0;
+      guint hi = sorted_paths->len;
+      while (lo < hi)
+        {
+          const guint mid = lo + (hi - lo) / 2;
+          if (strcmp (static_cast<const char *> (sorted_paths->pdata[mid]), dir->str) < 0)
+            lo = mid + 1;
+          else
+            hi = mid;
+        }
+      if (lo == sorted_paths->len)
+        continue;
+      auto path = static_cast<const char *> (sorted_paths->pdata[lo]);
+      if (attempt == 0 ? g_str_equal (path, dir->str) : g_str_has_prefix (path, dir->str))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
 /* Execute a supported script.  Note that @cancellable
  * does not currently kill a running script subprocess.
  */
 gboolean
-rpmostree_script_run_sync (DnfPackage *pkg, Header hdr, RpmOstreeScriptKind kind, int rootfs_fd,
-                           GLnxTmpDir *var_lib_rpm_statedir, gboolean enable_fuse,
-                           gboolean use_kernel_install, guint *out_n_run, GCancellable *cancellable,
-                           GError **error)
+rpmostree_script_run_sync (DnfPackage *pkg, Header hdr, RpmOstreeScriptKind kind,
+                           RpmOstreeScriptRunner *runner, gboolean use_kernel_install,
+                           guint *out_n_run, GCancellable *cancellable, GError **error)
 {
-  const KnownRpmScriptKind *scriptkind;
-  switch (kind)
-    {
-    case RPMOSTREE_SCRIPT_PREIN:
-      scriptkind = &pre_script;
-      break;
-    case RPMOSTREE_SCRIPT_POSTIN:
-      scriptkind = &post_script;
-      break;
-    case RPMOSTREE_SCRIPT_POSTTRANS:
-      scriptkind = &posttrans_script;
-      break;
-    default:
-      g_assert_not_reached ();
-    }
+  g_autoptr (RpmOstreePreparedScript) prepared = NULL;
+  if (!rpmostree_script_prepare (pkg, hdr, kind, use_kernel_install, &prepared, error))
+    return FALSE;
+  if (!prepared)
+    return TRUE;
 
-  gboolean did_run = FALSE;
-  if (!run_script (scriptkind, pkg, hdr, rootfs_fd, var_lib_rpm_statedir, enable_fuse,
-                   use_kernel_install, &did_run, cancellable, error))
+  if (!rpmostree_prepared_script_run (prepared, runner, cancellable, error))
     return FALSE;
 
-  if (did_run)
-    (*out_n_run)++;
+  (*out_n_run)++;
   return TRUE;
 }
 
 /* File triggers, as used by e.g. glib2.spec and vagrant.spec in Fedora. More
  * info at <http://rpm.org/user_doc/file_triggers.html>.
+ *
+ * If @changed_files is provided (sorted absolute paths), we only run the
+ * triggers whose patterns match one of them, like librpm does for packages
+ * which were already installed.
  */
 gboolean
-rpmostree_transfiletriggers_run_sync (Header hdr, int rootfs_fd, gboolean enable_fuse,
+rpmostree_transfiletriggers_run_sync (Header hdr, RpmOstreeScriptRunner *runner,
+                                      RpmOstreeFileIndex *file_index, GPtrArray *changed_files,
                                       gboolean use_kernel_install, guint *out_n_run,
                                       GCancellable *cancellable, GError **error)
 {
+  const int rootfs_fd = runner->rootfs_fd;
   const char *pkg_name = headerGetString (hdr, RPMTAG_NAME);
   g_assert (pkg_name);
   const char *pkg_scriptid = glnx_strjoina (pkg_name, ".transfiletriggerin");
@@ -904,6 +1636,19 @@ rpmostree_transfiletriggers_run_sync (Header hdr, int rootfs_fd, gboolean enable
       if (patterns->len == 0)
         continue;
 
+      if (changed_files)
+        {
+          gboolean triggered = FALSE;
+          for (guint j = 0; j < patterns->len && !triggered; j++)
+            triggered = pattern_matches_any (changed_files,
+                                             static_cast<const char *> (patterns->pdata[j]));
+          if (!triggered)
+            {
+              g_debug ("Skipping %%transfiletriggerin for %s; no changed files matched", pkg_name);
+              continue;
+            }
+        }
+
       /* Build up the list of files matching the patterns. librpm uses a pipe and
        * doesn't do async writes, and hence is subject to deadlock. We could use
        * a pipe and do async, but an O_TMPFILE is easier for now. There
@@ -929,8 +1674,8 @@ rpmostree_transfiletriggers_run_sync (Header hdr, int rootfs_fd, gboolean enable
           if (j > 0)
             g_string_append (patterns_joined, ", ");
           g_string_append (patterns_joined, pattern);
-          if (!find_and_write_matching_files (rootfs_fd, pattern, tmpf_file, &n_matched,
-                                              cancellable, error))
+          if (!find_and_write_matching_files (rootfs_fd, file_index, pattern, tmpf_file,
+                                              &n_matched, cancellable, error))
             return FALSE;
           if (n_matched == 0)
             {
@@ -953,9 +1698,8 @@ rpmostree_transfiletriggers_run_sync (Header hdr, int rootfs_fd, gboolean enable
 
       /* Run it, and log the result */
       guint64 start_time_ms = g_get_monotonic_time () / 1000;
-      if (!rpmostree_run_script_in_bwrap_container (rootfs_fd, NULL, enable_fuse, pkg_name,
-                                                    "%transfiletriggerin", interp, script, NULL,
-                                                    fileno (tmpf_file), cancellable, error))
+      if (!rpmostree_script_runner_run (runner, pkg_name, "%transfiletriggerin", interp, script,
+                                        NULL, fileno (tmpf_file), cancellable, error))
         return FALSE;
       guint64 end_time_ms = g_get_monotonic_time () / 1000;
       guint64 elapsed_ms = end_time_ms - start_time_ms;
@@ -44,12 +44,52 @@ typedef enum
 gboolean rpmostree_script_txn_validate (DnfPackage *package, Header hdr, bool use_kernel_install,
                                         GCancellable *cancellable, GError **error);
 
+typedef struct RpmOstreeScriptRunner RpmOstreeScriptRunner;
+
+RpmOstreeScriptRunner *rpmostree_script_runner_new (int rootfs_fd,
+                                                    GLnxTmpDir *var_lib_rpm_statedir,
+                                                    gboolean enable_rofiles);
+
+void rpmostree_script_runner_free (RpmOstreeScriptRunner *runner);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (RpmOstreeScriptRunner, rpmostree_script_runner_free)
+
+void rpmostree_script_runner_set_output (RpmOstreeScriptRunner *runner, GString *output);
+
+gboolean rpmostree_script_runner_run (RpmOstreeScriptRunner *runner, const char *name,
+                                      const char *scriptdesc, const char *interp,
+                                      const char *script, const char *script_arg, int stdin_fd,
+                                      GCancellable *cancellable, GError **error);
+
 gboolean rpmostree_script_run_sync (DnfPackage *pkg, Header hdr, RpmOstreeScriptKind kind,
-                                    int rootfs_fd, GLnxTmpDir *var_lib_rpm_statedir,
-                                    gboolean enable_rofiles, gboolean use_kernel_install,
+                                    RpmOstreeScriptRunner *runner, gboolean use_kernel_install,
                                     guint *out_n_run, GCancellable *cancellable, GError **error);
 
-gboolean rpmostree_transfiletriggers_run_sync (Header hdr, int rootfs_fd, gboolean enable_rofiles,
+typedef struct RpmOstreePreparedScript RpmOstreePreparedScript;
+
+void rpmostree_prepared_script_free (RpmOstreePreparedScript *prepared);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (RpmOstreePreparedScript, rpmostree_prepared_script_free)
+
+gboolean rpmostree_script_prepare (DnfPackage *pkg, Header hdr, RpmOstreeScriptKind kind,
+                                   gboolean use_kernel_install,
+                                   RpmOstreePreparedScript **out_prepared, GError **error);
+
+gboolean rpmostree_prepared_script_run (RpmOstreePreparedScript *prepared,
+                                        RpmOstreeScriptRunner *runner, GCancellable *cancellable,
+                                        GError **error);
+
+typedef struct RpmOstreeFileIndex RpmOstreeFileIndex;
+
+RpmOstreeFileIndex *rpmostree_file_index_new (int rootfs_fd);
+
+void rpmostree_file_index_free (RpmOstreeFileIndex *index);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (RpmOstreeFileIndex, rpmostree_file_index_free)
+
+gboolean rpmostree_transfiletriggers_run_sync (Header hdr, RpmOstreeScriptRunner *runner,
+                                               RpmOstreeFileIndex *file_index,
+                                               GPtrArray *changed_files,
                                                gboolean use_kernel_install, guint *out_n_run,
                                                GCancellable *cancellable, GError **error);
 
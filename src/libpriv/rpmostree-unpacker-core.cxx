@@ -37,6 +37,8 @@
 #include <rpm/rpmts.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 
 /**
  * throw_libarchive_error:
@@ -65,17 +67,10 @@ throw_libarchive_error (struct archive *ar, GError **error, char const *prefix)
 
 typedef int (*archive_setup_func) (struct archive *);
 
-/**
- * rpmostree_unpack_rpm2cpio:
- * @fd: An open file descriptor for an RPM package
- * @error: GError
- *
- * Parse CPIO content of @fd via libarchive.  Note that the CPIO data
- * does not capture all relevant filesystem content; for example,
- * filesystem capabilities are part of a separate header, etc.
- */
-struct archive *
-rpmostree_unpack_rpm2cpio (int fd, GError **error)
+/* If @decompress_only is set, the archive yields the uncompressed cpio
+ * stream as a single "raw" entry rather than parsing it. */
+static struct archive *
+new_rpm2cpio_archive (gboolean decompress_only, GError **error)
 {
   g_autoptr (archive) ar = archive_read_new ();
   if (ar == NULL)
@@ -91,7 +86,7 @@ rpmostree_unpack_rpm2cpio (int fd, GError **error)
 #ifdef HAVE_LIBARCHIVE_ZSTD
             archive_read_support_filter_zstd,
 #endif
-            archive_read_support_format_cpio };
+            decompress_only ? archive_read_support_format_raw : archive_read_support_format_cpio };
 
     for (guint i = 0; i < G_N_ELEMENTS (archive_setup_funcs); i++)
       {
@@ -100,8 +95,283 @@ rpmostree_unpack_rpm2cpio (int fd, GError **error)
       }
   }
 
-  if (archive_read_open_fd (ar, fd, 10240) != ARCHIVE_OK)
+  return util::move_nullify (ar);
+}
+
+#define RPM2CPIO_MIN_BUFSIZE (64 * 1024)
+#define RPM2CPIO_MAX_BUFSIZE (4 * 1024 * 1024)
+
+/* Pick a read buffer size for a package of @size bytes (0 if unknown) */
+static gsize
+rpm2cpio_read_bufsize (guint64 size)
+{
+  if (size == 0)
+    return RPM2CPIO_MAX_BUFSIZE / 4;
+  const gsize pagesize = sysconf (_SC_PAGESIZE);
+  gsize bufsize = ((size + pagesize - 1) / pagesize) * pagesize;
+  return CLAMP (bufsize, RPM2CPIO_MIN_BUFSIZE, RPM2CPIO_MAX_BUFSIZE);
+}
+
+/* libarchive client state for a local package, either mmap()ed or read
+ * in large page-aligned chunks. */
+typedef struct
+{
+  int fd; /* Borrowed */
+  GMappedFile *map;
+  gboolean map_consumed;
+  guint8 *buf;
+  gsize bufsize;
+  RpmOstreeUnpackStats *stats;
+} Rpm2cpioSource;
+
+static la_ssize_t
+rpm2cpio_source_read_cb (struct archive *ar, void *client_data, const void **buffer)
+{
+  auto src = static_cast<Rpm2cpioSource *> (client_data);
+  if (src->map)
+    {
+      if (src->map_consumed)
+        return 0;
+      src->map_consumed = TRUE;
+      *buffer = g_mapped_file_get_contents (src->map);
+      gsize len = g_mapped_file_get_length (src->map);
+      if (src->stats)
+        src->stats->n_bytes += len;
+      return len;
+    }
+
+  ssize_t n = TEMP_FAILURE_RETRY (read (src->fd, src->buf, src->bufsize));
+  if (n < 0)
+    {
+      archive_set_error (ar, errno, "Reading package: %s", g_strerror (errno));
+      return -1;
+    }
+  if (src->stats)
+    {
+      src->stats->n_syscalls++;
+      src->stats->n_bytes += n;
+    }
+  *buffer = src->buf;
+  return n;
+}
+
+static int
+rpm2cpio_source_close_cb (struct archive *ar, void *client_data)
+{
+  auto src = static_cast<Rpm2cpioSource *> (client_data);
+  g_clear_pointer (&src->map, g_mapped_file_unref);
+  free (src->buf);
+  g_free (src);
+  return ARCHIVE_OK;
+}
+
+/* For large packages, we decompress the payload in a separate thread and
+ * feed the uncompressed cpio stream to the importer over a socket, so that
+ * decompression overlaps with checksumming and writing objects.  For small
+ * packages this isn't worth it; we already import several in parallel. */
+#define RPM2CPIO_PIPELINE_MIN_SIZE (16 * 1024 * 1024)
+
+typedef struct
+{
+  struct archive *decompressor;
+  int sock;              /* Our end */
+  int decompressor_sock; /* Taken by the thread */
+  GThread *thread;
+  GError *error; /* Set by the decompressor thread */
+  guint8 *buf;
+  gsize bufsize;
+} Rpm2cpioPipeline;
+
+static gpointer
+rpm2cpio_pipeline_decompress_thread (gpointer data)
+{
+  auto pipeline = static_cast<Rpm2cpioPipeline *> (data);
+  struct archive *ar = pipeline->decompressor;
+  glnx_autofd int sock = glnx_steal_fd (&pipeline->decompressor_sock);
+
+  struct archive_entry *entry;
+  if (archive_read_next_header (ar, &entry) != ARCHIVE_OK)
+    return throw_libarchive_error (ar, &pipeline->error, "Decompressing payload");
+
+  while (TRUE)
+    {
+      const void *buf;
+      size_t size;
+      la_int64_t offset;
+      int r = archive_read_data_block (ar, &buf, &size, &offset);
+      if (r == ARCHIVE_EOF)
+        break;
+      if (r < ARCHIVE_WARN)
+        return throw_libarchive_error (ar, &pipeline->error, "Decompressing payload");
+
+      const guint8 *p = (const guint8 *)buf;
+      while (size > 0)
+        {
+          ssize_t n = TEMP_FAILURE_RETRY (send (sock, p, size, MSG_NOSIGNAL));
+          if (n < 0)
+            {
+              /* EPIPE means the reader went away, e.g. it hit an error of its own */
+              if (errno != EPIPE)
+                glnx_throw_errno_prefix (&pipeline->error, "send");
+              return NULL;
+            }
+          p += n;
+          size -= n;
+        }
+    }
+
+  return NULL;
+}
+
+static void
+rpm2cpio_pipeline_join (Rpm2cpioPipeline *pipeline)
+{
+  if (pipeline->thread)
+    (void)g_thread_join (util::move_nullify (pipeline->thread));
+}
+
+static la_ssize_t
+rpm2cpio_pipeline_read_cb (struct archive *ar, void *client_data, const void **buffer)
+{
+  auto pipeline = static_cast<Rpm2cpioPipeline *> (client_data);
+  ssize_t n = TEMP_FAILURE_RETRY (read (pipeline->sock, pipeline->buf, pipeline->bufsize));
+  if (n < 0)
+    {
+      archive_set_error (ar, errno, "Reading payload: %s", g_strerror (errno));
+      return -1;
+    }
+  if (n == 0)
+    {
+      /* The decompressor closed its end; make sure it actually succeeded */
+      rpm2cpio_pipeline_join (pipeline);
+      if (pipeline->error)
+        {
+          archive_set_error (ar, ARCHIVE_ERRNO_MISC, "%s", pipeline->error->message);
+          return -1;
+        }
+    }
+  *buffer = pipeline->buf;
+  return n;
+}
+
+static int
+rpm2cpio_pipeline_close_cb (struct archive *ar, void *client_data)
+{
+  auto pipeline = static_cast<Rpm2cpioPipeline *> (client_data);
+  /* This unblocks the decompressor if it's still running */
+  glnx_close_fd (&pipeline->sock);
+  rpm2cpio_pipeline_join (pipeline);
+  glnx_close_fd (&pipeline->decompressor_sock);
+  if (pipeline->decompressor)
+    archive_read_free (pipeline->decompressor);
+  g_clear_error (&pipeline->error);
+  g_free (pipeline->buf);
+  g_free (pipeline);
+  return ARCHIVE_OK;
+}
+
+/* Takes ownership of @decompressor, which must be an open
+ * new_rpm2cpio_archive (TRUE) */
+static struct archive *
+new_pipelined_rpm2cpio_archive (struct archive *decompressor, gsize bufsize, GError **error)
+{
+  g_autoptr (archive) decompressor_owned = decompressor;
+  g_autoptr (archive) ar = archive_read_new ();
+  if (ar == NULL)
+    return (struct archive *)glnx_null_throw (error,
+                                              "Failed to initialize rpm2cpio archive object");
+  if (archive_read_support_format_cpio (ar) != ARCHIVE_OK)
+    return throw_libarchive_error (ar, error, "Setting up rpm2cpio");
+
+  int socks[2];
+  if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, socks) < 0)
+    return (struct archive *)glnx_null_throw_errno_prefix (error, "socketpair");
+  /* Best effort; a larger buffer means fewer context switches */
+  int sndbuf = bufsize;
+  (void)setsockopt (socks[1], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof (sndbuf));
+
+  auto pipeline = g_new0 (Rpm2cpioPipeline, 1);
+  pipeline->sock = socks[0];
+  pipeline->decompressor_sock = socks[1];
+  pipeline->decompressor = util::move_nullify (decompressor_owned);
+  pipeline->bufsize = bufsize;
+  pipeline->buf = (guint8 *)g_malloc (bufsize);
+  pipeline->thread = g_thread_new ("rpm2cpio", rpm2cpio_pipeline_decompress_thread, pipeline);
+
+  /* Note the close callback takes ownership of pipeline, even on failure */
+  if (archive_read_open (ar, pipeline, NULL, rpm2cpio_pipeline_read_cb,
+                         rpm2cpio_pipeline_close_cb)
+      != ARCHIVE_OK)
     return throw_libarchive_error (ar, error, "Reading rpm2cpio");
 
   return util::move_nullify (ar);
 }
+
+/**
+ * rpmostree_unpack_rpm2cpio:
+ * @fd: An open file descriptor for an RPM package
+ * @allow_mmap: Whether @fd may be mmap()ed
+ * @stats: (optional): Updated with I/O statistics as the archive is read
+ * @error: GError
+ *
+ * Parse CPIO content of @fd via libarchive.  Note that the CPIO data
+ * does not capture all relevant filesystem content; for example,
+ * filesystem capabilities are part of a separate header, etc.
+ *
+ * If @allow_mmap is set and @fd is a regular file positioned at the start,
+ * it is mmap()ed; otherwise it is read in large page-aligned chunks.  Only
+ * set @allow_mmap for files nobody else can write to (the dnf cache, our own
+ * downloads): if the file is truncated under us, we get SIGBUS.  Large
+ * packages are decompressed in a separate thread.
+ */
+struct archive *
+rpmostree_unpack_rpm2cpio (int fd, gboolean allow_mmap, RpmOstreeUnpackStats *stats,
+                           GError **error)
+{
+  struct stat stbuf;
+  if (!glnx_fstat (fd, &stbuf, error))
+    return NULL;
+  const gboolean is_reg = S_ISREG (stbuf.st_mode);
+  const gboolean pipelined = is_reg && stbuf.st_size >= RPM2CPIO_PIPELINE_MIN_SIZE;
+
+  g_autoptr (archive) ar = new_rpm2cpio_archive (pipelined, error);
+  if (ar == NULL)
+    return NULL;
+
+  auto src = g_new0 (Rpm2cpioSource, 1);
+  src->fd = fd;
+  src->stats = stats;
+  src->bufsize = rpm2cpio_read_bufsize (is_reg ? stbuf.st_size : 0);
+
+  if (allow_mmap && is_reg && stbuf.st_size > 0 && lseek (fd, 0, SEEK_CUR) == 0)
+    {
+      /* If this fails (e.g. the filesystem doesn't support it), just fall back to read() */
+      src->map = g_mapped_file_new_from_fd (fd, FALSE, NULL);
+      if (src->map)
+        {
+          (void)madvise (g_mapped_file_get_contents (src->map), g_mapped_file_get_length (src->map),
+                         MADV_SEQUENTIAL);
+          if (stats)
+            {
+              stats->mmapped = TRUE;
+              stats->n_syscalls++;
+            }
+        }
+    }
+  if (!src->map)
+    {
+      if (posix_memalign ((void **)&src->buf, sysconf (_SC_PAGESIZE), src->bufsize) != 0)
+        g_error ("Failed to allocate %" G_GSIZE_FORMAT " byte buffer", src->bufsize);
+    }
+
+  /* Note the close callback takes ownership of src, even on failure */
+  if (archive_read_open (ar, src, NULL, rpm2cpio_source_read_cb, rpm2cpio_source_close_cb)
+      != ARCHIVE_OK)
+    return throw_libarchive_error (ar, error, "Reading rpm2cpio");
+
+  if (pipelined)
+    return new_pipelined_rpm2cpio_archive (util::move_nullify (ar), RPM2CPIO_MAX_BUFSIZE / 4,
+                                           error);
+
+  return util::move_nullify (ar);
+}
@@ -32,6 +32,16 @@ G_BEGIN_DECLS
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (archive, archive_read_free);
 
-struct archive *rpmostree_unpack_rpm2cpio (int fd, GError **error);
+typedef struct
+{
+  guint64 n_bytes;    /* Package bytes handed to libarchive */
+  guint64 n_syscalls; /* read() or mmap() calls made to get them */
+  gboolean mmapped;   /* Whether the package was mmap()ed */
+  guint64 elapsed_us; /* Wall-clock time spent importing */
+  guint64 n_deduped;  /* Files found in the digest index */
+} RpmOstreeUnpackStats;
+
+struct archive *rpmostree_unpack_rpm2cpio (int fd, gboolean allow_mmap,
+                                           RpmOstreeUnpackStats *stats, GError **error);
 
 G_END_DECLS
\ No newline at end of file
@@ -207,3 +207,19 @@ if test -f extensions-changed; then
   fatal "found extensions-changed"
 fi
 echo "ok extensions no change"
+
+# Rerunning into an output dir that has other copies of the same RPMs: an
+# identical one is kept, anything else is replaced
+solitaire_rpm=$(ls extensions/solitaire-1.0-*.rpm)
+cp --remove-destination ${solitaire_rpm} solitaire.rpm
+cp solitaire.rpm ${solitaire_rpm}
+dodo_rpm=$(ls extensions/dodo-1.0-*.rpm)
+rm ${dodo_rpm}
+echo garbage > ${dodo_rpm}
+runasroot rpm-ostree compose extensions --repo=${repo} \
+  --cachedir=${test_tmpdir}/cache \
+  --output-dir extensions ${treefile} extensions.yaml
+cmp solitaire.rpm ${solitaire_rpm}
+rpm -qp ${dodo_rpm} > out.txt
+assert_file_has_content out.txt dodo-1.0
+echo "ok extensions rerun into non-empty output dir"
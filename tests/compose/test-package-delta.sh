@@ -0,0 +1,34 @@
+#!/bin/bash
+set -xeuo pipefail
+
+dn=$(cd "$(dirname "$0")" && pwd)
+# shellcheck source=libcomposetest.sh
+. "${dn}/libcomposetest.sh"
+
+build_rpm deltapkg version 1.0
+build_rpm deltaold
+
+echo gpgcheck=0 >> yumrepo.repo
+ln "$PWD/yumrepo.repo" config/yumrepo.repo
+treefile_append "repos" '["test-repo"]'
+treefile_append "packages" '["deltapkg", "deltaold"]'
+
+runcompose > log.txt
+assert_not_file_has_content_literal log.txt 'since previous commit'
+echo "ok no delta on first compose"
+
+# Bump one package, swap another out for a new one
+build_rpm deltapkg version 2.0
+build_rpm deltanew
+treefile_remove "packages" '"deltaold"'
+treefile_append "packages" '["deltanew"]'
+runcompose > log.txt
+assert_file_has_content_literal log.txt \
+  'Package changes since previous commit: 1 upgraded, 1 removed, 1 added'
+echo "ok package delta"
+
+# And with only a change to the treefile, the package set is the same
+treefile_set "documentation" "False"
+runcompose > log.txt
+assert_file_has_content_literal log.txt 'No package changes since previous commit'
+echo "ok no package delta"
@@ -0,0 +1,46 @@
+#!/bin/bash
+set -xeuo pipefail
+
+dn=$(cd "$(dirname "$0")" && pwd)
+# shellcheck source=libcomposetest.sh
+. "${dn}/libcomposetest.sh"
+
+# postdep's %post is slow; postuser requires it, so must wait for it.
+# postother is independent and can run concurrently with both.
+build_rpm postdep \
+          post "sleep 2; echo postdep-post; echo done > /etc/postdep.txt"
+build_rpm postuser requires postdep \
+          post "test -f /etc/postdep.txt; echo postuser-post; echo done > /etc/postuser.txt"
+build_rpm postother \
+          post "echo postother-post; echo done > /etc/postother.txt"
+
+echo gpgcheck=0 >> yumrepo.repo
+ln "$PWD/yumrepo.repo" config/yumrepo.repo
+treefile_append "repos" '["test-repo"]'
+treefile_append "packages" '["postdep", "postuser", "postother"]'
+treefile_set "parallel-post-scripts" "True"
+
+runcompose > log.txt
+for pkg in postdep postuser postother; do
+  assert_file_has_content_literal log.txt "${pkg}.post: ${pkg}-post"
+  ostree --repo=${repo} cat ${treeref} /usr/etc/${pkg}.txt > out.txt
+  assert_file_has_content_literal out.txt done
+done
+echo "ok parallel post scripts"
+
+# Output is still printed in transaction order
+dep_line=$(grep -n '^postdep\.post:' log.txt | cut -d: -f1)
+user_line=$(grep -n '^postuser\.post:' log.txt | cut -d: -f1)
+test "${dep_line}" -lt "${user_line}"
+echo "ok parallel post scripts output order"
+
+# A failing script fails the compose, and its output is shown
+build_rpm postfail \
+          post "echo postfail-post; exit 1"
+treefile_append "packages" '["postfail"]'
+if runcompose &> err.txt; then
+  fatal "compose unexpectedly succeeded"
+fi
+assert_file_has_content_literal err.txt 'postfail.post: postfail-post'
+assert_file_has_content err.txt 'Running %post for postfail'
+echo "ok parallel post scripts failure"
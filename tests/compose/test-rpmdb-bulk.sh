@@ -0,0 +1,49 @@
+#!/bin/bash
+set -xeuo pipefail
+
+dn=$(cd "$(dirname "$0")" && pwd)
+# shellcheck source=libcomposetest.sh
+. "${dn}/libcomposetest.sh"
+
+# Compose writes a fresh rpmdb by importing the headers directly rather than
+# running an rpm transaction; verify the result is the same as what librpm
+# would have written.
+build_rpm langpkg \
+          files "%lang(fr) /usr/share/langpkg/fr.txt
+                 %lang(de) /usr/share/langpkg/de.txt" \
+          install "mkdir -p %{buildroot}/usr/share/langpkg
+                   echo bonjour > %{buildroot}/usr/share/langpkg/fr.txt
+                   echo hallo > %{buildroot}/usr/share/langpkg/de.txt"
+
+echo gpgcheck=0 >> yumrepo.repo
+ln "$PWD/yumrepo.repo" config/yumrepo.repo
+treefile_append "repos" '["test-repo"]'
+treefile_append "packages" '["langpkg"]'
+
+dump_rpmdb() {
+  rm -rf db
+  ostree --repo=${repo} checkout -U --subpath=/usr/share/rpm ${treeref} db
+  rpm --dbpath="$PWD/db" -qa \
+    --qf '%{NEVRA} %{INSTALLCOLOR} %{INSTPREFIXES}\n[%{NEVRA} %{FILENAMES} %{FILESTATES:fstate}\n]' \
+    | sort > "$1"
+}
+
+runcompose
+dump_rpmdb bulk.txt
+RPMOSTREE_RPMDB_FULL_TRANSACTION=1 runcompose --force-nocache
+dump_rpmdb txn.txt
+diff -u txn.txt bulk.txt
+assert_file_has_content_literal bulk.txt 'langpkg-1.0-1.x86_64 /usr/share/langpkg/de.txt normal'
+echo "ok rpmdb matches transaction"
+
+# With install-langs, librpm marks the other languages as not installed;
+# the bulk path must not claim they're there
+treefile_set "install-langs" '["fr"]'
+runcompose
+dump_rpmdb bulk.txt
+RPMOSTREE_RPMDB_FULL_TRANSACTION=1 runcompose --force-nocache
+dump_rpmdb txn.txt
+diff -u txn.txt bulk.txt
+assert_file_has_content_literal bulk.txt 'langpkg-1.0-1.x86_64 /usr/share/langpkg/fr.txt normal'
+assert_file_has_content_literal bulk.txt 'langpkg-1.0-1.x86_64 /usr/share/langpkg/de.txt not installed'
+echo "ok rpmdb matches transaction with install-langs"
@@ -0,0 +1,40 @@
+#!/bin/bash
+set -xeuo pipefail
+
+dn=$(cd "$(dirname "$0")" && pwd)
+# shellcheck source=libcomposetest.sh
+. "${dn}/libcomposetest.sh"
+
+# By default the regular files of the rootfs are written in parallel before
+# the serial commit walk; verify that gives the same tree as the walk alone.
+build_rpm serialpkg \
+          files "/usr/share/serialpkg/a.txt
+                 /usr/share/serialpkg/b.txt
+                 /usr/bin/serialpkg" \
+          install "mkdir -p %{buildroot}/usr/share/serialpkg %{buildroot}/usr/bin
+                   echo a > %{buildroot}/usr/share/serialpkg/a.txt
+                   echo b > %{buildroot}/usr/share/serialpkg/b.txt
+                   ln %{buildroot}/usr/share/serialpkg/a.txt %{buildroot}/usr/bin/serialpkg"
+
+echo gpgcheck=0 >> yumrepo.repo
+ln "$PWD/yumrepo.repo" config/yumrepo.repo
+treefile_append "repos" '["test-repo"]'
+treefile_append "packages" '["serialpkg"]'
+
+# Compare the whole tree, except for the rpmdb which isn't reproducible
+# between composes; that also means ignoring the checksums of directories,
+# but every file below them is still compared.
+list_tree() {
+  ostree --repo=${repo} ls -RXC ${treeref} / \
+    | grep -vE ' /usr/(share/rpm|lib/sysimage/rpm-ostree-base-db)(/|$)' \
+    | awk '/^d/ { $5 = ""; $6 = "" } { print }'
+}
+
+runcompose
+list_tree > parallel.txt
+RPMOSTREE_COMPOSE_SERIAL_COMMIT=1 runcompose --force-nocache
+list_tree > serial.txt
+diff -u serial.txt parallel.txt
+assert_file_has_content parallel.txt 'serialpkg/a.txt$'
+ostree --repo=${repo} fsck
+echo "ok parallel commit matches serial commit"
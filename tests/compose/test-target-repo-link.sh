@@ -0,0 +1,26 @@
+#!/bin/bash
+set -xeuo pipefail
+
+dn=$(cd "$(dirname "$0")" && pwd)
+# shellcheck source=libcomposetest.sh
+. "${dn}/libcomposetest.sh"
+
+# The test repo is bare-user like the build repo, and the cachedir is on the
+# same filesystem, so objects get linked over rather than pulled.
+runcompose > log.txt
+assert_file_has_content log.txt 'Linked [0-9]*/[0-9]* objects into target repo'
+ostree --repo=${repo} fsck ${treeref}
+ostree --repo=${repo} ls ${treeref} /usr/bin/bash > /dev/null
+echo "ok link into target repo"
+
+# Linking again is a no-op for the objects already there
+runcompose --force-nocache > log.txt
+assert_file_has_content log.txt 'Linked [0-9]*/[0-9]* objects into target repo'
+ostree --repo=${repo} fsck ${treeref}
+echo "ok link into target repo again"
+
+RPMOSTREE_COMPOSE_FULL_PULL_LOCAL=1 runcompose --force-nocache > log.txt
+assert_not_file_has_content log.txt 'objects into target repo'
+ostree --repo=${repo} fsck ${treeref}
+ostree --repo=${repo} ls ${treeref} /usr/bin/bash > /dev/null
+echo "ok full pull-local"